@@ -1,11 +1,55 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "pamu.h"
 
 #include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+// Tracepoints, USDT probes when available + the user's hook
+#ifdef PAMU_TRACE
+#include <time.h>
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PAMU_USDT(name, fd, addr, size, walk) DTRACE_PROBE4(pamu, name, fd, addr, size, walk)
+#endif
+#endif
+#ifndef PAMU_USDT
+#define PAMU_USDT(name, fd, addr, size, walk)
+#endif
+#define PAMU_PROBE_ENTRY(name, type, fd, addr, size) \
+  struct timespec _pamu_trace_start;                 \
+  _pamu_trace_walk = 0;                              \
+  clock_gettime(CLOCK_MONOTONIC, &_pamu_trace_start); \
+  PAMU_USDT(name, fd, addr, size, 0);                \
+  _pamu_trace_emit(type, fd, addr, size, NULL)
+#define PAMU_PROBE_EXIT(name, type, fd, addr, size)  \
+  PAMU_USDT(name, fd, addr, size, _pamu_trace_walk); \
+  _pamu_trace_emit(type, fd, addr, size, &_pamu_trace_start)
+#define PAMU_PROBE(name, type, fd, addr, size)       \
+  PAMU_USDT(name, fd, addr, size, _pamu_trace_walk); \
+  _pamu_trace_emit(type, fd, addr, size, NULL)
+#define PAMU_PROBE_WALK() _pamu_trace_walk++
+#else
+#define PAMU_PROBE_ENTRY(name, type, fd, addr, size)
+#define PAMU_PROBE_EXIT(name, type, fd, addr, size)
+#define PAMU_PROBE(name, type, fd, addr, size)
+#define PAMU_PROBE_WALK()
+#endif
+
 /* * * * * * * * * * * * * * * * * * * * * * * * *\
  * CAUTION                                       *
  * * * * * * * * * * * * * * * * * * * * * * * * *
@@ -16,11 +60,50 @@
 #define  PAMU_KEYWORD         "PAMU"
 #define  PAMU_KEYWORD_LEN     4
 
-#define  PAMU_INTERNAL_FLAG_FREE  ((PAMU_T_MARKER)1<<((8*PAMU_T_MARKER_SIZE)-1))
+#define  PAMU_ROOT_OFFSET     (PAMU_KEYWORD_LEN + sizeof(uint32_t))
+#define  PAMU_ROOT_ENTRY      (PAMU_ROOT_NAME_LEN + PAMU_T_POINTER_SIZE)
+#define  PAMU_ROOT_SIZE(f)    (((f) & PAMU_ROOTS) ? (PAMU_ROOT_SLOTS * PAMU_ROOT_ENTRY) : 0)
+
+#define  PAMU_POOL_SIZE(f)    (((f) & PAMU_POOL) ? 8 : 0) // Record size, reserved
+#define  PAMU_CLEAN_SIZE(f)   (((f) & PAMU_CLEAN) ? 16 : 0) // State snapshot, it's length
+#define  PAMU_POOL_CHUNK      4096 // Records per chunk, led by their bitmap
+#define  PAMU_POOL_BITMAP     (PAMU_POOL_CHUNK / 8)
+#define  PAMU_POOL_WORDS      (PAMU_POOL_CHUNK / 64)
+
+#define  PAMU_JOURNAL_KEYWORD        "PAMJ"
+#define  PAMU_JOURNAL_RECORD_HEADER  32   // Keyword, length, sequence, medium size, checksum
+#define  PAMU_JOURNAL_ENTRY_HEADER   12   // Address, length
+#define  PAMU_JOURNAL_OP_RESERVE     1024 // Upper bound of a single alloc/free
+
+#define  PAMU_CLEAN_KEYWORD   "PAMS"
+#define  PAMU_CLEAN_HEADER    48 // Keyword, contents, medium size, counts, checksum
+#define  PAMU_CLEAN_INDEX     1  // Free block index
+#define  PAMU_CLEAN_DEDUP     2  // Deduplication table
+#define  PAMU_CLEAN_SETTLED   4  // No lazily freed blocks left
+
+#define  PAMU_NEAR_WINDOW  64 // Free blocks to look at on either side of a hint
+
+#define  PAMU_CACHE_PAGE   4096
+
+#define  PAMU_BULK_BUFFER  (1024*1024)
+
+#define  PAMU_EXPORT_KEYWORD  "PAMX"
+#define  PAMU_EXPORT_DIRECT   4096 // Blobs from this size are copied by the kernel
+
+#define  PAMU_PUNCH_ALIGN  4096
+
+#define  PAMU_FRAME_SIZE   8  // Logical length, packed length
+#define  PAMU_TRAILER_SIZE 16 // Content hash, references, logical length
+#define  PAMU_LZ_BITS      12 // Hash table of 4096 recent positions
+#define  PAMU_LZ_MIN       4  // Shortest match worth encoding
+
+#define  PAMU_INTERNAL_FLAG_FREE  ((PAMU_T_MARKER)((uint64_t)1<<((8*PAMU_T_MARKER_SIZE)-1)))
 #define  PAMU_INTERNAL_FLAG_ERR   ((PAMU_T_MARKER)1<<((8*PAMU_T_MARKER_SIZE)-2))
-#define  PAMU_INTERNAL_FLAGS      (PAMU_INTERNAL_FLAG_FREE)
+#define  PAMU_INTERNAL_FLAG_PENDING ((PAMU_T_MARKER)1<<((8*PAMU_T_MARKER_SIZE)-3))
+#define  PAMU_INTERNAL_FLAGS      (PAMU_INTERNAL_FLAG_FREE|PAMU_INTERNAL_FLAG_PENDING)
 
 #define MAX(a,b) ((a)>(b)?(a):(b))
+#define MIN(a,b) ((a)<(b)?(a):(b))
 
 // Overloaded ntoh & hton
 int64_t ntoh_i64(int64_t v) {
@@ -56,531 +139,4313 @@ struct pamu_medium_stat {
   PAMU_T_MARKER mediumSize;
 };
 
-// Uses outer address
-// Returns inner size in bytes
-PAMU_T_MARKER _pamu_find_sizeFlags(int fd, PAMU_T_POINTER addr) {
-  PAMU_T_MARKER beSize;
+// Pending in-place write, data lives in the state's arena
+struct pamu_journal_entry {
+  int64_t  addr;
+  uint32_t len;
+  uint32_t off;
+};
 
-  // Go to the requested address
-  PAMU_T_POINTER _addr = lseek(fd, addr, SEEK_SET);
-  if (addr != _addr) {
-    return PAMU_ERR_READ_MALFORMED;
-  }
+struct pamu_range {
+  int64_t start;
+  int64_t end;
+};
 
-  // Read the size|flags
-  ssize_t rc = read(fd, &beSize, PAMU_T_MARKER_SIZE);
-  if (rc != PAMU_T_MARKER_SIZE) {
-    return PAMU_ERR_READ_MALFORMED;
+// Byte range of the file modified during a checkpoint
+struct pamu_change {
+  int64_t  start;
+  int64_t  end;
+  uint64_t seq;
+};
+
+// Outer address & inner size of a free block
+struct pamu_free_block {
+  int64_t addr;
+  int64_t size;
+};
+
+struct pamu_group {
+  uint64_t group;
+  int64_t  addr;
+};
+
+// Deduplicated blob by content hash, addr 0 = removed
+struct pamu_dedup {
+  uint64_t hash;
+  int64_t  addr;
+};
+
+struct pamu_cache_page {
+  int64_t  addr;
+  size_t   valid;
+  int      dirty;
+  int      referenced;
+  int      hnext;
+  uint8_t  dirtyBits[PAMU_CACHE_PAGE / 8];
+  char     data[PAMU_CACHE_PAGE];
+};
+
+// In-memory state for media which need it (journaled, ...)
+struct pamu_state {
+  struct pamu_state *next;
+  int      fd;
+  dev_t    dev;
+  ino_t    ino;
+  uint32_t flags;
+  uint32_t headerSize;
+
+  // Logical medium size, including pending writes
+  int64_t  mediumSize;
+  int64_t  committedSize;
+
+  // Journal slots & current group
+  int64_t  journalOffset;
+  uint32_t journalSlotSize;
+  uint64_t journalSeq;
+  int      journalUnsynced;
+  size_t   journalUsed;
+  struct pamu_journal_entry *entries;
+  size_t   entryCount;
+  size_t   entryLimit;
+  char    *arena;
+  size_t   arenaUsed;
+  size_t   arenaLimit;
+
+  // Transaction savepoint, blobs allocated & blocks freed within it
+  int      txn;
+  size_t   txnEntryCount;
+  size_t   txnArenaUsed;
+  size_t   txnJournalUsed;
+  int64_t  txnMediumSize;
+  struct pamu_journal_entry *txnEntries;
+  struct pamu_range         *txnFresh;
+  size_t   txnFreshCount;
+  size_t   txnFreshLimit;
+  struct pamu_range         *txnFreed;
+  size_t   txnFreedCount;
+  size_t   txnFreedLimit;
+
+  // Metadata of the last commit that became blob space within the group
+  struct pamu_range         *guards;
+  size_t   guardCount;
+  size_t   guardLimit;
+
+  // Address-ordered index of free blocks, built on first use
+  int      indexBuilt;
+  struct pamu_free_block *index;
+  size_t   indexCount;
+  size_t   indexLimit;
+
+  // Last allocation of each group, open addressing
+  struct pamu_group *groups;
+  size_t   groupCount;
+  size_t   groupLimit;
+
+  // Metadata page cache, chained hash of page addresses
+  struct pamu_cache_page *cache;
+  size_t   cacheCount;
+  size_t   cacheLimit;
+  size_t   cacheHand;
+  int     *cacheBuckets;
+  size_t   cacheBucketCount;
+
+  // Lazily freed blocks awaiting coalescing, found by a scan on first use
+  int      pendingScanned;
+  int64_t *pending;
+  uint64_t *pendingEpochs; // Epoch each block was freed in
+  size_t   pendingCount;
+  size_t   pendingLimit;
+
+  // Free blocks of at least punchSize get their interior released
+  PAMU_T_MARKER punchSize;
+  struct pamu_free_block *punches;
+  size_t   punchCount;
+  size_t   punchLimit;
+
+  // Concurrent readers, each slot holds the epoch it's pinned at, 0 = idle
+  _Atomic uint64_t  epoch;
+  _Atomic uint64_t *readers;
+  size_t            readerLimit;
+  _Atomic int64_t   readerSize;  // Medium size readers may walk up to
+
+  // Deduplicated blobs by content hash, open addressing, found by a scan on
+  // first use
+  int      dedupScanned;
+  struct pamu_dedup *dedup;
+  size_t   dedupCount; // Including removed entries
+  size_t   dedupLimit;
+
+  // Fixed-size records, lowest bitmap word that may have a free slot
+  uint32_t recordSize;
+  int64_t  chunkSize;
+  int64_t  poolHint;
+
+  // Blobs of at least tierThreshold bytes live on tierFd, 0 = untiered
+  int           tierFd;
+  PAMU_T_MARKER tierThreshold;
+
+  // Ranges of the file written since the oldest live checkpoint, 0 = off
+  uint64_t changeSeq;
+  uint64_t changeFloor;
+  struct pamu_change *changes;
+  size_t   changeCount;
+  size_t   changeLimit;
+};
+
+struct pamu_state *_pamu_states = NULL;
+
+#ifdef PAMU_TRACE
+pamu_trace_hook  _pamu_trace_hook  = NULL;
+void            *_pamu_trace_udata = NULL;
+int64_t          _pamu_trace_walk  = 0;
+
+void pamu_trace(pamu_trace_hook hook, void *udata) {
+  _pamu_trace_hook  = hook;
+  _pamu_trace_udata = udata;
+}
+
+// Hands an event to the user's hook, with the time since start if given
+void _pamu_trace_emit(int type, int fd, int64_t addr, int64_t size, struct timespec *start) {
+  if (!_pamu_trace_hook) return;
+  struct pamu_trace_event event = { type, fd, addr, size, _pamu_trace_walk, 0 };
+  struct timespec now;
+  if (start) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    event.ns = ((int64_t)(now.tv_sec - start->tv_sec) * 1000000000) + (now.tv_nsec - start->tv_nsec);
   }
+  _pamu_trace_hook(&event, _pamu_trace_udata);
+}
+#endif
 
-  // And return the size without the flags
-  return ntoh(beSize);
+// Word-at-a-time 64-bit hash, endian-independent
+uint64_t _pamu_hash(const void *data, size_t len, uint64_t seed) {
+  const uint8_t *p = data;
+  uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+  uint64_t w;
+  while(len >= 8) {
+    memcpy(&w, p, 8);
+    h ^= le64toh(w) * 0x87c37b91114253d5ULL;
+    h  = ((h << 31) | (h >> 33)) * 0x4cf5ad432745937fULL;
+    p += 8;
+    len -= 8;
+  }
+  w = 0;
+  memcpy(&w, p, len);
+  h ^= le64toh(w) * 0x87c37b91114253d5ULL;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
 }
 
-PAMU_T_MARKER _pamu_find_size(int fd, PAMU_T_POINTER addr) {
-  return _pamu_find_sizeFlags(fd, addr) & (~PAMU_INTERNAL_FLAGS);
+// Emits one LZ4 sequence: literals, then a match unless it's the last one
+// Returns the new output position, 0 = didn't fit
+size_t _pamu_lz_sequence(uint8_t *dst, size_t cap, size_t out, const uint8_t *lits, size_t litLen, size_t offset, size_t matchLen) {
+  if (out + 1 + litLen + (litLen / 255) + 1 + 2 + (matchLen / 255) + 1 > cap) return 0;
+  size_t token = out++;
+  size_t n;
+  dst[token] = MIN(litLen, 15) << 4;
+  if (litLen >= 15) {
+    for(n = litLen - 15; n >= 255; n -= 255) dst[out++] = 255;
+    dst[out++] = n;
+  }
+  memcpy(dst + out, lits, litLen);
+  out += litLen;
+  if (!matchLen) return out;
+  dst[out++] = offset & 0xff;
+  dst[out++] = offset >> 8;
+  matchLen -= PAMU_LZ_MIN;
+  dst[token] |= MIN(matchLen, 15);
+  if (matchLen >= 15) {
+    for(n = matchLen - 15; n >= 255; n -= 255) dst[out++] = 255;
+    dst[out++] = n;
+  }
+  return out;
 }
 
-PAMU_T_MARKER _pamu_find_flags(int fd, PAMU_T_POINTER addr) {
-  PAMU_T_MARKER raw = _pamu_find_sizeFlags(fd, addr);
-  if (raw & PAMU_INTERNAL_FLAG_ERR) return raw;
-  return raw & PAMU_INTERNAL_FLAGS;
+// Greedy LZ4 block compression, 0 = the result didn't fit in cap
+size_t _pamu_lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+  uint32_t table[1 << PAMU_LZ_BITS] = {0}; // Position + 1 of the last 4 bytes hashing here
+  uint32_t seq, h;
+  size_t   i = 0, anchor = 0, out = 0, match, matchLen;
+  while(i + PAMU_LZ_MIN <= len) {
+    memcpy(&seq, src + i, sizeof(uint32_t));
+    h        = (seq * 2654435761U) >> (32 - PAMU_LZ_BITS);
+    match    = table[h];
+    table[h] = i + 1;
+    if ((!match) || (i + 1 - match > 65535) || memcmp(src + match - 1, src + i, PAMU_LZ_MIN)) {
+      i++;
+      continue;
+    }
+    match--;
+    matchLen = PAMU_LZ_MIN;
+    while((i + matchLen < len) && (src[match + matchLen] == src[i + matchLen])) matchLen++;
+    out = _pamu_lz_sequence(dst, cap, out, src + anchor, i - anchor, i - match, matchLen);
+    if (!out) return 0;
+    i     += matchLen;
+    anchor = i;
+  }
+  return _pamu_lz_sequence(dst, cap, out, src + anchor, len - anchor, 0, 0);
 }
 
-// Uses outer addresses
-// Returns limit = no block found
-PAMU_T_POINTER _pamu_find_free_block(int fd, PAMU_T_POINTER start, PAMU_T_POINTER limit, PAMU_T_MARKER size) {
-  PAMU_T_POINTER current = start;
-  PAMU_T_MARKER csize   = 0;
-  PAMU_T_MARKER cflags  = 0;
+// Decompresses an LZ4 block of exactly cap bytes, never reading or writing
+// outside of the buffers
+int _pamu_lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+  size_t  in = 0, out = 0, n, offset;
+  uint8_t token, b;
+  while(in < len) {
+    token = src[in++];
 
-  while(
-    current &&
-    (current < limit)
-  ) {
-    csize  = _pamu_find_size(fd, current);
-    cflags = _pamu_find_flags(fd, current);
+    // Literals
+    n = token >> 4;
+    if (n == 15) do {
+      if (in >= len) return PAMU_ERR_READ_MALFORMED;
+      b  = src[in++];
+      n += b;
+    } while(b == 255);
+    if ((n > len - in) || (n > cap - out)) return PAMU_ERR_READ_MALFORMED;
+    memcpy(dst + out, src + in, n);
+    in  += n;
+    out += n;
+    if (in == len) break; // Last sequence has no match
 
-    // Return errors
-    if (csize  < 0) return csize;  // Error = return error
-    if (cflags & (~PAMU_INTERNAL_FLAGS)) return cflags; // Error = return error
+    // Match, may overlap with it's own output
+    if (in + 2 > len) return PAMU_ERR_READ_MALFORMED;
+    offset = src[in] | (src[in + 1] << 8);
+    in    += 2;
+    if ((!offset) || (offset > out)) return PAMU_ERR_READ_MALFORMED;
+    n = token & 15;
+    if (n == 15) do {
+      if (in >= len) return PAMU_ERR_READ_MALFORMED;
+      b  = src[in++];
+      n += b;
+    } while(b == 255);
+    n += PAMU_LZ_MIN;
+    if (n > cap - out) return PAMU_ERR_READ_MALFORMED;
+    for(; n; n--, out++) dst[out] = dst[out - offset];
+  }
+  return out == cap ? 0 : PAMU_ERR_READ_MALFORMED;
+}
 
-    // If not free, go to the next entry
-    if (!(cflags & PAMU_INTERNAL_FLAG_FREE)) {
-      current += csize + (2 * PAMU_T_MARKER_SIZE);
+// Returns the state of fd, without validating it
+struct pamu_state * _pamu_state(int fd) {
+  struct pamu_state *state = _pamu_states;
+  while(state && state->fd != fd) state = state->next;
+  return state;
+}
+
+void _pamu_state_drop(int fd) {
+  struct pamu_state **ref = &_pamu_states;
+  struct pamu_state *state;
+  while(*ref) {
+    state = *ref;
+    if (state->fd != fd) {
+      ref = &state->next;
       continue;
     }
+    *ref = state->next;
+    free(state->entries);
+    free(state->arena);
+    free(state->txnEntries);
+    free(state->txnFresh);
+    free(state->txnFreed);
+    free(state->guards);
+    free(state->index);
+    free(state->groups);
+    free(state->cache);
+    free(state->cacheBuckets);
+    free(state->pending);
+    free(state->pendingEpochs);
+    free(state->punches);
+    free((void *)state->readers);
+    free(state->dedup);
+    free(state->changes);
+    free(state);
+  }
+}
 
-    // Here = free
+// Sets the size concurrent readers may walk up to
+void _pamu_publish(struct pamu_state *state, int64_t size) {
+  if (state && state->readerLimit) atomic_store(&state->readerSize, size);
+}
 
-    // If large enough: return this one
-    if (csize >= size) return current;
+// Lowest epoch any reader is pinned at, UINT64_MAX = none
+uint64_t _pamu_readers_oldest(struct pamu_state *state) {
+  uint64_t oldest = UINT64_MAX;
+  uint64_t epoch;
+  size_t   i;
+  for(i = 0; i < state->readerLimit; i++) {
+    epoch = atomic_load(&state->readers[i]);
+    if (epoch && (epoch < oldest)) oldest = epoch;
+  }
+  return oldest;
+}
 
-    // Skip to the next free block
-    if (lseek(fd, current + (2*PAMU_T_MARKER_SIZE), SEEK_SET) != current + (2*PAMU_T_MARKER_SIZE)) {
-      return PAMU_ERR_READ_MALFORMED;
+int _pamu_change_compare(const void *a, const void *b) {
+  int64_t l = ((const struct pamu_change *)a)->start;
+  int64_t r = ((const struct pamu_change *)b)->start;
+  return (l > r) - (l < r);
+}
+
+// Sorts the change log & merges overlapping ranges, keeping the newest seq,
+// which may report a range to an older checkpoint more than once but never
+// leaves one out
+void _pamu_changes_merge(struct pamu_state *state) {
+  size_t i, count = 0;
+  struct pamu_change *last = NULL;
+  qsort(state->changes, state->changeCount, sizeof(struct pamu_change), _pamu_change_compare);
+  for(i = 0; i < state->changeCount; i++) {
+    if (last && (state->changes[i].start <= last->end)) {
+      last->end = MAX(last->end, state->changes[i].end);
+      last->seq = MAX(last->seq, state->changes[i].seq);
+      continue;
     }
-    if (read(fd, &current, PAMU_T_POINTER_SIZE) != PAMU_T_POINTER_SIZE) {
-      return PAMU_ERR_READ_MALFORMED;
+    last  = &state->changes[count++];
+    *last = state->changes[i];
+  }
+  state->changeCount = count;
+}
+
+// Records a modified range of the file in the change log, if tracking
+void _pamu_track(int fd, int64_t start, int64_t end) {
+  struct pamu_state  *state = _pamu_state(fd);
+  struct pamu_change *last;
+  if (!state || !state->changeSeq || (end <= start)) return;
+
+  // Sequential writes mostly extend the previous range
+  last = state->changeCount ? &state->changes[state->changeCount - 1] : NULL;
+  if (last && (last->seq == state->changeSeq) && (start <= last->end) && (end >= last->start)) {
+    last->start = MIN(last->start, start);
+    last->end   = MAX(last->end, end);
+    return;
+  }
+
+  // Merge before growing, so the log is bound by the ranges touched
+  if (state->changeCount == state->changeLimit) {
+    _pamu_changes_merge(state);
+    if (state->changeCount >= state->changeLimit / 2) {
+      state->changeLimit = state->changeLimit ? state->changeLimit * 2 : 64;
+      state->changes     = realloc(state->changes, state->changeLimit * sizeof(struct pamu_change));
     }
   }
+  state->changes[state->changeCount++] = (struct pamu_change){ start, end, state->changeSeq };
+}
 
-  if (
-    (current == 0) &&
-    (current >= limit)
-  ) {
-    return limit;
+// Raw positional I/O on the medium, bypassing the cache & journal
+ssize_t _pamu_pread(int fd, int64_t addr, void *buf, size_t len) {
+  size_t  done = 0;
+  ssize_t rc;
+  while(done < len) {
+    rc = pread(fd, ((char*)buf) + done, len - done, addr + done);
+    if (rc <= 0) break;
+    done += rc;
+  }
+  return done;
+}
+ssize_t _pamu_pwrite(int fd, int64_t addr, const void *buf, size_t len) {
+  size_t  done = 0;
+  ssize_t rc;
+  while(done < len) {
+    rc = pwrite(fd, ((const char*)buf) + done, len - done, addr + done);
+    if (rc <= 0) return PAMU_ERR_WRITE;
+    done += rc;
   }
+  _pamu_track(fd, addr, addr + len);
+  return done;
+}
 
-  return current;
+// Truncation of the medium, tracking everything past the new end
+int _pamu_ftruncate(int fd, int64_t size) {
+  _pamu_track(fd, size, INT64_MAX);
+  return ftruncate(fd, size);
 }
 
-// Uses outer addresses
-// Reads the current's size and returns the start of the next block
-PAMU_T_POINTER _pamu_find_next(int fd, PAMU_T_POINTER current) {
-  PAMU_T_MARKER size = _pamu_find_size(fd, current);
-  return current + size + (2 * PAMU_T_MARKER_SIZE);
+// Page cache, only dirty bytes are written back as blob data may share a page
+int _pamu_cache_find(struct pamu_state *state, int64_t pageAddr) {
+  int i = state->cacheBuckets[(pageAddr / PAMU_CACHE_PAGE) % state->cacheBucketCount];
+  while((i >= 0) && (state->cache[i].addr != pageAddr)) i = state->cache[i].hnext;
+  return i;
 }
 
-// Uses outer addresses
-// Reads the previous' size and returns it's start
-PAMU_T_POINTER _pamu_find_previous(int fd, PAMU_T_POINTER current, uint32_t header_size) {
-  PAMU_T_POINTER addr = current - PAMU_T_MARKER_SIZE;
-  if (addr < header_size) return PAMU_ERR_OUT_OF_BOUNDS;
-  PAMU_T_MARKER size = _pamu_find_size(fd, addr);
-  return current - size - (2 * PAMU_T_MARKER_SIZE);
+void _pamu_cache_unlink(struct pamu_state *state, int i) {
+  int *ref = &state->cacheBuckets[(state->cache[i].addr / PAMU_CACHE_PAGE) % state->cacheBucketCount];
+  while(*ref != i) ref = &state->cache[*ref].hnext;
+  *ref = state->cache[i].hnext;
+  state->cache[i].addr  = -1;
+  state->cache[i].dirty = 0;
 }
 
-struct pamu_medium_stat * _pamu_medium_stat(int fd) {
-  struct pamu_medium_stat * response = malloc(sizeof(struct pamu_medium_stat));
+int _pamu_cache_compare(const void *a, const void *b) {
+  const struct pamu_cache_page *pa = *(const struct pamu_cache_page **)a;
+  const struct pamu_cache_page *pb = *(const struct pamu_cache_page **)b;
+  return (pa->addr > pb->addr) - (pa->addr < pb->addr);
+}
 
-  // Verify keyword in header
-  if (lseek(fd, 0, SEEK_SET)) {
-    free(response);
-    perror("lseek");
-    return (void*)PAMU_ERR_SEEK;
-  }
-  char *keyBuf = calloc(1, PAMU_KEYWORD_LEN + 1);
-  ssize_t rc = read(fd, keyBuf, PAMU_KEYWORD_LEN);
-  if (rc != PAMU_KEYWORD_LEN) {
-    free(response);
-    free(keyBuf);
-    return (void*)PAMU_ERR_READ_MALFORMED;
+// Writes all dirty pages back in address order
+int _pamu_cache_writeback(int fd, struct pamu_state *state) {
+  size_t i, count = 0;
+  struct pamu_cache_page **dirty = malloc((state->cacheCount + 1) * sizeof(struct pamu_cache_page *));
+  for(i = 0; i < state->cacheCount; i++) {
+    if (state->cache[i].dirty) dirty[count++] = &state->cache[i];
   }
-  if (strcmp(PAMU_KEYWORD, keyBuf)) {
-    free(response);
-    free(keyBuf);
-    return (void*)PAMU_ERR_MEDIUM_UNINITIALIZED;
+  qsort(dirty, count, sizeof(struct pamu_cache_page *), _pamu_cache_compare);
+
+  // Write runs of dirty bytes
+  size_t j, start;
+  struct pamu_cache_page *page;
+  for(i = 0; i < count; i++) {
+    page = dirty[i];
+    for(j = 0; j < page->valid; j++) {
+      if (!(page->dirtyBits[j / 8] & (1 << (j % 8)))) continue;
+      start = j;
+      while((j < page->valid) && (page->dirtyBits[j / 8] & (1 << (j % 8)))) j++;
+      if (_pamu_pwrite(fd, page->addr + start, page->data + start, j - start) < 0) {
+        free(dirty);
+        return PAMU_ERR_WRITE;
+      }
+    }
+    memset(page->dirtyBits, 0, sizeof(page->dirtyBits));
+    page->dirty = 0;
   }
 
-  // Read header size & flags
-  uint32_t beFlaggedSize;
-  rc = read(fd, &beFlaggedSize, sizeof(uint32_t));
-  if (rc != sizeof(uint32_t)) {
-    free(response);
-    free(keyBuf);
-    return (void*)PAMU_ERR_READ_MALFORMED;
+  free(dirty);
+  return 0;
+}
+
+// Returns the cache index of a page, loading it if needed
+int _pamu_cache_page(int fd, struct pamu_state *state, int64_t pageAddr) {
+  int i = _pamu_cache_find(state, pageAddr);
+  if (i >= 0) {
+    state->cache[i].referenced = 1;
+    return i;
   }
-  uint32_t iFlaggedHeaderSize = ntoh(beFlaggedSize);
-  response->flags      = iFlaggedHeaderSize &  PAMU_FLAGS;
-  response->headerSize = iFlaggedHeaderSize & ~PAMU_FLAGS;
 
-  // Find medium size
-  response->mediumSize = lseek(fd, 0, SEEK_END);
+  // Free slot or clock sweep, dirty victims trigger a full write-back
+  if (state->cacheCount < state->cacheLimit) {
+    i = state->cacheCount++;
+  } else {
+    while(state->cache[state->cacheHand].referenced) {
+      state->cache[state->cacheHand].referenced = 0;
+      state->cacheHand = (state->cacheHand + 1) % state->cacheLimit;
+    }
+    i = state->cacheHand;
+    state->cacheHand = (state->cacheHand + 1) % state->cacheLimit;
+    if (state->cache[i].dirty && _pamu_cache_writeback(fd, state)) return PAMU_ERR_WRITE;
+    if (state->cache[i].addr >= 0) _pamu_cache_unlink(state, i);
+  }
 
-  free(keyBuf);
-  return response;
+  struct pamu_cache_page *page = &state->cache[i];
+  memset(page->data, 0, PAMU_CACHE_PAGE);
+  memset(page->dirtyBits, 0, sizeof(page->dirtyBits));
+  page->addr       = pageAddr;
+  page->valid      = _pamu_pread(fd, pageAddr, page->data, PAMU_CACHE_PAGE);
+  page->dirty      = 0;
+  page->referenced = 1;
+  page->hnext      = state->cacheBuckets[(pageAddr / PAMU_CACHE_PAGE) % state->cacheBucketCount];
+  state->cacheBuckets[(pageAddr / PAMU_CACHE_PAGE) % state->cacheBucketCount] = i;
+  return i;
 }
 
+// Returns the number of bytes available from addr, like pread
+// A short page may be followed by data written past it, the gap reads as 0
+ssize_t _pamu_cache_read(int fd, struct pamu_state *state, int64_t addr, void *buf, size_t len) {
+  size_t  done = 0, avail = 0;
+  size_t  off, chunk, n;
+  int64_t pageAddr;
+  int     i;
+  while(done < len) {
+    pageAddr = ((addr + done) / PAMU_CACHE_PAGE) * PAMU_CACHE_PAGE;
+    off      = (addr + done) - pageAddr;
+    chunk    = MAX(0, MIN(PAMU_CACHE_PAGE - off, len - done));
+    i        = _pamu_cache_page(fd, state, pageAddr);
+    if (i < 0) return i;
+    n = (state->cache[i].valid > off) ? MIN(chunk, state->cache[i].valid - off) : 0;
+    memcpy(((char*)buf) + done, state->cache[i].data + off, n);
+    memset(((char*)buf) + done + n, 0, chunk - n);
+    if (n) avail = done + n;
+    done += chunk;
+  }
+  return avail;
+}
 
-// Open/close functionality
-int pamu_init(int fd, uint32_t flags) {
-
-  // "calculate" header size
-  uint32_t iHeaderSize =
-    PAMU_KEYWORD_LEN  + // Keyword
-    sizeof(uint32_t ) + // Headersize + flags
-    0;
+// Writes into the cache, marking the bytes dirty
+ssize_t _pamu_cache_write(int fd, struct pamu_state *state, int64_t addr, const void *buf, size_t len) {
+  size_t  done = 0;
+  size_t  off, chunk, j;
+  int64_t pageAddr;
+  int     i;
+  struct pamu_cache_page *page;
+  while(done < len) {
+    pageAddr = ((addr + done) / PAMU_CACHE_PAGE) * PAMU_CACHE_PAGE;
+    off      = (addr + done) - pageAddr;
+    chunk    = MIN(PAMU_CACHE_PAGE - off, len - done);
+    i        = _pamu_cache_page(fd, state, pageAddr);
+    if (i < 0) return i;
+    page = &state->cache[i];
+    memcpy(page->data + off, ((const char*)buf) + done, chunk);
+    for(j = off; j < off + chunk; j++) page->dirtyBits[j / 8] |= 1 << (j % 8);
+    page->valid = MAX(page->valid, off + chunk);
+    page->dirty = 1;
+    done += chunk;
+  }
+  return len;
+}
 
-  // "calculate" entry size
-  uint32_t iEntrySize =
-    PAMU_T_MARKER_SIZE + // Start size indicator
-    PAMU_T_POINTER_SIZE + // Previous free pointer in empty records
-    PAMU_T_POINTER_SIZE + // Next free pointer in empty records
-    PAMU_T_MARKER_SIZE + // End size indicator
-    0;
+// Keeps cached copies in sync with a write that bypassed the cache
+void _pamu_cache_update(struct pamu_state *state, int64_t addr, const void *buf, size_t len) {
+  if (!state || !state->cacheLimit) return;
+  size_t  done = 0;
+  size_t  off, chunk, j;
+  int64_t pageAddr;
+  int     i;
+  struct pamu_cache_page *page;
+  while(done < len) {
+    pageAddr = ((addr + done) / PAMU_CACHE_PAGE) * PAMU_CACHE_PAGE;
+    off      = (addr + done) - pageAddr;
+    chunk    = MIN(PAMU_CACHE_PAGE - off, len - done);
+    i        = _pamu_cache_find(state, pageAddr);
+    if (i >= 0) {
+      page = &state->cache[i];
+      memcpy(page->data + off, ((const char*)buf) + done, chunk);
+      for(j = off; j < off + chunk; j++) page->dirtyBits[j / 8] &= ~(1 << (j % 8));
+      page->valid = MAX(page->valid, off + chunk);
+    }
+    done += chunk;
+  }
+}
 
-  // Fetch medium size
-  PAMU_T_MARKER iMediumSize = lseek(fd, 0, SEEK_END);
+// Forgets dirty bytes within a range, optionally dropping pages past the end
+void _pamu_cache_discard(int fd, struct pamu_state *state, int64_t start, int64_t end) {
+  if (!state || !state->cacheLimit) return;
+  size_t i;
+  int64_t j, from, to;
+  ssize_t n;
+  int dirty;
+  struct pamu_cache_page *page;
+  for(i = 0; i < state->cacheCount; i++) {
+    page = &state->cache[i];
+    if (page->addr < 0) continue;
+    from = MAX(start, page->addr);
+    to   = MIN(end  , page->addr + PAMU_CACHE_PAGE);
+    if (from >= to) continue;
+    dirty = 0;
+    for(j = from - page->addr; j < to - page->addr; j++) {
+      if (page->dirtyBits[j / 8] & (1 << (j % 8))) dirty = 1;
+      page->dirtyBits[j / 8] &= ~(1 << (j % 8));
+    }
 
-  // If not dynamic: check if our header + 1 entry is going to fit
-  if (
-    (!(flags & PAMU_DYNAMIC)) &&
-    ((iHeaderSize + iEntrySize) > iMediumSize)
-  ) {
-    return PAMU_ERR_MEDIUM_SIZE;
+    // The cached copy must match the medium again
+    to = MIN(to, page->addr + (int64_t)page->valid);
+    if (!dirty || (from >= to)) continue;
+    n = _pamu_pread(fd, from, page->data + (from - page->addr), to - from);
+    if (n < 0) n = 0;
+    if (n < to - from) memset(page->data + (from - page->addr) + n, 0, (to - from) - n);
   }
+}
 
-  // Write "PAMU" keyword
-  if (lseek(fd, 0, SEEK_SET)) {
-    perror("lseek");
-    return PAMU_ERR_SEEK;
+// Cut off everything from size onwards, after a truncate
+void _pamu_cache_trim(int fd, struct pamu_state *state, int64_t size) {
+  if (!state || !state->cacheLimit) return;
+  _pamu_cache_discard(fd, state, size, INT64_MAX);
+  size_t i;
+  struct pamu_cache_page *page;
+  for(i = 0; i < state->cacheCount; i++) {
+    page = &state->cache[i];
+    if (page->addr < 0) continue;
+    if (page->addr >= size) {
+      _pamu_cache_unlink(state, i);
+    } else if (page->addr + (int64_t)page->valid > size) {
+      memset(page->data + (size - page->addr), 0, page->valid - (size - page->addr));
+      page->valid = size - page->addr;
+    }
   }
-  write(fd, PAMU_KEYWORD, PAMU_KEYWORD_LEN);
+}
 
-  // Write flags | headersize uint32_t
-  uint32_t beHeaderSize = hton(flags | iHeaderSize);
-  write(fd, &beHeaderSize, sizeof(uint32_t));
+// Raw write which keeps the cache coherent
+ssize_t _pamu_medium_write(int fd, int64_t addr, const void *buf, size_t len) {
+  _pamu_cache_update(_pamu_state(fd), addr, buf, len);
+  return _pamu_pwrite(fd, addr, buf, len);
+}
 
-  // Initialize medium as free blob
-  PAMU_T_MARKER mediumSize = lseek(fd, 0, SEEK_END);
-  PAMU_T_MARKER blobSize   = mediumSize - iHeaderSize - (2 * PAMU_T_MARKER_SIZE);
-  PAMU_T_MARKER blobMarker = hton(blobSize | PAMU_INTERNAL_FLAG_FREE);
-  int64_t zero      = 0;
-  if (!(flags & PAMU_DYNAMIC)) {
-    lseek(fd, iHeaderSize, SEEK_SET);
-    write(fd, &blobMarker, PAMU_T_MARKER_SIZE); // Start marker
-    write(fd, &zero      , PAMU_T_POINTER_SIZE); // Previous pointer
-    write(fd, &zero      , PAMU_T_POINTER_SIZE); // Next Pointer
-    lseek(fd, iHeaderSize + blobSize + PAMU_T_MARKER_SIZE, SEEK_SET);
-    write(fd, &blobMarker, PAMU_T_MARKER_SIZE); // End marker
+// Reads from the medium as seen by pamu, including pending writes
+ssize_t _pamu_read(int fd, int64_t addr, void *buf, size_t len) {
+  struct pamu_state *state = _pamu_state(fd);
+  ssize_t rc = (state && state->cacheLimit)
+    ? _pamu_cache_read(fd, state, addr, buf, len)
+    : _pamu_pread(fd, addr, buf, len);
+  if (rc < 0) return rc;
+  if (!state || !state->entryCount) {
+    return rc == (ssize_t)len ? rc : PAMU_ERR_READ_MALFORMED;
   }
+  if (addr + (int64_t)len > state->mediumSize) return PAMU_ERR_READ_MALFORMED;
 
-  return 0;
-}
+  // Not on the medium yet, but within it's logical size
+  if (rc < (ssize_t)len) memset(((char*)buf) + rc, 0, len - rc);
 
-// Returns inner address or error
-PAMU_T_POINTER pamu_alloc(int fd, PAMU_T_MARKER size) {
-  if (size <= 0) return PAMU_ERR_NEGATIVE_SIZE;
-  if (size < (2*PAMU_T_POINTER_SIZE)) size = 2*PAMU_T_POINTER_SIZE;
+  // Overlay pending writes, in order of writing
+  size_t i;
+  int64_t start, end;
+  struct pamu_journal_entry *entry;
+  for(i = 0; i < state->entryCount; i++) {
+    entry = &state->entries[i];
+    start = MAX(entry->addr, addr);
+    end   = entry->addr + entry->len;
+    if (end > addr + (int64_t)len) end = addr + len;
+    if (start >= end) continue;
+    memcpy(((char*)buf) + (start - addr), state->arena + entry->off + (start - entry->addr), end - start);
+  }
 
-  // Fetch info (or return error code)
-  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
-  if (stat < 0) return (PAMU_T_POINTER)stat;
+  return len;
+}
 
-  // Find a pre-existing block with the correct size (or throw error)
-  PAMU_T_POINTER block = _pamu_find_free_block(fd, stat->headerSize, stat->mediumSize, size);
+int _pamu_journal_append(struct pamu_state *state, int64_t addr, const void *buf, size_t len) {
+  struct pamu_journal_entry *entry = state->entryCount ? &state->entries[state->entryCount - 1] : NULL;
 
-  // Error during finding
-  if (block < 0) {
-    free(stat);
-    return block;
+  if (state->arenaUsed + len > state->arenaLimit) {
+    state->arenaLimit = MAX(state->arenaLimit * 2, state->arenaUsed + len);
+    state->arena      = realloc(state->arena, state->arenaLimit);
   }
+  memcpy(state->arena + state->arenaUsed, buf, len);
 
-  // Throw error if non-dynamic & not enough space
+  // Extend the previous entry if we're continuing it
   if (
-    (block + (2*PAMU_T_MARKER_SIZE) + size >= stat->mediumSize) &&
-    (!(stat->flags & PAMU_DYNAMIC))
+    entry &&
+    (entry->addr + entry->len == addr) &&
+    (entry->off  + entry->len == state->arenaUsed)
   ) {
-    free(stat);
-    return PAMU_ERR_MEDIUM_FULL;
+    entry->len         += len;
+    state->arenaUsed   += len;
+    state->journalUsed += len;
+    return 0;
   }
 
-  // Here = got the space
+  if (state->entryCount == state->entryLimit) {
+    state->entryLimit = MAX(state->entryLimit * 2, 64);
+    state->entries    = realloc(state->entries, state->entryLimit * sizeof(struct pamu_journal_entry));
+  }
+  entry = &state->entries[state->entryCount++];
+  entry->addr = addr;
+  entry->len  = len;
+  entry->off  = state->arenaUsed;
+  state->arenaUsed   += len;
+  state->journalUsed += PAMU_JOURNAL_ENTRY_HEADER + len;
+  return 0;
+}
 
-  // Fetch or build block size
-  PAMU_T_MARKER blockSize = block == stat->mediumSize
-    ? size
-    : _pamu_find_size(fd, block);
-  PAMU_T_MARKER blockMarker = hton(blockSize | PAMU_INTERNAL_FLAG_FREE);
+// Writes to the medium, staged in the journal if enabled
+ssize_t _pamu_write(int fd, int64_t addr, const void *buf, size_t len) {
+  struct pamu_state *state = _pamu_state(fd);
+  if (!state || !(state->flags & PAMU_JOURNAL)) {
+    if (!state || !state->cacheLimit) return _pamu_pwrite(fd, addr, buf, len);
+    if (_pamu_cache_write(fd, state, addr, buf, len) < 0) return PAMU_ERR_WRITE;
+  } else {
+    _pamu_journal_append(state, addr, buf, len);
+  }
+  if ((state->flags & PAMU_DYNAMIC) && (addr + (int64_t)len > state->mediumSize)) {
+    state->mediumSize = addr + len;
+  }
+  return len;
+}
+
+int _pamu_truncate(int fd, int64_t size) {
+  struct pamu_state *state = _pamu_state(fd);
+  if (state && (state->flags & PAMU_JOURNAL)) {
+    state->mediumSize = size;
+    return 0;
+  }
+  if (state && state->cacheLimit) {
+    _pamu_cache_trim(fd, state, size);
+    state->mediumSize = size;
+  }
+  _pamu_publish(state, size);
+  if (_pamu_ftruncate(fd, size)) {
+    perror("ftruncate");
+    return PAMU_ERR_WRITE;
+  }
+  return 0;
+}
+
+// Drops pending metadata writes within a range handed to the application,
+// so a commit never overwrites data written there in the meantime
+void _pamu_claim(int fd, int64_t start, int64_t end) {
+  struct pamu_state *state = _pamu_state(fd);
+  if (!state) return;
+  _pamu_cache_discard(fd, state, start, end);
+
+  // Blobs allocated within a transaction may be written in-place, unless
+  // they overlap one freed within it which an abort brings back
+  size_t i;
+  int fresh = state->txn;
+  for(i = 0; fresh && (i < state->txnFreedCount); i++) {
+    fresh = (state->txnFreed[i].end <= start) || (state->txnFreed[i].start >= end);
+  }
+  if (fresh) {
+    if (state->txnFreshCount == state->txnFreshLimit) {
+      state->txnFreshLimit = MAX(state->txnFreshLimit * 2, 16);
+      state->txnFresh      = realloc(state->txnFresh, state->txnFreshLimit * sizeof(struct pamu_range));
+    }
+    state->txnFresh[state->txnFreshCount].start = start;
+    state->txnFresh[state->txnFreshCount].end   = end;
+    state->txnFreshCount++;
+  }
+
+  int64_t entryEnd;
+  struct pamu_journal_entry *entry;
+  for(i = 0; i < state->entryCount; i++) {
+    entry    = &state->entries[i];
+    entryEnd = entry->addr + entry->len;
+    if ((entryEnd <= start) || (entry->addr >= end)) continue;
+
+    // Range within the entry, split it in 2
+    if ((entry->addr < start) && (entryEnd > end)) {
+      if (state->entryCount == state->entryLimit) {
+        state->entryLimit *= 2;
+        state->entries     = realloc(state->entries, state->entryLimit * sizeof(struct pamu_journal_entry));
+        entry              = &state->entries[i];
+      }
+      memmove(&state->entries[i + 2], &state->entries[i + 1], (state->entryCount - i - 1) * sizeof(struct pamu_journal_entry));
+      state->entryCount++;
+      state->entries[i + 1].addr = end;
+      state->entries[i + 1].len  = entryEnd - end;
+      state->entries[i + 1].off  = entry->off + (end - entry->addr);
+      state->journalUsed        += PAMU_JOURNAL_ENTRY_HEADER;
+      entry->len = start - entry->addr;
+      state->journalUsed -= end - start;
+      i++;
+      continue;
+    }
+
+    // Cut off the part that overlaps
+    if (entry->addr < start) {
+      state->journalUsed -= entryEnd - start;
+      entry->len = start - entry->addr;
+    } else if (entryEnd > end) {
+      state->journalUsed -= end - entry->addr;
+      entry->off += end - entry->addr;
+      entry->len  = entryEnd - end;
+      entry->addr = end;
+    } else {
+      state->journalUsed -= entry->len;
+      entry->len = 0;
+    }
+  }
+}
+
+// Remembers a range holding metadata of the last commit that may become part
+// of a blob before the next one, blob data written there is journaled
+void _pamu_guard(int fd, int64_t start, int64_t end) {
+  struct pamu_state *state = _pamu_state(fd);
+  if (!state || !(state->flags & PAMU_JOURNAL)) return;
+  if (state->guardCount == state->guardLimit) {
+    state->guardLimit = MAX(state->guardLimit * 2, 16);
+    state->guards     = realloc(state->guards, state->guardLimit * sizeof(struct pamu_range));
+  }
+  state->guards[state->guardCount].start = start;
+  state->guards[state->guardCount].end   = end;
+  state->guardCount++;
+}
+
+int _pamu_range_compare(const void *a, const void *b) {
+  int64_t l = ((const struct pamu_range *)a)->start;
+  int64_t r = ((const struct pamu_range *)b)->start;
+  return (l > r) - (l < r);
+}
+
+// Returns the position of the first indexed block at or after addr
+size_t _pamu_index_find(struct pamu_state *state, int64_t addr) {
+  size_t low  = 0;
+  size_t high = state->indexCount;
+  size_t mid;
+  while(low < high) {
+    mid = (low + high) / 2;
+    if (state->index[mid].addr < addr) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+// Follows a free block queued for punching as it shrinks, -1 = no longer free
+void _pamu_punch_track(struct pamu_state *state, int64_t addr, int64_t size) {
+  size_t i;
+  for(i = 0; i < state->punchCount; i++) {
+    if (state->punches[i].addr != addr) continue;
+    if (size < state->punchSize) {
+      state->punches[i] = state->punches[--state->punchCount];
+    } else {
+      state->punches[i].size = size;
+    }
+    return;
+  }
+}
+
+// Inserts or updates a free block in the index
+void _pamu_index_set(int fd, int64_t addr, int64_t size) {
+  struct pamu_state *state = _pamu_state(fd);
+  if (state) _pamu_punch_track(state, addr, size);
+  if (!state || !state->indexBuilt) return;
+  size_t i = _pamu_index_find(state, addr);
+  if ((i < state->indexCount) && (state->index[i].addr == addr)) {
+    state->index[i].size = size;
+    return;
+  }
+  if (state->indexCount == state->indexLimit) {
+    state->indexLimit = MAX(state->indexLimit * 2, 64);
+    state->index      = realloc(state->index, state->indexLimit * sizeof(struct pamu_free_block));
+  }
+  memmove(&state->index[i + 1], &state->index[i], (state->indexCount - i) * sizeof(struct pamu_free_block));
+  state->index[i].addr = addr;
+  state->index[i].size = size;
+  state->indexCount++;
+}
+
+void _pamu_index_del(int fd, int64_t addr) {
+  struct pamu_state *state = _pamu_state(fd);
+  if (state) _pamu_punch_track(state, addr, -1);
+  if (!state || !state->indexBuilt) return;
+  size_t i = _pamu_index_find(state, addr);
+  if ((i == state->indexCount) || (state->index[i].addr != addr)) return;
+  memmove(&state->index[i], &state->index[i + 1], (state->indexCount - i - 1) * sizeof(struct pamu_free_block));
+  state->indexCount--;
+}
+
+// Builds the record header & checksum in-place
+void _pamu_journal_seal(char *record, size_t length, uint64_t seq, int64_t size) {
+  uint32_t beLength = hton((uint32_t)(length - PAMU_JOURNAL_RECORD_HEADER));
+  uint64_t beSeq    = hton(seq);
+  int64_t  beSize   = hton(size);
+  uint64_t beSum    = 0;
+  memcpy(record     , PAMU_JOURNAL_KEYWORD, PAMU_KEYWORD_LEN);
+  memcpy(record +  4, &beLength, sizeof(uint32_t));
+  memcpy(record +  8, &beSeq   , sizeof(uint64_t));
+  memcpy(record + 16, &beSize  , sizeof(int64_t));
+  memcpy(record + 24, &beSum   , sizeof(uint64_t));
+  beSum = hton(_pamu_hash(record, length, 0));
+  memcpy(record + 24, &beSum   , sizeof(uint64_t));
+}
+
+// Reads a journal slot, returns the record length or 0 if not valid
+size_t _pamu_journal_load(int fd, struct pamu_state *state, int slot, char **record, uint64_t *seq, int64_t *size) {
+  int64_t  addr = state->journalOffset + ((int64_t)slot * state->journalSlotSize);
+  char     header[PAMU_JOURNAL_RECORD_HEADER];
+  uint32_t beLength;
+  uint64_t beValue, beSum;
+  int64_t  beSize;
+
+  if (_pamu_pread(fd, addr, header, PAMU_JOURNAL_RECORD_HEADER) != PAMU_JOURNAL_RECORD_HEADER) return 0;
+  if (memcmp(header, PAMU_JOURNAL_KEYWORD, PAMU_KEYWORD_LEN)) return 0;
+  memcpy(&beLength, header + 4, sizeof(uint32_t));
+  size_t length = PAMU_JOURNAL_RECORD_HEADER + ntoh(beLength);
+  if (length > state->journalSlotSize) return 0;
+
+  char *buf = malloc(length);
+  if (_pamu_pread(fd, addr, buf, length) != (ssize_t)length) {
+    free(buf);
+    return 0;
+  }
+
+  // Verify the checksum, a torn record is treated as absent
+  memcpy(&beSum, buf + 24, sizeof(uint64_t));
+  memset(buf + 24, 0, sizeof(uint64_t));
+  if (ntoh(beSum) != _pamu_hash(buf, length, 0)) {
+    free(buf);
+    return 0;
+  }
+
+  memcpy(&beValue, buf +  8, sizeof(uint64_t));
+  memcpy(&beSize , buf + 16, sizeof(int64_t));
+  *seq    = ntoh(beValue);
+  *size   = ntoh(beSize);
+  *record = buf;
+  return length;
+}
+
+// Writes a record's entries in-place
+int _pamu_journal_apply(int fd, struct pamu_state *state, const char *record, size_t length, int64_t size) {
+  const char *cursor = record + PAMU_JOURNAL_RECORD_HEADER;
+  int64_t     beAddr;
+  uint32_t    beLen;
+  while(cursor < record + length) {
+    memcpy(&beAddr, cursor    , sizeof(int64_t));
+    memcpy(&beLen , cursor + 8, sizeof(uint32_t));
+    cursor += PAMU_JOURNAL_ENTRY_HEADER;
+    if (_pamu_medium_write(fd, ntoh(beAddr), cursor, ntoh(beLen)) < 0) return PAMU_ERR_WRITE;
+    cursor += ntoh(beLen);
+  }
+
+  // Dynamic media follow the logical size, static ones only shrink by resizing
+  int64_t end = lseek(fd, 0, SEEK_END);
+  if ((end != size) && ((state->flags & PAMU_DYNAMIC) || (end > size))) {
+    _pamu_cache_trim(fd, state, size);
+    if (_pamu_ftruncate(fd, size)) {
+      perror("ftruncate");
+      return PAMU_ERR_WRITE;
+    }
+  }
+
+  return 0;
+}
+
+// Releases the disk space of a free block's interior, keeping it's boundary
+// tags & free pointers
+void _pamu_punch(int fd, struct pamu_state *state, int64_t block, int64_t size) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+  int64_t start = block + PAMU_T_MARKER_SIZE + (2 * PAMU_T_POINTER_SIZE);
+  int64_t end   = block + PAMU_T_MARKER_SIZE + size;
+  start = ((start + PAMU_PUNCH_ALIGN - 1) / PAMU_PUNCH_ALIGN) * PAMU_PUNCH_ALIGN;
+  end   = (end / PAMU_PUNCH_ALIGN) * PAMU_PUNCH_ALIGN;
+  if (end <= start) return;
+
+  // Stale bytes in there must not be written back later
+  _pamu_cache_discard(fd, state, start, end);
+  if (state->cacheLimit) {
+    char *zero = calloc(1, end - start);
+    _pamu_cache_update(state, start, zero, end - start);
+    free(zero);
+  }
+
+  // Best effort, not all filesystems support it
+  _pamu_track(fd, start, end);
+  fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start);
+#endif
+}
+
+// Punches blocks queued during the group that are still free after it
+void _pamu_punch_queued(int fd, struct pamu_state *state) {
+  size_t i;
+  PAMU_T_MARKER beMarker;
+  for(i = 0; i < state->punchCount; i++) {
+    if (_pamu_read(fd, state->punches[i].addr, &beMarker, PAMU_T_MARKER_SIZE) != PAMU_T_MARKER_SIZE) continue;
+    if (ntoh(beMarker) != (state->punches[i].size | PAMU_INTERNAL_FLAG_FREE)) continue;
+    _pamu_punch(fd, state, state->punches[i].addr, state->punches[i].size);
+  }
+  state->punchCount = 0;
+}
+
+// Punches a freed block if it's large enough, journaled media wait for the
+// group to be committed so a crash can't replay into zeroed blob data, and
+// with concurrent readers it waits for the ones that may still walk it
+void _pamu_punch_block(int fd, int64_t block, int64_t size) {
+  struct pamu_state *state = _pamu_state(fd);
+  if (!state || !state->punchSize || (size < state->punchSize)) return;
+  if (!(state->flags & PAMU_JOURNAL) && !state->readerLimit) {
+    _pamu_punch(fd, state, block, size);
+    return;
+  }
+  if (state->punchCount == state->punchLimit) {
+    state->punchLimit = MAX(16, state->punchLimit * 2);
+    state->punches    = realloc(state->punches, state->punchLimit * sizeof(struct pamu_free_block));
+  }
+  state->punches[state->punchCount].addr = block;
+  state->punches[state->punchCount].size = size;
+  state->punchCount++;
+}
+
+// Group commit: one record & fdatasync for all operations since the last one
+int _pamu_journal_commit(int fd, struct pamu_state *state) {
+  if (!state || !(state->flags & PAMU_JOURNAL)) return 0;
+  if (!state->entryCount && (state->mediumSize == state->committedSize)) return 0;
+  if (state->journalUsed > state->journalSlotSize) return PAMU_ERR_JOURNAL_FULL;
+
+  // Only the latest record is replayed, so the previous group's in-place
+  // writes must be durable before this one becomes valid
+  if (state->journalUnsynced) {
+    if (fdatasync(fd)) return PAMU_ERR_WRITE;
+    state->journalUnsynced = 0;
+  }
+
+  // Serialize the pending group
+  char    *record = malloc(state->journalUsed);
+  char    *cursor = record + PAMU_JOURNAL_RECORD_HEADER;
+  int64_t  beAddr;
+  uint32_t beLen;
+  size_t   i;
+  struct pamu_journal_entry *entry;
+  for(i = 0; i < state->entryCount; i++) {
+    entry = &state->entries[i];
+    if (!entry->len) continue;
+    beAddr = hton(entry->addr);
+    beLen  = hton(entry->len);
+    memcpy(cursor    , &beAddr, sizeof(int64_t));
+    memcpy(cursor + 8, &beLen , sizeof(uint32_t));
+    cursor += PAMU_JOURNAL_ENTRY_HEADER;
+    memcpy(cursor, state->arena + entry->off, entry->len);
+    cursor += entry->len;
+  }
+  size_t   length = cursor - record;
+  uint64_t seq    = state->journalSeq + 1;
+  _pamu_journal_seal(record, length, seq, state->mediumSize);
+
+  // Alternate slots, a torn write leaves the previous record intact
+  if (_pamu_pwrite(fd, state->journalOffset + ((int64_t)(seq % 2) * state->journalSlotSize), record, length) < 0) {
+    free(record);
+    return PAMU_ERR_WRITE;
+  }
+  if (fdatasync(fd)) {
+    free(record);
+    return PAMU_ERR_WRITE;
+  }
+
+  // Here = committed, the group survives a crash from now on
+  state->journalSeq      = seq;
+  state->journalUnsynced = 1;
+  state->committedSize   = state->mediumSize;
+  state->guardCount      = 0;
+  state->entryCount      = 0;
+  state->arenaUsed       = 0;
+  state->journalUsed     = PAMU_JOURNAL_RECORD_HEADER;
+
+  int rc = _pamu_journal_apply(fd, state, record, length, state->mediumSize);
+  free(record);
+  if (!rc) _pamu_punch_queued(fd, state);
+  return rc;
+}
+
+// Commits the current group if an operation of <bytes> may not fit
+int _pamu_journal_reserve(int fd, size_t bytes) {
+  struct pamu_state *state = _pamu_state(fd);
+  if (!state || !(state->flags & PAMU_JOURNAL)) return 0;
+  if (state->journalUsed + bytes <= state->journalSlotSize) return 0;
+  if (state->txn) return PAMU_ERR_JOURNAL_FULL;
+  return _pamu_journal_commit(fd, state);
+}
+
+// Picks up the state snapshot of a clean shutdown, if any, and marks the medium
+// as in use before anything changes it
+int _pamu_clean_load(int fd, struct pamu_state *state) {
+  int64_t  offset = state->headerSize - PAMU_POOL_SIZE(state->flags) - PAMU_CLEAN_SIZE(state->flags);
+  uint64_t slot[2];
+  if (_pamu_pread(fd, offset, slot, sizeof(slot)) != sizeof(slot)) return PAMU_ERR_READ_MALFORMED;
+  int64_t  addr   = ntoh(slot[0]);
+  uint64_t length = ntoh(slot[1]);
+  if (!addr) return 0;
+  slot[0] = slot[1] = 0;
+  if ((_pamu_pwrite(fd, offset, slot, sizeof(slot)) != sizeof(slot)) || fdatasync(fd)) return PAMU_ERR_WRITE;
+
+  // Anything off means a full scan on first use, as after a crash, a length
+  // beyond the medium isn't even read
+  if (
+    (length < PAMU_CLEAN_HEADER) ||
+    (addr < (int64_t)state->headerSize) ||
+    (addr > state->mediumSize) ||
+    (length > (uint64_t)(state->mediumSize - addr))
+  ) return 0;
+  uint64_t *snapshot = malloc(length);
+  uint64_t  entries  = (length - PAMU_CLEAN_HEADER) / (2 * sizeof(uint64_t));
+  uint64_t  sum;
+  if (
+    (_pamu_pread(fd, addr, snapshot, length) != (ssize_t)length) ||
+    memcmp(snapshot, PAMU_CLEAN_KEYWORD, PAMU_KEYWORD_LEN) ||
+    (ntoh(snapshot[1]) != (uint64_t)state->mediumSize) ||
+    (ntoh(snapshot[2]) > entries) ||
+    (ntoh(snapshot[3]) > entries - ntoh(snapshot[2])) ||
+    (ntoh(snapshot[4]) > ntoh(snapshot[3])) ||
+    (length != PAMU_CLEAN_HEADER + (2 * sizeof(uint64_t) * (ntoh(snapshot[2]) + ntoh(snapshot[3]))))
+  ) {
+    free(snapshot);
+    return 0;
+  }
+  sum         = ntoh(snapshot[5]);
+  snapshot[5] = 0;
+  if (sum != _pamu_hash(snapshot, length, 0)) {
+    free(snapshot);
+    return 0;
+  }
+
+  uint32_t  contents = ntoh(snapshot[0]) & UINT32_MAX;
+  uint64_t *entry    = snapshot + (PAMU_CLEAN_HEADER / sizeof(uint64_t));
+  size_t    i;
+  if (contents & PAMU_CLEAN_INDEX) {
+    state->indexBuilt = 1;
+    state->indexCount = ntoh(snapshot[2]);
+    state->indexLimit = MAX(state->indexCount, 64);
+    state->index      = malloc(state->indexLimit * sizeof(struct pamu_free_block));
+    for(i = 0; i < state->indexCount; i++, entry += 2) {
+      state->index[i].addr = ntoh(entry[0]);
+      state->index[i].size = ntoh(entry[1]);
+    }
+  }
+  if (contents & PAMU_CLEAN_DEDUP) {
+    state->dedupScanned = 1;
+    state->dedupLimit   = ntoh(snapshot[3]);
+    state->dedupCount   = ntoh(snapshot[4]);
+    state->dedup        = calloc(MAX(state->dedupLimit, 1), sizeof(struct pamu_dedup));
+    for(i = 0; i < state->dedupLimit; i++, entry += 2) {
+      state->dedup[i].hash = ntoh(entry[0]);
+      state->dedup[i].addr = ntoh(entry[1]);
+    }
+  }
+  if (contents & PAMU_CLEAN_SETTLED) state->pendingScanned = 1;
+  free(snapshot);
+  return 0;
+}
+
+// Sets up the in-memory state for fd, replaying the journal if present
+struct pamu_state * _pamu_state_open(int fd, uint32_t flags, uint32_t headerSize) {
+  struct stat st;
+  if (fstat(fd, &st)) return NULL;
+
+  struct pamu_state *state = calloc(1, sizeof(struct pamu_state));
+  state->fd          = fd;
+  state->dev         = st.st_dev;
+  state->ino         = st.st_ino;
+  state->flags       = flags;
+  state->headerSize  = headerSize;
+  state->journalUsed = PAMU_JOURNAL_RECORD_HEADER;
+
+  if (flags & PAMU_JOURNAL) {
+    state->journalOffset   = PAMU_ROOT_OFFSET + PAMU_ROOT_SIZE(flags);
+    state->journalSlotSize = (headerSize - state->journalOffset - PAMU_CLEAN_SIZE(flags) - PAMU_POOL_SIZE(flags)) / 2;
+
+    // Replay the latest valid record, it's writes are idempotent
+    char    *record[2] = { NULL, NULL };
+    uint64_t seq[2]    = { 0, 0 };
+    int64_t  size[2]   = { 0, 0 };
+    size_t   length[2];
+    length[0] = _pamu_journal_load(fd, state, 0, &record[0], &seq[0], &size[0]);
+    length[1] = _pamu_journal_load(fd, state, 1, &record[1], &seq[1], &size[1]);
+    int latest = (length[1] && ((!length[0]) || (seq[1] > seq[0]))) ? 1 : 0;
+    if (length[latest]) {
+      state->journalSeq = seq[latest];
+      if (
+        _pamu_journal_apply(fd, state, record[latest], length[latest], size[latest]) ||
+        fdatasync(fd)
+      ) {
+        free(record[0]);
+        free(record[1]);
+        free(state);
+        return NULL;
+      }
+    }
+    free(record[0]);
+    free(record[1]);
+  }
+
+  // Record pools keep their record size at the end of the header
+  uint32_t beRecordSize;
+  if (flags & PAMU_POOL) {
+    if (_pamu_pread(fd, headerSize - PAMU_POOL_SIZE(flags), &beRecordSize, sizeof(uint32_t)) != sizeof(uint32_t)) {
+      free(state);
+      return NULL;
+    }
+    state->recordSize = ntoh(beRecordSize);
+    state->chunkSize  = PAMU_POOL_BITMAP + ((int64_t)PAMU_POOL_CHUNK * state->recordSize);
+  }
+
+  state->mediumSize    = lseek(fd, 0, SEEK_END);
+  state->committedSize = state->mediumSize;
+  if ((flags & PAMU_CLEAN) && _pamu_clean_load(fd, state)) {
+    free(state->index);
+    free(state->dedup);
+    free(state);
+    return NULL;
+  }
+  state->next          = _pamu_states;
+  _pamu_states         = state;
+  return state;
+}
+
+// Returns the state of fd, setting it up if the medium didn't need it yet
+struct pamu_state * _pamu_state_require(int fd, struct pamu_medium_stat *stat) {
+  struct pamu_state *state = _pamu_state(fd);
+  if (state) return state;
+  return _pamu_state_open(fd, stat->flags, stat->headerSize);
+}
+
+// Uses outer address
+// Returns inner size in bytes
+PAMU_T_MARKER _pamu_find_sizeFlags(int fd, PAMU_T_POINTER addr) {
+  PAMU_T_MARKER beSize;
+
+  // Read the size|flags
+  if (_pamu_read(fd, addr, &beSize, PAMU_T_MARKER_SIZE) != PAMU_T_MARKER_SIZE) {
+    return PAMU_ERR_READ_MALFORMED;
+  }
+
+  // And return the size without the flags
+  return ntoh(beSize);
+}
+
+PAMU_T_MARKER _pamu_find_size(int fd, PAMU_T_POINTER addr) {
+  return _pamu_find_sizeFlags(fd, addr) & (~PAMU_INTERNAL_FLAGS);
+}
+
+PAMU_T_MARKER _pamu_find_flags(int fd, PAMU_T_POINTER addr) {
+  PAMU_T_MARKER raw = _pamu_find_sizeFlags(fd, addr);
+  if (raw & PAMU_INTERNAL_FLAG_ERR) return raw;
+  return raw & PAMU_INTERNAL_FLAGS;
+}
+
+// Uses outer addresses
+// Returns limit = no block found
+PAMU_T_POINTER _pamu_find_free_block(int fd, PAMU_T_POINTER start, PAMU_T_POINTER limit, PAMU_T_MARKER size) {
+  PAMU_T_POINTER current = start;
+  PAMU_T_POINTER beNext  = 0;
+  PAMU_T_MARKER csize   = 0;
+  PAMU_T_MARKER cflags  = 0;
+
+  while(
+    current &&
+    (current < limit)
+  ) {
+    csize  = _pamu_find_size(fd, current);
+    cflags = _pamu_find_flags(fd, current);
+    PAMU_PROBE_WALK();
+
+    // Return errors
+    if (csize  < 0) return csize;  // Error = return error
+    if (cflags & (~PAMU_INTERNAL_FLAGS)) return cflags; // Error = return error
+
+    // If not free, go to the next entry
+    if (!(cflags & PAMU_INTERNAL_FLAG_FREE)) {
+      current += csize + (2 * PAMU_T_MARKER_SIZE);
+      continue;
+    }
+
+    // Here = free
+
+    // If large enough: return this one
+    if (csize >= size) return current;
+
+    // Skip to the next free block
+    if (_pamu_read(fd, current + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, &beNext, PAMU_T_POINTER_SIZE) != PAMU_T_POINTER_SIZE) {
+      return PAMU_ERR_READ_MALFORMED;
+    }
+    current = ntoh(beNext);
+  }
+
+  if (
+    (current == 0) ||
+    (current >= limit)
+  ) {
+    return limit;
+  }
+
+  return current;
+}
+
+// Uses outer addresses
+// Reads the current's size and returns the start of the next block
+PAMU_T_POINTER _pamu_find_next(int fd, PAMU_T_POINTER current) {
+  PAMU_T_MARKER size = _pamu_find_size(fd, current);
+  return current + size + (2 * PAMU_T_MARKER_SIZE);
+}
+
+// Uses outer addresses
+// Reads the previous' size and returns it's start
+PAMU_T_POINTER _pamu_find_previous(int fd, PAMU_T_POINTER current, uint32_t header_size) {
+  PAMU_T_POINTER addr = current - PAMU_T_MARKER_SIZE;
+  if (addr < header_size) return PAMU_ERR_OUT_OF_BOUNDS;
+  PAMU_T_MARKER size = _pamu_find_size(fd, addr);
+  return current - size - (2 * PAMU_T_MARKER_SIZE);
+}
+
+struct pamu_medium_stat * _pamu_medium_stat(int fd) {
+  struct pamu_medium_stat * response = malloc(sizeof(struct pamu_medium_stat));
+  struct pamu_state       * state    = _pamu_state(fd);
+  struct stat st;
+
+  // Known medium, unless the fd now refers to another file
+  if (state) {
+    if (
+      (!fstat(fd, &st)) &&
+      (st.st_dev == state->dev) &&
+      (st.st_ino == state->ino)
+    ) {
+      response->flags      = state->flags;
+      response->headerSize = state->headerSize;
+      response->mediumSize = ((state->flags & PAMU_JOURNAL) || state->cacheLimit) ? state->mediumSize : lseek(fd, 0, SEEK_END);
+      return response;
+    }
+    _pamu_state_drop(fd);
+  }
+
+  // Verify keyword in header
+  char *keyBuf = calloc(1, PAMU_KEYWORD_LEN + 1);
+  ssize_t rc = _pamu_pread(fd, 0, keyBuf, PAMU_KEYWORD_LEN);
+  if (rc != PAMU_KEYWORD_LEN) {
+    free(response);
+    free(keyBuf);
+    return (void*)PAMU_ERR_READ_MALFORMED;
+  }
+  if (strcmp(PAMU_KEYWORD, keyBuf)) {
+    free(response);
+    free(keyBuf);
+    return (void*)PAMU_ERR_MEDIUM_UNINITIALIZED;
+  }
+
+  // Read header size & flags
+  uint32_t beFlaggedSize;
+  rc = _pamu_pread(fd, PAMU_KEYWORD_LEN, &beFlaggedSize, sizeof(uint32_t));
+  if (rc != sizeof(uint32_t)) {
+    free(response);
+    free(keyBuf);
+    return (void*)PAMU_ERR_READ_MALFORMED;
+  }
+  uint32_t iFlaggedHeaderSize = ntoh(beFlaggedSize);
+  response->flags      = iFlaggedHeaderSize &  PAMU_FLAGS;
+  response->headerSize = iFlaggedHeaderSize & ~PAMU_FLAGS;
+
+  // Journaled media need state, replaying the journal on first access, as do
+  // media that may hold a state snapshot
+  if (response->flags & (PAMU_JOURNAL | PAMU_CLEAN)) {
+    state = _pamu_state_open(fd, response->flags, response->headerSize);
+    if (!state) {
+      free(response);
+      free(keyBuf);
+      return (void*)PAMU_ERR_WRITE;
+    }
+  }
+
+  // Find medium size
+  response->mediumSize = state ? state->mediumSize : lseek(fd, 0, SEEK_END);
+
+  free(keyBuf);
+  return response;
+}
+
+
+// Open/close functionality
+int _pamu_init(int fd, uint32_t flags, uint32_t recordSize) {
+
+  // Any state we had belongs to the previous medium
+  _pamu_state_drop(fd);
+
+  // A blob is either framed or has a trailer, records have neither
+  if ((flags & PAMU_COMPRESS) && (flags & PAMU_DEDUP)) return PAMU_ERR_NOT_SUPPORTED;
+  if ((flags & PAMU_POOL) && (flags & (PAMU_LAZY | PAMU_COMPRESS | PAMU_DEDUP))) return PAMU_ERR_NOT_SUPPORTED;
+  if ((flags & PAMU_POOL) && !recordSize) return PAMU_ERR_NEGATIVE_SIZE;
+  if ((flags & PAMU_POOL) && (flags & PAMU_CLEAN)) return PAMU_ERR_NOT_SUPPORTED;
+
+  // "calculate" header size
+  uint32_t iHeaderSize =
+    PAMU_KEYWORD_LEN  + // Keyword
+    sizeof(uint32_t ) + // Headersize + flags
+    PAMU_ROOT_SIZE(flags) + // Root table
+    ((flags & PAMU_JOURNAL) ? (2 * PAMU_JOURNAL_SIZE) : 0) + // Journal slots
+    PAMU_CLEAN_SIZE(flags) + // State snapshot
+    PAMU_POOL_SIZE(flags) + // Record size
+    0;
+
+  // "calculate" entry size
+  uint32_t iEntrySize = (flags & PAMU_POOL) ? (PAMU_POOL_BITMAP + recordSize) : (
+    PAMU_T_MARKER_SIZE + // Start size indicator
+    PAMU_T_POINTER_SIZE + // Previous free pointer in empty records
+    PAMU_T_POINTER_SIZE + // Next free pointer in empty records
+    PAMU_T_MARKER_SIZE + // End size indicator
+    0);
+
+  // Fetch medium size
+  PAMU_T_MARKER iMediumSize = lseek(fd, 0, SEEK_END);
+
+  // If not dynamic: check if our header + 1 entry is going to fit
+  if (
+    (!(flags & PAMU_DYNAMIC)) &&
+    ((iHeaderSize + iEntrySize) > iMediumSize)
+  ) {
+    return PAMU_ERR_MEDIUM_SIZE;
+  }
+
+  // Write "PAMU" keyword
+  if (lseek(fd, 0, SEEK_SET)) {
+    perror("lseek");
+    return PAMU_ERR_SEEK;
+  }
+  write(fd, PAMU_KEYWORD, PAMU_KEYWORD_LEN);
+
+  // Write flags | headersize uint32_t
+  uint32_t beHeaderSize = hton(flags | iHeaderSize);
+  write(fd, &beHeaderSize, sizeof(uint32_t));
+
+  // Clear the root table
+  if (flags & PAMU_ROOTS) {
+    char *roots = calloc(1, PAMU_ROOT_SIZE(flags));
+    write(fd, roots, PAMU_ROOT_SIZE(flags));
+    free(roots);
+  }
+
+  // Clear the journal slots
+  char *slot = NULL;
+  if (flags & PAMU_JOURNAL) {
+    slot = calloc(1, PAMU_JOURNAL_SIZE);
+    write(fd, slot, PAMU_JOURNAL_SIZE);
+    write(fd, slot, PAMU_JOURNAL_SIZE);
+  }
+
+  // No state snapshot yet
+  uint64_t clean[2] = { 0, 0 };
+  if (flags & PAMU_CLEAN) {
+    write(fd, clean, PAMU_CLEAN_SIZE(flags));
+  }
+
+  // Record size of a pool
+  uint32_t pool[2] = { hton(recordSize), 0 };
+  if (flags & PAMU_POOL) {
+    write(fd, pool, PAMU_POOL_SIZE(flags));
+  }
+
+  // Static pools start with all bitmaps cleared
+  PAMU_T_MARKER mediumSize = lseek(fd, 0, SEEK_END);
+  if (flags & PAMU_POOL) {
+    int64_t  chunk   = PAMU_POOL_BITMAP + ((int64_t)PAMU_POOL_CHUNK * recordSize);
+    int64_t  addr;
+    char    *bitmap  = calloc(1, PAMU_POOL_BITMAP);
+    for(addr = iHeaderSize; (!(flags & PAMU_DYNAMIC)) && (addr + PAMU_POOL_BITMAP <= mediumSize); addr += chunk) {
+      _pamu_pwrite(fd, addr, bitmap, PAMU_POOL_BITMAP);
+    }
+    free(bitmap);
+  }
+
+  // Initialize medium as free blob
+  PAMU_T_MARKER blobSize   = mediumSize - iHeaderSize - (2 * PAMU_T_MARKER_SIZE);
+  PAMU_T_MARKER blobMarker = hton(blobSize | PAMU_INTERNAL_FLAG_FREE);
+  int64_t zero      = 0;
+  if (!(flags & (PAMU_DYNAMIC | PAMU_POOL))) {
+    lseek(fd, iHeaderSize, SEEK_SET);
+    write(fd, &blobMarker, PAMU_T_MARKER_SIZE); // Start marker
+    write(fd, &zero      , PAMU_T_POINTER_SIZE); // Previous pointer
+    write(fd, &zero      , PAMU_T_POINTER_SIZE); // Next Pointer
+    lseek(fd, iHeaderSize + blobSize + PAMU_T_MARKER_SIZE, SEEK_SET);
+    write(fd, &blobMarker, PAMU_T_MARKER_SIZE); // End marker
+  }
+
+  // Initial record, so replay always knows the logical medium size
+  if (flags & PAMU_JOURNAL) {
+    _pamu_journal_seal(slot, PAMU_JOURNAL_RECORD_HEADER, 0, mediumSize);
+    lseek(fd, PAMU_ROOT_OFFSET + PAMU_ROOT_SIZE(flags), SEEK_SET);
+    write(fd, slot, PAMU_JOURNAL_RECORD_HEADER);
+    free(slot);
+    if (fdatasync(fd)) return PAMU_ERR_WRITE;
+  }
+
+  return 0;
+}
+
+int pamu_init(int fd, uint32_t flags) {
+  return _pamu_init(fd, flags, 0);
+}
+
+int pamu_init_pool(int fd, uint32_t flags, uint32_t recordSize) {
+  return _pamu_init(fd, flags | PAMU_POOL, recordSize);
+}
+
+int pamu_flush(int fd) {
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (int)(intptr_t)stat;
+  free(stat);
+
+  // Journaled = a committed group is durable
+  struct pamu_state *state = _pamu_state(fd);
+  if (state && state->txn) return PAMU_ERR_TXN;
+
+  // Tiered handles flush the slow medium along
+  int rc = (state && state->tierThreshold) ? pamu_flush(state->tierFd) : 0;
+  if (rc) return rc;
+
+  if (state && (state->flags & PAMU_JOURNAL)) {
+    return _pamu_journal_commit(fd, state);
+  }
+
+  // Write-back cache
+  if (state && state->cacheLimit && _pamu_cache_writeback(fd, state)) return PAMU_ERR_WRITE;
+
+  if (fdatasync(fd)) return PAMU_ERR_WRITE;
+  return 0;
+}
+
+// Keeps what's known about the medium in the interior of a free block, so the
+// next open can skip scanning it
+int _pamu_clean_save(int fd, struct pamu_state *state) {
+  uint32_t contents =
+    (state->indexBuilt   ? PAMU_CLEAN_INDEX : 0) |
+    (state->dedupScanned ? PAMU_CLEAN_DEDUP : 0) |
+    ((state->pendingScanned && !state->pendingCount) ? PAMU_CLEAN_SETTLED : 0);
+  if (!contents) return 0;
+
+  // Any free block large enough will do, nothing is left without room
+  size_t   indexCount = state->indexBuilt   ? state->indexCount : 0;
+  size_t   dedupLimit = state->dedupScanned ? state->dedupLimit : 0;
+  size_t   length     = PAMU_CLEAN_HEADER + (2 * sizeof(uint64_t) * (indexCount + dedupLimit));
+  int64_t  mediumSize = lseek(fd, 0, SEEK_END);
+  int64_t  headerSize = state->headerSize;
+  PAMU_T_POINTER block = _pamu_find_free_block(fd, headerSize, mediumSize, length + (2 * PAMU_T_POINTER_SIZE));
+  if ((block < 0) || (block >= mediumSize)) return 0;
+
+  uint64_t *snapshot = malloc(length);
+  uint64_t *entry    = snapshot + (PAMU_CLEAN_HEADER / sizeof(uint64_t));
+  size_t    i;
+  memcpy(snapshot, PAMU_CLEAN_KEYWORD, PAMU_KEYWORD_LEN);
+  snapshot[0] = hton((ntoh(snapshot[0]) & ~(uint64_t)UINT32_MAX) | contents);
+  snapshot[1] = hton((uint64_t)mediumSize);
+  snapshot[2] = hton((uint64_t)indexCount);
+  snapshot[3] = hton((uint64_t)dedupLimit);
+  snapshot[4] = hton((uint64_t)(dedupLimit ? state->dedupCount : 0));
+  snapshot[5] = 0;
+  for(i = 0; i < indexCount; i++, entry += 2) {
+    entry[0] = hton((uint64_t)state->index[i].addr);
+    entry[1] = hton((uint64_t)state->index[i].size);
+  }
+  for(i = 0; i < dedupLimit; i++, entry += 2) {
+    entry[0] = hton(state->dedup[i].hash);
+    entry[1] = hton((uint64_t)state->dedup[i].addr);
+  }
+  snapshot[5] = hton(_pamu_hash(snapshot, length, 0));
+
+  // The snapshot must be durable before the header points at it
+  uint64_t slot[2] = { hton((uint64_t)(block + PAMU_T_MARKER_SIZE + (2 * PAMU_T_POINTER_SIZE))), hton((uint64_t)length) };
+  int rc = (_pamu_pwrite(fd, ntoh(slot[0]), snapshot, length) != (ssize_t)length) || fdatasync(fd);
+  free(snapshot);
+  if (rc) return PAMU_ERR_WRITE;
+  int64_t offset = headerSize - PAMU_POOL_SIZE(state->flags) - PAMU_CLEAN_SIZE(state->flags);
+  if ((_pamu_pwrite(fd, offset, slot, sizeof(slot)) != sizeof(slot)) || fdatasync(fd)) return PAMU_ERR_WRITE;
+  return 0;
+}
+
+int pamu_close(int fd) {
+
+  // Leave no lazily freed blocks behind
+  struct pamu_state *state = _pamu_state(fd);
+  if (state && state->pendingCount && !state->txn) pamu_maintain(fd, 0);
+
+  int rc = pamu_flush(fd);
+  if (state && state->tierThreshold && !rc) rc = pamu_close(state->tierFd);
+  if (state && (state->flags & PAMU_CLEAN) && !rc) rc = _pamu_clean_save(fd, state);
+  _pamu_state_drop(fd);
+  return rc;
+}
+
+// Copies a range of fd into the same place in out, by the kernel if it can
+int _pamu_copy_range(int fd, int out, int64_t start, int64_t end, char **buffer) {
+  off_t   off = start, offOut;
+  ssize_t n;
+  while(off < end) {
+    if (!*buffer) {
+      offOut = off;
+      n      = copy_file_range(fd, &off, out, &offOut, end - off, 0);
+      if (n > 0) continue;
+      *buffer = malloc(PAMU_BULK_BUFFER);
+    }
+    n = _pamu_pread(fd, off, *buffer, MIN(end - off, PAMU_BULK_BUFFER));
+    if ((n <= 0) || (_pamu_pwrite(out, off, *buffer, n) < 0)) return PAMU_ERR_WRITE;
+    off += n;
+  }
+  return 0;
+}
+
+// Copies the data extents of fd into out, leaving holes as they are
+int _pamu_snapshot_copy(int fd, int out, int64_t size) {
+  int64_t  pos = 0, data, hole;
+  char    *buffer = NULL;
+  while(pos < size) {
+    data = lseek(fd, pos, SEEK_DATA);
+    if ((data < 0) && (errno == ENXIO)) break; // No more data
+    hole = (data < 0) ? -1 : lseek(fd, data, SEEK_HOLE);
+    if (hole < 0) {
+      data = pos; // Filesystem can't tell, copy it all
+      hole = size;
+    }
+    if (_pamu_copy_range(fd, out, data, hole, &buffer)) {
+      free(buffer);
+      return PAMU_ERR_WRITE;
+    }
+    pos = hole;
+  }
+  free(buffer);
+  return ftruncate(out, size) ? PAMU_ERR_WRITE : 0;
+}
+
+// Clones the medium into a new file at path, which opens as a medium holding
+// everything up to the last completed operation
+int pamu_snapshot(int fd, const char *path) {
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (int)(intptr_t)stat;
+  free(stat);
+
+  // Bring the medium itself up-to-date
+  struct pamu_state *state = _pamu_state(fd);
+  if (state && state->txn) return PAMU_ERR_TXN;
+
+  // Pointers into a slow tier would dangle in the clone
+  if (state && state->tierThreshold) return PAMU_ERR_NOT_SUPPORTED;
+  if (state && (state->flags & PAMU_JOURNAL) && _pamu_journal_commit(fd, state)) return PAMU_ERR_WRITE;
+  if (state && state->cacheLimit && _pamu_cache_writeback(fd, state)) return PAMU_ERR_WRITE;
+
+  // Block devices report no size through fstat, ask the medium itself
+  struct stat st;
+  int64_t size = lseek(fd, 0, SEEK_END);
+  if ((size < 0) || fstat(fd, &st)) return PAMU_ERR_READ_MALFORMED;
+  int out = open(path, O_RDWR | O_CREAT | O_TRUNC, st.st_mode & 0777);
+  if (out < 0) return PAMU_ERR_WRITE;
+
+  // Reflink when the filesystem supports it, copy otherwise
+  int rc = 0;
+#ifdef FICLONE
+  if (ioctl(out, FICLONE, fd))
+#endif
+  rc = _pamu_snapshot_copy(fd, out, size);
+  if (!rc && fdatasync(out)) rc = PAMU_ERR_WRITE;
+  close(out);
+  if (rc) unlink(path);
+  return rc;
+}
+
+int64_t pamu_checkpoint(int fd) {
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (int64_t)(intptr_t)stat;
+  struct pamu_state *state = _pamu_state_require(fd, stat);
+  free(stat);
+  if (!state) return PAMU_ERR_READ_MALFORMED;
+
+  // Writes from here on belong to the new checkpoint
+  if (!state->changeSeq) state->changeFloor = 1;
+  return ++state->changeSeq;
+}
+
+int64_t pamu_changes_since(int fd, int64_t checkpoint, pamu_change_cb cb, void *udata) {
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (int64_t)(intptr_t)stat;
+  free(stat);
+
+  // Ranges before the floor have been forgotten already
+  struct pamu_state *state = _pamu_state(fd);
+  if (!state || !state->changeSeq) return PAMU_ERR_NOT_SUPPORTED;
+  if (state->tierThreshold) return PAMU_ERR_NOT_SUPPORTED;
+  if ((checkpoint < (int64_t)state->changeFloor) || (checkpoint > (int64_t)state->changeSeq)) {
+    return PAMU_ERR_NOT_SUPPORTED;
+  }
+  if (state->txn) return PAMU_ERR_TXN;
+
+  // Bring the medium itself up-to-date, those writes are tracked as well
+  if ((state->flags & PAMU_JOURNAL) && _pamu_journal_commit(fd, state)) return PAMU_ERR_WRITE;
+  if (state->cacheLimit && _pamu_cache_writeback(fd, state)) return PAMU_ERR_WRITE;
+  // Block devices report no size through fstat, ask the medium itself
+  int64_t size = lseek(fd, 0, SEEK_END);
+  if (size < 0) return PAMU_ERR_READ_MALFORMED;
+
+  // Forget what older checkpoints changed, then hand out the rest
+  size_t i, count = 0;
+  for(i = 0; i < state->changeCount; i++) {
+    if (state->changes[i].seq < (uint64_t)checkpoint) continue;
+    state->changes[count++] = state->changes[i];
+  }
+  state->changeCount = count;
+  state->changeFloor = checkpoint;
+  _pamu_changes_merge(state);
+
+  // Ranges past the end were truncated, reported as an empty range at it
+  int64_t start, end;
+  int     rc;
+  for(i = 0; i < state->changeCount; i++) {
+    start = MIN(state->changes[i].start, size);
+    end   = MIN(state->changes[i].end  , size);
+    rc    = cb(udata, start, end - start, size);
+    if (rc) return rc;
+  }
+
+  // Whatever happens next is for the next checkpoint
+  return ++state->changeSeq;
+}
+
+// Local replica being brought up-to-date by pamu_replicate
+struct pamu_replica {
+  int      fd;
+  int      replicaFd;
+  int64_t  size;
+  char    *buffer;
+};
+
+// Copies one changed range into the replica, sizing it like the medium
+int _pamu_replica_apply(void *udata, int64_t addr, int64_t len, int64_t size) {
+  struct pamu_replica *replica = udata;
+  if (replica->size < 0) replica->size = lseek(replica->replicaFd, 0, SEEK_END);
+  if (replica->size != size) {
+    if (ftruncate(replica->replicaFd, size)) return PAMU_ERR_WRITE;
+    replica->size = size;
+  }
+  return _pamu_copy_range(replica->fd, replica->replicaFd, addr, addr + len, &replica->buffer);
+}
+
+int64_t pamu_replicate(int fd, int replicaFd, int64_t checkpoint) {
+  struct pamu_replica replica = { fd, replicaFd, -1, NULL };
+  int64_t rc = pamu_changes_since(fd, checkpoint, _pamu_replica_apply, &replica);
+  free(replica.buffer);
+  if (rc < 0) return rc;
+  if (fdatasync(replicaFd)) return PAMU_ERR_WRITE;
+  return rc;
+}
+
+int pamu_cache(int fd, size_t pages) {
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (int)(intptr_t)stat;
+  struct pamu_state *state = _pamu_state_require(fd, stat);
+  if (!state) {
+    free(stat);
+    return PAMU_ERR_READ_MALFORMED;
+  }
+
+  // Concurrent readers bypass the cache
+  if (pages && state->readerLimit) {
+    free(stat);
+    return PAMU_ERR_NOT_SUPPORTED;
+  }
+
+  // Drop the current cache, writing back what's dirty
+  int rc = state->cacheLimit ? _pamu_cache_writeback(fd, state) : 0;
+  if (!state->cacheLimit && !(state->flags & PAMU_JOURNAL)) {
+    state->mediumSize = stat->mediumSize;
+  }
+  free(stat);
+  free(state->cache);
+  free(state->cacheBuckets);
+  state->cache        = NULL;
+  state->cacheBuckets = NULL;
+  state->cacheCount   = 0;
+  state->cacheLimit   = 0;
+  state->cacheHand    = 0;
+  if (rc || !pages) return rc;
+
+  size_t i;
+  state->cache            = calloc(pages, sizeof(struct pamu_cache_page));
+  state->cacheBucketCount = pages * 2;
+  state->cacheBuckets     = malloc(state->cacheBucketCount * sizeof(int));
+  for(i = 0; i < state->cacheBucketCount; i++) state->cacheBuckets[i] = -1;
+  state->cacheLimit = pages;
+  return 0;
+}
+
+int pamu_punch(int fd, PAMU_T_MARKER size) {
+#ifndef FALLOC_FL_PUNCH_HOLE
+  return PAMU_ERR_NOT_SUPPORTED;
+#endif
+  if (size < 0) return PAMU_ERR_NEGATIVE_SIZE;
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (int)(intptr_t)stat;
+  struct pamu_state *state = _pamu_state_require(fd, stat);
+  free(stat);
+  if (!state) return PAMU_ERR_READ_MALFORMED;
+
+  state->punchSize = size;
+  return 0;
+}
+
+// Blobs of at least threshold bytes go to slowFd, 0 unbinds it
+int pamu_tier(int fd, int slowFd, PAMU_T_MARKER threshold) {
+  if (threshold < 0) return PAMU_ERR_NEGATIVE_SIZE;
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (int)(intptr_t)stat;
+  struct pamu_state *state = _pamu_state_require(fd, stat);
+  int64_t mediumSize = stat->mediumSize;
+  free(stat);
+  if (!state) return PAMU_ERR_READ_MALFORMED;
+  if (!threshold) {
+    state->tierThreshold = 0;
+    return 0;
+  }
+
+  // One level only, the tier bit must be free on both sides
+  if (slowFd == fd) return PAMU_ERR_NOT_SUPPORTED;
+  struct pamu_state *slowState = _pamu_state(slowFd);
+  if (slowState && slowState->tierThreshold) return PAMU_ERR_NOT_SUPPORTED;
+  stat = _pamu_medium_stat(slowFd);
+  if (stat < 0) return (int)(intptr_t)stat;
+  if ((mediumSize > PAMU_TIER_BIT) || (stat->mediumSize > PAMU_TIER_BIT)) {
+    free(stat);
+    return PAMU_ERR_MEDIUM_SIZE;
+  }
+  free(stat);
+
+  state->tierFd        = slowFd;
+  state->tierThreshold = threshold;
+  return 0;
+}
+
+// Medium a blob of size bytes is allocated on & the bit marking it's pointer
+int _pamu_tier_pick(int fd, PAMU_T_MARKER size, PAMU_T_POINTER *bit) {
+  struct pamu_state *state = _pamu_state(fd);
+  *bit = 0;
+  if (!state || !state->tierThreshold || (size < state->tierThreshold)) return fd;
+  *bit = PAMU_TIER_BIT;
+  return state->tierFd;
+}
+
+// Marks a pointer of the slow medium, which must not reach the tier bit itself
+PAMU_T_POINTER _pamu_tier_mark(int fd, PAMU_T_POINTER addr, PAMU_T_POINTER bit) {
+  if (addr <= 0) return addr;
+  if (addr & PAMU_TIER_BIT) {
+    pamu_free(fd, addr);
+    return PAMU_ERR_MEDIUM_FULL;
+  }
+  return addr | bit;
+}
+
+// Points fd & addr at the slow medium when addr carries the tier bit
+void _pamu_tier_route(int *fd, PAMU_T_POINTER *addr) {
+  if ((*addr <= 0) || !(*addr & PAMU_TIER_BIT)) return;
+  struct pamu_state *state = _pamu_state(*fd);
+  if (!state || !state->tierThreshold) return;
+  *fd    = state->tierFd;
+  *addr &= ~PAMU_TIER_BIT;
+}
+
+int pamu_txn_begin(int fd) {
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (int)(intptr_t)stat;
+  free(stat);
+
+  // Staging relies on the journal
+  struct pamu_state *state = _pamu_state(fd);
+  if (!state || !(state->flags & PAMU_JOURNAL)) return PAMU_ERR_NOT_SUPPORTED;
+  if (state->txn) return PAMU_ERR_TXN;
+
+  // Savepoint, pending entries may be trimmed by allocations within the
+  // transaction so we keep a copy of them
+  state->txn            = 1;
+  state->txnEntryCount  = state->entryCount;
+  state->txnArenaUsed   = state->arenaUsed;
+  state->txnJournalUsed = state->journalUsed;
+  state->txnMediumSize  = state->mediumSize;
+  state->txnFreshCount  = 0;
+  state->txnFreedCount  = 0;
+  state->txnEntries     = realloc(state->txnEntries, MAX(state->entryCount, 1) * sizeof(struct pamu_journal_entry));
+  memcpy(state->txnEntries, state->entries, state->entryCount * sizeof(struct pamu_journal_entry));
+  return 0;
+}
+
+int pamu_txn_commit(int fd) {
+  struct pamu_state *state = _pamu_state(fd);
+  if (!state || !state->txn) return PAMU_ERR_TXN;
+
+  // Blob data written in-place must be durable before the record is
+  if (state->txnFreshCount) state->journalUnsynced = 1;
+
+  int rc = _pamu_journal_commit(fd, state);
+  if (rc) return rc;
+  state->txn = 0;
+  return 0;
+}
+
+int pamu_txn_abort(int fd) {
+  struct pamu_state *state = _pamu_state(fd);
+  if (!state || !state->txn) return PAMU_ERR_TXN;
+
+  // Nothing of the transaction reached the medium's metadata
+  state->entryCount  = state->txnEntryCount;
+  state->arenaUsed   = state->txnArenaUsed;
+  state->journalUsed = state->txnJournalUsed;
+  state->mediumSize  = state->txnMediumSize;
+  memcpy(state->entries, state->txnEntries, state->entryCount * sizeof(struct pamu_journal_entry));
+  state->txn            = 0;
+  state->indexBuilt     = 0;
+  state->pendingScanned = 0;
+  state->dedupScanned   = 0;
+  state->poolHint       = 0;
+  state->punchCount     = 0;
+
+  // Drop blob data written past the logical end, the last commit's blocks
+  // stay until a commit cuts them off
+  int64_t end = MAX(state->mediumSize, state->committedSize);
+  if ((state->flags & PAMU_DYNAMIC) && (lseek(fd, 0, SEEK_END) > end)) {
+    _pamu_cache_trim(fd, state, end);
+    if (_pamu_ftruncate(fd, end)) {
+      perror("ftruncate");
+      return PAMU_ERR_WRITE;
+    }
+  }
+
+  return 0;
+}
+
+// Writes blob data in-place, except for guarded bytes which are staged in the
+// journal, a crash before the next commit must find the last one intact
+int _pamu_blob_place(int fd, struct pamu_state *state, int64_t addr, const char *buf, size_t len) {
+  int64_t end    = addr + len;
+  int64_t cursor = addr, start;
+  size_t  i, count = 0, staged = 0;
+  struct pamu_range *clip = NULL;
+  for(i = 0; state && (i < state->guardCount); i++) {
+    if ((state->guards[i].end <= addr) || (state->guards[i].start >= end)) continue;
+    if (!clip) clip = malloc(state->guardCount * sizeof(struct pamu_range));
+    clip[count].start = MAX(state->guards[i].start, addr);
+    clip[count].end   = MIN(state->guards[i].end, end);
+    staged += PAMU_JOURNAL_ENTRY_HEADER + (clip[count].end - clip[count].start);
+    count++;
+  }
+
+  // Outside of a transaction, committing first makes the whole blob ours
+  if (count && (state->journalUsed + staged > state->journalSlotSize)) {
+    free(clip);
+    if (state->txn) return PAMU_ERR_JOURNAL_FULL;
+    int rc = _pamu_journal_commit(fd, state);
+    if (rc) return rc;
+    count = 0;
+  }
+  if (!count) {
+    return _pamu_medium_write(fd, addr, buf, len) < 0 ? PAMU_ERR_WRITE : 0;
+  }
+
+  qsort(clip, count, sizeof(struct pamu_range), _pamu_range_compare);
+  for(i = 0; i <= count; i++) {
+    start = (i < count) ? clip[i].start : end;
+    if (start > cursor) {
+      if (_pamu_medium_write(fd, cursor, buf + (cursor - addr), start - cursor) < 0) {
+        free(clip);
+        return PAMU_ERR_WRITE;
+      }
+      cursor = start;
+    }
+    if ((i < count) && (clip[i].end > cursor)) {
+      _pamu_journal_append(state, cursor, buf + (cursor - addr), clip[i].end - cursor);
+      cursor = clip[i].end;
+    }
+  }
+  free(clip);
+  return 0;
+}
+
+// Writes blob data, outside of a transaction or into a blob allocated within
+// it directly, staged in the journal otherwise
+int _pamu_blob_write(int fd, int64_t addr, const void *buf, size_t len) {
+  struct pamu_state *state = _pamu_state(fd);
+  size_t i;
+  int fresh = !(state && state->txn);
+  for(i = 0; (!fresh) && (i < state->txnFreshCount); i++) {
+    fresh = (addr >= state->txnFresh[i].start) && (addr + (int64_t)len <= state->txnFresh[i].end);
+  }
+  if (fresh) return _pamu_blob_place(fd, state, addr, buf, len);
+
+  // Overwriting existing data, stage it in the journal
+  if (state->journalUsed + PAMU_JOURNAL_ENTRY_HEADER + len > state->journalSlotSize) {
+    return PAMU_ERR_JOURNAL_FULL;
+  }
+  _pamu_journal_append(state, addr, buf, len);
+  return 0;
+}
+
+// Builds the frame of a blob holding buf, compressed if that makes it smaller
+// Returns the frame's size, the caller frees *frame
+size_t _pamu_frame_pack(const void *buf, size_t len, char **frame) {
+  *frame = malloc(PAMU_FRAME_SIZE + len);
+  size_t packed = len ? _pamu_lz_compress(buf, len, (uint8_t *)*frame + PAMU_FRAME_SIZE, len - 1) : 0;
+  if (!packed) memcpy(*frame + PAMU_FRAME_SIZE, buf, len);
+  uint32_t beLength = hton((uint32_t)len);
+  uint32_t bePacked = hton((uint32_t)packed);
+  memcpy(*frame    , &beLength, sizeof(uint32_t));
+  memcpy(*frame + 4, &bePacked, sizeof(uint32_t));
+  return PAMU_FRAME_SIZE + (packed ? packed : len);
+}
+
+// Reads the logical & packed length from the frame of a blob
+int _pamu_frame_read(int fd, PAMU_T_POINTER addr, uint32_t *length, uint32_t *packed) {
+  uint32_t be[2];
+  if (_pamu_read(fd, addr, be, PAMU_FRAME_SIZE) != PAMU_FRAME_SIZE) return PAMU_ERR_READ_MALFORMED;
+  *length = ntoh(be[0]);
+  *packed = ntoh(be[1]);
+  return 0;
+}
+
+// Fresh blob on a compressed medium, holding len bytes stored as-is
+int _pamu_frame_init(int fd, PAMU_T_POINTER addr, size_t len) {
+  uint32_t be[2] = { hton((uint32_t)len), 0 };
+  return _pamu_blob_write(fd, addr, be, PAMU_FRAME_SIZE);
+}
+
+// Reads the trailer at the end of a blob on a deduplicated medium
+int _pamu_trailer_read(int fd, PAMU_T_POINTER addr, uint64_t *hash, uint32_t *refs, uint32_t *length) {
+  PAMU_T_MARKER size = _pamu_find_size(fd, addr - PAMU_T_MARKER_SIZE);
+  char          trailer[PAMU_TRAILER_SIZE];
+  uint64_t      beHash;
+  uint32_t      beRefs, beLength;
+  if (size < PAMU_TRAILER_SIZE) return PAMU_ERR_READ_MALFORMED;
+  if (_pamu_read(fd, addr + size - PAMU_TRAILER_SIZE, trailer, PAMU_TRAILER_SIZE) != PAMU_TRAILER_SIZE) {
+    return PAMU_ERR_READ_MALFORMED;
+  }
+  memcpy(&beHash  , trailer     , sizeof(uint64_t));
+  memcpy(&beRefs  , trailer +  8, sizeof(uint32_t));
+  memcpy(&beLength, trailer + 12, sizeof(uint32_t));
+  *hash   = ntoh(beHash);
+  *refs   = ntoh(beRefs);
+  *length = ntoh(beLength);
+  return 0;
+}
+
+// Trailers are metadata, journaled along with the allocation
+int _pamu_trailer_write(int fd, PAMU_T_POINTER addr, uint64_t hash, uint32_t refs, uint32_t length) {
+  PAMU_T_MARKER size = _pamu_find_size(fd, addr - PAMU_T_MARKER_SIZE);
+  char          trailer[PAMU_TRAILER_SIZE];
+  uint64_t      beHash   = hton(hash);
+  uint32_t      beRefs   = hton(refs);
+  uint32_t      beLength = hton(length);
+  if (size < PAMU_TRAILER_SIZE) return PAMU_ERR_READ_MALFORMED;
+  memcpy(trailer     , &beHash  , sizeof(uint64_t));
+  memcpy(trailer +  8, &beRefs  , sizeof(uint32_t));
+  memcpy(trailer + 12, &beLength, sizeof(uint32_t));
+  return _pamu_write(fd, addr + size - PAMU_TRAILER_SIZE, trailer, PAMU_TRAILER_SIZE) < 0 ? PAMU_ERR_WRITE : 0;
+}
+
+// Bytes a medium keeps with every blob next to the application's data
+PAMU_T_MARKER _pamu_blob_overhead(int32_t flags) {
+  if (flags & PAMU_COMPRESS) return PAMU_FRAME_SIZE;
+  if (flags & PAMU_DEDUP)    return PAMU_TRAILER_SIZE;
+  return 0;
+}
+
+// Writes the frame or trailer of a fresh blob holding length bytes
+int _pamu_blob_init(int fd, int32_t flags, PAMU_T_POINTER addr, PAMU_T_MARKER length) {
+  if (flags & PAMU_COMPRESS) return _pamu_frame_init(fd, addr, length);
+  if (flags & PAMU_DEDUP)    return _pamu_trailer_write(fd, addr, 0, 1, length);
+  return 0;
+}
+
+// Replaces the whole content of a blob on a compressed medium
+int _pamu_frame_write(int fd, PAMU_T_POINTER addr, const void *buf, size_t len) {
+  PAMU_T_MARKER sizeFlags = _pamu_find_sizeFlags(fd, addr - PAMU_T_MARKER_SIZE);
+  if (sizeFlags & (PAMU_INTERNAL_FLAGS | PAMU_INTERNAL_FLAG_ERR)) return PAMU_ERR_INVALID_ADDRESS;
+  if (len > UINT32_MAX) return PAMU_ERR_OUT_OF_BOUNDS;
+  char  *frame;
+  size_t size = _pamu_frame_pack(buf, len, &frame);
+  int    rc   = (int64_t)size > sizeFlags ? PAMU_ERR_OUT_OF_BOUNDS : _pamu_blob_write(fd, addr, frame, size);
+  free(frame);
+  return rc;
+}
+
+// Reads the first len bytes of a blob on a compressed medium
+int _pamu_frame_load(int fd, PAMU_T_POINTER addr, void *buf, size_t len) {
+  uint32_t length, packed;
+  if (_pamu_frame_read(fd, addr, &length, &packed)) return PAMU_ERR_READ_MALFORMED;
+  if (len > length) return PAMU_ERR_OUT_OF_BOUNDS;
+  if (!packed) {
+    return _pamu_read(fd, addr + PAMU_FRAME_SIZE, buf, len) == (ssize_t)len ? 0 : PAMU_ERR_READ_MALFORMED;
+  }
+
+  // Partial reads still need the whole blob decompressed
+  uint8_t *data   = malloc(packed + ((len < length) ? length : 0));
+  uint8_t *target = (len < length) ? data + packed : buf;
+  int      rc     = PAMU_ERR_READ_MALFORMED;
+  if (_pamu_read(fd, addr + PAMU_FRAME_SIZE, data, packed) == packed) {
+    rc = _pamu_lz_decompress(data, packed, target, length);
+  }
+  if ((!rc) && (target != buf)) memcpy(buf, target, len);
+  free(data);
+  return rc;
+}
+
+int pamu_write(int fd, PAMU_T_POINTER addr, const void *buf, size_t len) {
+  _pamu_tier_route(&fd, &addr);
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (int)(intptr_t)stat;
+
+  // Catch out-of-bounds, compressed media store whole blobs
+  int framed = stat->flags & PAMU_COMPRESS;
+  if (
+    (addr < stat->headerSize) ||
+    (addr + (int64_t)(framed ? PAMU_FRAME_SIZE : len) > stat->mediumSize)
+  ) {
+    free(stat);
+    return PAMU_ERR_OUT_OF_BOUNDS;
+  }
+
+  // Shared blobs are found by their content, which must not change under
+  // the other references or the stored hash
+  uint64_t hash;
+  uint32_t refs, length;
+  if ((stat->flags & PAMU_DEDUP) && !_pamu_trailer_read(fd, addr, &hash, &refs, &length) && hash) {
+    free(stat);
+    return PAMU_ERR_NOT_SUPPORTED;
+  }
+  free(stat);
+  if (framed) return _pamu_frame_write(fd, addr, buf, len);
+
+  return _pamu_blob_write(fd, addr, buf, len);
+}
+
+int pamu_read(int fd, PAMU_T_POINTER addr, void *buf, size_t len) {
+  _pamu_tier_route(&fd, &addr);
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (int)(intptr_t)stat;
+
+  // Catch out-of-bounds, compressed media decompress whole blobs
+  int framed = stat->flags & PAMU_COMPRESS;
+  if (
+    (addr < stat->headerSize) ||
+    (addr + (int64_t)(framed ? PAMU_FRAME_SIZE : len) > stat->mediumSize)
+  ) {
+    free(stat);
+    return PAMU_ERR_OUT_OF_BOUNDS;
+  }
+  free(stat);
+  if (framed) return _pamu_frame_load(fd, addr, buf, len);
+
+  return _pamu_read(fd, addr, buf, len) < 0 ? PAMU_ERR_READ_MALFORMED : 0;
+}
+
+// Uses outer address of a free block (or the medium end when growing)
+// Returns inner address of the allocated blob
+PAMU_T_POINTER _pamu_alloc_block(int fd, struct pamu_medium_stat *stat, PAMU_T_POINTER block, PAMU_T_MARKER size) {
+
+  // Fetch or build block size
+  PAMU_T_MARKER blockSize = block == stat->mediumSize
+    ? size
+    : _pamu_find_size(fd, block);
+  PAMU_T_MARKER blockMarker = hton(blockSize | PAMU_INTERNAL_FLAG_FREE);
+
+  // No longer free, a split remainder is indexed again below
+  _pamu_index_del(fd, block);
+  _pamu_guard(fd, block + PAMU_T_MARKER_SIZE, block + PAMU_T_MARKER_SIZE + (2 * PAMU_T_POINTER_SIZE));
 
   // Split free block if large enough
   int64_t zero = 0;
-  PAMU_T_POINTER previousFree;
-  PAMU_T_POINTER nextFree;
-  PAMU_T_POINTER newFree;
-  PAMU_T_MARKER  newFreeSize;
-  PAMU_T_MARKER  newFreeMarker;
-  PAMU_T_POINTER beBlock = hton(block);
-  if ((blockSize - size) > ((2 * PAMU_T_POINTER_SIZE) + (2*PAMU_T_MARKER_SIZE))) {
-    lseek(fd, block + PAMU_T_MARKER_SIZE, SEEK_SET);
-    read(fd, &previousFree, PAMU_T_POINTER_SIZE);
-    read(fd, &nextFree, PAMU_T_POINTER_SIZE);
+  PAMU_T_POINTER previousFree;
+  PAMU_T_POINTER nextFree;
+  PAMU_T_POINTER newFree;
+  PAMU_T_MARKER  newFreeSize;
+  PAMU_T_MARKER  newFreeMarker;
+  PAMU_T_POINTER beBlock = hton(block);
+  if ((blockSize - size) > ((2 * PAMU_T_POINTER_SIZE) + (2*PAMU_T_MARKER_SIZE))) {
+    _pamu_read(fd, block + PAMU_T_MARKER_SIZE, &previousFree, PAMU_T_POINTER_SIZE);
+    _pamu_read(fd, block + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, &nextFree, PAMU_T_POINTER_SIZE);
+
+    newFree       = hton((PAMU_T_POINTER)(block     + size + (2 * PAMU_T_MARKER_SIZE)));
+    newFreeSize   =          blockSize - size - (2 * PAMU_T_MARKER_SIZE) ;
+    newFreeMarker = hton((PAMU_T_MARKER)(newFreeSize | PAMU_INTERNAL_FLAG_FREE));
+
+    // Build new free block first, concurrent readers may follow the current
+    // block's start marker as soon as it shrinks
+    _pamu_write(fd, ntoh(newFree)                                      , &newFreeMarker, PAMU_T_MARKER_SIZE); // Start marker
+    _pamu_write(fd, ntoh(newFree) + PAMU_T_MARKER_SIZE                 , &beBlock      , PAMU_T_POINTER_SIZE); // Previous/current free
+    _pamu_write(fd, ntoh(newFree) + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, &nextFree, PAMU_T_POINTER_SIZE); // Next free
+    _pamu_write(fd, ntoh(newFree) + newFreeSize + PAMU_T_MARKER_SIZE   , &newFreeMarker, PAMU_T_MARKER_SIZE); // End marker
+
+    // Update the current block
+    blockSize   = size;
+    blockMarker = hton(blockSize | PAMU_INTERNAL_FLAG_FREE);
+    _pamu_write(fd, block                                              , &blockMarker , PAMU_T_MARKER_SIZE);  // Start marker
+    _pamu_write(fd, block + PAMU_T_MARKER_SIZE                         , &previousFree, PAMU_T_POINTER_SIZE); // Previous free
+    _pamu_write(fd, block + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE   , &newFree     , PAMU_T_POINTER_SIZE); // Next/new free
+    _pamu_write(fd, block + blockSize + PAMU_T_MARKER_SIZE             , &blockMarker , PAMU_T_MARKER_SIZE);  // End marker
+
+    // Update next block to point it's previous to the new free
+    if (nextFree) {
+      _pamu_write(fd, ntoh(nextFree) + PAMU_T_MARKER_SIZE, &newFree, PAMU_T_POINTER_SIZE);
+    }
+
+    _pamu_index_set(fd, ntoh(newFree), newFreeSize);
+    PAMU_PROBE(split, PAMU_TRACE_SPLIT, fd, ntoh(newFree), newFreeSize);
+
+    // And the new free is now our next free
+    nextFree = newFree;
+    // No need to update previous free block in this step
+  }
+
+  // Grow medium in dynamic mode
+  // Init as free block without prev/next
+  int grown = 0;
+  if (
+    (stat->flags & PAMU_DYNAMIC) &&
+    (block == stat->mediumSize)
+  ) {
+    grown = 1;
+    PAMU_PROBE(grow, PAMU_TRACE_GROW, fd, block, blockSize);
+    _pamu_write(fd, block                                           , &blockMarker, PAMU_T_MARKER_SIZE);  // Start marker
+    _pamu_write(fd, block + PAMU_T_MARKER_SIZE                      , &zero       , PAMU_T_POINTER_SIZE); // Previous free
+    _pamu_write(fd, block + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, &zero       , PAMU_T_POINTER_SIZE); // Next free
+    _pamu_write(fd, block + blockSize + PAMU_T_MARKER_SIZE          , &blockMarker, PAMU_T_MARKER_SIZE);  // End marker
+  }
+
+  // Mark the current block as allocated & read previous/next free pointers
+  blockMarker = hton(blockSize);
+  _pamu_write(fd, block, &blockMarker, PAMU_T_MARKER_SIZE);
+  _pamu_read(fd, block + PAMU_T_MARKER_SIZE                      , &previousFree, PAMU_T_POINTER_SIZE);
+  _pamu_read(fd, block + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, &nextFree    , PAMU_T_POINTER_SIZE);
+  _pamu_write(fd, block + blockSize + PAMU_T_MARKER_SIZE, &blockMarker, PAMU_T_MARKER_SIZE);
+  if (grown) _pamu_publish(_pamu_state(fd), block + blockSize + (2 * PAMU_T_MARKER_SIZE));
+
+  // Update the previous free's next pointer
+  if (previousFree) {
+    _pamu_write(fd, ntoh(previousFree) + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, &nextFree, PAMU_T_POINTER_SIZE);
+  }
+
+  // Update the next free's previous pointer
+  if (nextFree) {
+    _pamu_write(fd, ntoh(nextFree) + PAMU_T_MARKER_SIZE, &previousFree, PAMU_T_POINTER_SIZE);
+  }
+
+  // The blob is the application's now
+  _pamu_claim(fd, block + PAMU_T_MARKER_SIZE, block + PAMU_T_MARKER_SIZE + blockSize);
+
+  // Return pointer to innards
+  return block + PAMU_T_MARKER_SIZE;
+}
+
+// Uses first-fit from the start of the medium
+// Returns inner address or error
+PAMU_T_POINTER _pamu_alloc_fit(int fd, struct pamu_medium_stat *stat, PAMU_T_MARKER size) {
+
+  // Find a pre-existing block with the correct size (or throw error)
+  PAMU_T_POINTER block = _pamu_find_free_block(fd, stat->headerSize, stat->mediumSize, size);
+
+  // Error during finding
+  if (block < 0) {
+    return block;
+  }
+
+  // Coalesce lazily freed blocks before giving up or growing the medium
+  struct pamu_state *state = _pamu_state(fd);
+  if (
+    (block == stat->mediumSize) &&
+    (stat->flags & PAMU_LAZY) &&
+    ((!state) || (!state->pendingScanned) || state->pendingCount)
+  ) {
+    int rc = pamu_maintain(fd, 0);
+    if (rc < 0) return rc;
+    struct pamu_medium_stat *fresh = _pamu_medium_stat(fd);
+    if (fresh < 0) return (PAMU_T_POINTER)(intptr_t)fresh;
+    memcpy(stat, fresh, sizeof(struct pamu_medium_stat));
+    free(fresh);
+    rc = _pamu_journal_reserve(fd, PAMU_JOURNAL_OP_RESERVE);
+    if (rc) return rc;
+    block = _pamu_find_free_block(fd, stat->headerSize, stat->mediumSize, size);
+    if (block < 0) {
+      return block;
+    }
+  }
+
+  // Throw error if non-dynamic & not enough space
+  if (
+    (block + (2*PAMU_T_MARKER_SIZE) + size >= stat->mediumSize) &&
+    (!(stat->flags & PAMU_DYNAMIC))
+  ) {
+    return PAMU_ERR_MEDIUM_FULL;
+  }
+
+  // Here = got the space
+  return _pamu_alloc_block(fd, stat, block, size);
+}
+
+// Uses outer address of a free block large enough to split
+// Carves the blob from the end, leaving the block's free list links intact
+PAMU_T_POINTER _pamu_alloc_block_tail(int fd, PAMU_T_POINTER block, PAMU_T_MARKER blockSize, PAMU_T_MARKER size) {
+  PAMU_T_MARKER  freeSize    = blockSize - size - (2 * PAMU_T_MARKER_SIZE);
+  PAMU_T_MARKER  freeMarker  = hton((PAMU_T_MARKER)(freeSize | PAMU_INTERNAL_FLAG_FREE));
+  PAMU_T_MARKER  blockMarker = hton(size);
+  PAMU_T_POINTER allocated   = block + freeSize + (2 * PAMU_T_MARKER_SIZE);
+
+  // Build the allocated block first, concurrent readers may follow the free
+  // block's start marker as soon as it shrinks
+  _pamu_write(fd, allocated                            , &blockMarker, PAMU_T_MARKER_SIZE); // Start marker
+  _pamu_write(fd, allocated + size + PAMU_T_MARKER_SIZE, &blockMarker, PAMU_T_MARKER_SIZE); // End marker
+
+  // And shrink the free block in front of it
+  _pamu_write(fd, block                                , &freeMarker, PAMU_T_MARKER_SIZE); // Start marker
+  _pamu_write(fd, block + freeSize + PAMU_T_MARKER_SIZE, &freeMarker, PAMU_T_MARKER_SIZE); // End marker
+  _pamu_index_set(fd, block, freeSize);
+  PAMU_PROBE(split, PAMU_TRACE_SPLIT, fd, block, freeSize);
+
+  // The blob is the application's now
+  _pamu_claim(fd, allocated + PAMU_T_MARKER_SIZE, allocated + PAMU_T_MARKER_SIZE + size);
+
+  return allocated + PAMU_T_MARKER_SIZE;
+}
+
+// Builds the free index by walking the free list, which is address-ordered
+int _pamu_index_build(int fd, struct pamu_medium_stat *stat, struct pamu_state *state) {
+  if (state->indexBuilt) return 0;
+  state->indexCount = 0;
+  state->indexBuilt = 1;
+
+  PAMU_T_POINTER current = stat->headerSize;
+  PAMU_T_POINTER beNext;
+  PAMU_T_MARKER  csize, cflags;
+  while(
+    current &&
+    (current < stat->mediumSize)
+  ) {
+    csize  = _pamu_find_size(fd, current);
+    cflags = _pamu_find_flags(fd, current);
+    if ((csize < 0) || (cflags & (~PAMU_INTERNAL_FLAGS))) {
+      state->indexBuilt = 0;
+      return PAMU_ERR_READ_MALFORMED;
+    }
+
+    // Allocated blocks are only walked until the first free one
+    if (!(cflags & PAMU_INTERNAL_FLAG_FREE)) {
+      current += csize + (2 * PAMU_T_MARKER_SIZE);
+      continue;
+    }
+
+    _pamu_index_set(fd, current, csize);
+    if (_pamu_read(fd, current + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, &beNext, PAMU_T_POINTER_SIZE) != PAMU_T_POINTER_SIZE) {
+      state->indexBuilt = 0;
+      return PAMU_ERR_READ_MALFORMED;
+    }
+    current = ntoh(beNext);
+  }
+
+  return 0;
+}
+
+// Address of bitmap word w of a record pool
+int64_t _pamu_pool_word_addr(struct pamu_state *state, int64_t w) {
+  return state->headerSize + ((w / PAMU_POOL_WORDS) * state->chunkSize) + ((w % PAMU_POOL_WORDS) * sizeof(uint64_t));
+}
+
+// Address of record i of a record pool
+int64_t _pamu_pool_record(struct pamu_state *state, int64_t i) {
+  return state->headerSize + ((i / PAMU_POOL_CHUNK) * state->chunkSize) + PAMU_POOL_BITMAP + ((i % PAMU_POOL_CHUNK) * state->recordSize);
+}
+
+// Index of the record at addr, or error if it's not the start of one
+int64_t _pamu_pool_index(struct pamu_state *state, PAMU_T_POINTER addr) {
+  int64_t offset = addr - state->headerSize;
+  int64_t within = (offset % state->chunkSize) - PAMU_POOL_BITMAP;
+  if ((offset < 0) || (within < 0) || (within % state->recordSize)) return PAMU_ERR_INVALID_ADDRESS;
+  return ((offset / state->chunkSize) * PAMU_POOL_CHUNK) + (within / state->recordSize);
+}
+
+// Reads bitmap word w, chunks past the end of the medium are empty
+int _pamu_pool_read(int fd, struct pamu_state *state, int64_t mediumSize, int64_t w, uint64_t *word) {
+  int64_t  addr = _pamu_pool_word_addr(state, w);
+  uint64_t beWord;
+  *word = 0;
+  if (addr + (int64_t)sizeof(uint64_t) > mediumSize) return 0;
+  if (_pamu_read(fd, addr, &beWord, sizeof(uint64_t)) != sizeof(uint64_t)) return PAMU_ERR_READ_MALFORMED;
+  *word = ntoh(beWord);
+  return 0;
+}
+
+int _pamu_pool_write(int fd, struct pamu_state *state, int64_t w, uint64_t word) {
+  uint64_t beWord = hton(word);
+  return _pamu_write(fd, _pamu_pool_word_addr(state, w), &beWord, sizeof(uint64_t)) < 0 ? PAMU_ERR_WRITE : 0;
+}
+
+// Takes the lowest free slot from the bitmaps, a word at a time
+PAMU_T_POINTER _pamu_pool_alloc(int fd, struct pamu_medium_stat *stat, PAMU_T_MARKER size) {
+  struct pamu_state *state = _pamu_state_require(fd, stat);
+  if (!state) return PAMU_ERR_READ_MALFORMED;
+  if (size > (PAMU_T_MARKER)state->recordSize) return PAMU_ERR_OUT_OF_BOUNDS;
+
+  // Make sure this operation fits in the current journal group
+  int rc = _pamu_journal_reserve(fd, PAMU_JOURNAL_OP_RESERVE);
+  if (rc) return rc;
+
+  int64_t  w, index;
+  uint64_t word;
+  for(w = state->poolHint; ; w++) {
+    rc = _pamu_pool_read(fd, state, stat->mediumSize, w, &word);
+    if (rc) return rc;
+    if (word != UINT64_MAX) break;
+  }
+  state->poolHint = w;
+  index = (w * 64) + __builtin_ctzll(~word);
+
+  // Static pools end at their last whole record, dynamic ones grow to it
+  int64_t record = _pamu_pool_record(state, index);
+  if (record + state->recordSize > stat->mediumSize) {
+    if (!(stat->flags & PAMU_DYNAMIC)) return PAMU_ERR_MEDIUM_FULL;
+    rc = _pamu_truncate(fd, record + state->recordSize);
+    if (rc) return rc;
+  }
+
+  rc = _pamu_pool_write(fd, state, w, word | ((uint64_t)1 << (index % 64)));
+  return rc ? rc : record;
+}
+
+int _pamu_pool_free(int fd, struct pamu_medium_stat *stat, PAMU_T_POINTER addr) {
+  struct pamu_state *state = _pamu_state_require(fd, stat);
+  if (!state) return PAMU_ERR_READ_MALFORMED;
+  int64_t index = _pamu_pool_index(state, addr);
+  if (index < 0) return (int)index;
+
+  int64_t  w   = index / 64;
+  uint64_t bit = (uint64_t)1 << (index % 64);
+  uint64_t word;
+  int      rc  = _pamu_pool_read(fd, state, stat->mediumSize, w, &word);
+  if (rc) return rc;
+  if (!(word & bit)) return PAMU_ERR_DOUBLE_FREE;
+  rc = _pamu_pool_write(fd, state, w, word & ~bit);
+  if (rc) return rc;
+  if (w < state->poolHint) state->poolHint = w;
+
+  // Dynamic pools give back the space after their last record
+  if ((!(stat->flags & PAMU_DYNAMIC)) || (addr + state->recordSize < stat->mediumSize)) return 0;
+  word &= ~bit;
+  while(!word) {
+    if (!w--) return _pamu_truncate(fd, state->headerSize);
+    rc = _pamu_pool_read(fd, state, stat->mediumSize, w, &word);
+    if (rc) return rc;
+  }
+  return _pamu_truncate(fd, _pamu_pool_record(state, (w * 64) + 63 - __builtin_clzll(word)) + state->recordSize);
+}
+
+// Next allocated record after addr, skipping empty bitmap words whole
+PAMU_T_POINTER _pamu_pool_next(int fd, struct pamu_medium_stat *stat, PAMU_T_POINTER addr) {
+  struct pamu_state *state = _pamu_state_require(fd, stat);
+  if (!state) return PAMU_ERR_READ_MALFORMED;
+  int64_t index = 0;
+  if (addr >= (PAMU_T_POINTER)state->headerSize) {
+    index = _pamu_pool_index(state, addr);
+    if (index < 0) return index;
+    index++;
+  }
+
+  int64_t  w = index / 64;
+  uint64_t word;
+  int      rc = _pamu_pool_read(fd, state, stat->mediumSize, w, &word);
+  if (rc) return rc;
+  word &= ~(((uint64_t)1 << (index % 64)) - 1);
+  while(!word) {
+    w++;
+    if (_pamu_pool_word_addr(state, w) >= stat->mediumSize) return 0;
+    rc = _pamu_pool_read(fd, state, stat->mediumSize, w, &word);
+    if (rc) return rc;
+  }
+  int64_t record = _pamu_pool_record(state, (w * 64) + __builtin_ctzll(word));
+  return (record + state->recordSize <= stat->mediumSize) ? record : 0;
+}
+
+// Returns inner address or error
+PAMU_T_POINTER _pamu_alloc(int fd, PAMU_T_MARKER size) {
+  if (size <= 0) return PAMU_ERR_NEGATIVE_SIZE;
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (PAMU_T_POINTER)(intptr_t)stat;
+
+  // Record pools hand out fixed-size slots
+  if (stat->flags & PAMU_POOL) {
+    PAMU_T_POINTER record = _pamu_pool_alloc(fd, stat, size);
+    free(stat);
+    return record;
+  }
+
+  // Room for a frame or trailer, if the medium keeps one
+  int32_t       flags  = stat->flags;
+  PAMU_T_MARKER length = size;
+  size += _pamu_blob_overhead(flags);
+  if (size < (2*PAMU_T_POINTER_SIZE)) size = 2*PAMU_T_POINTER_SIZE;
+
+  // Make sure this operation fits in the current journal group
+  int rc = _pamu_journal_reserve(fd, PAMU_JOURNAL_OP_RESERVE);
+  if (rc) {
+    free(stat);
+    return rc;
+  }
+
+  PAMU_T_POINTER addr = _pamu_alloc_fit(fd, stat, size);
+  free(stat);
+  if ((addr > 0) && _pamu_blob_init(fd, flags, addr, length)) return PAMU_ERR_WRITE;
+  return addr;
+}
+
+PAMU_T_POINTER pamu_alloc(int fd, PAMU_T_MARKER size) {
+  PAMU_PROBE_ENTRY(alloc__entry, PAMU_TRACE_ALLOC_ENTRY, fd, 0, size);
+  PAMU_T_POINTER bit;
+  int            tier = _pamu_tier_pick(fd, size, &bit);
+  PAMU_T_POINTER addr = _pamu_tier_mark(tier, _pamu_alloc(tier, size), bit);
+  PAMU_PROBE_EXIT(alloc__exit, PAMU_TRACE_ALLOC_EXIT, fd, addr, size);
+  return addr;
+}
+
+// Returns inner address or error
+PAMU_T_POINTER pamu_alloc_near(int fd, PAMU_T_MARKER size, PAMU_T_POINTER hint) {
+  if (size <= 0) return PAMU_ERR_NEGATIVE_SIZE;
+  PAMU_T_POINTER bit;
+  int tier = _pamu_tier_pick(fd, size, &bit);
+  if (tier != fd) return _pamu_tier_mark(tier, pamu_alloc_near(tier, size, hint & ~bit), bit);
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (PAMU_T_POINTER)(intptr_t)stat;
+
+  // Record pools hand out fixed-size slots
+  if (stat->flags & PAMU_POOL) {
+    PAMU_T_POINTER record = _pamu_pool_alloc(fd, stat, size);
+    free(stat);
+    return record;
+  }
+
+  // Room for a frame or trailer, if the medium keeps one
+  int32_t       flags  = stat->flags;
+  PAMU_T_MARKER length = size;
+  size += _pamu_blob_overhead(flags);
+  if (size < (2*PAMU_T_POINTER_SIZE)) size = 2*PAMU_T_POINTER_SIZE;
+
+  // Make sure this operation fits in the current journal group
+  int rc = _pamu_journal_reserve(fd, PAMU_JOURNAL_OP_RESERVE);
+  if (rc) {
+    free(stat);
+    return rc;
+  }
+
+  struct pamu_state *state = _pamu_state_require(fd, stat);
+  if (!state) {
+    free(stat);
+    return PAMU_ERR_READ_MALFORMED;
+  }
+  rc = _pamu_index_build(fd, stat, state);
+  if (rc) {
+    free(stat);
+    return rc;
+  }
+
+  // Nearest fitting free block after the hint
+  size_t  i     = _pamu_index_find(state, hint);
+  size_t  right = i;
+  int64_t rightDistance = -1;
+  while((right < state->indexCount) && (right - i < PAMU_NEAR_WINDOW)) {
+    if (state->index[right].size >= size) {
+      rightDistance = state->index[right].addr - hint;
+      break;
+    }
+    right++;
+  }
+
+  // Nearest fitting free block before the hint, measured from it's end
+  size_t  left = i;
+  int64_t leftDistance = -1;
+  while((left > 0) && (i - left < PAMU_NEAR_WINDOW)) {
+    left--;
+    if (state->index[left].size >= size) {
+      leftDistance = hint - (state->index[left].addr + state->index[left].size + (2 * PAMU_T_MARKER_SIZE));
+      break;
+    }
+  }
+
+  PAMU_T_POINTER addr;
+  if ((leftDistance >= 0) && ((rightDistance < 0) || (leftDistance < rightDistance))) {
+    // Take the tail of the block before the hint, closest to it
+    if ((state->index[left].size - size) > ((2 * PAMU_T_POINTER_SIZE) + (2 * PAMU_T_MARKER_SIZE))) {
+      addr = _pamu_alloc_block_tail(fd, state->index[left].addr, state->index[left].size, size);
+    } else {
+      addr = _pamu_alloc_block(fd, stat, state->index[left].addr, size);
+    }
+  } else if (rightDistance >= 0) {
+    addr = _pamu_alloc_block(fd, stat, state->index[right].addr, size);
+  } else {
+    // Nothing nearby, regular allocation
+    addr = _pamu_alloc_fit(fd, stat, size);
+  }
+
+  free(stat);
+  if ((addr > 0) && _pamu_blob_init(fd, flags, addr, length)) return PAMU_ERR_WRITE;
+  return addr;
+}
+
+// Returns inner address or error
+PAMU_T_POINTER pamu_alloc_group(int fd, PAMU_T_MARKER size, uint64_t group) {
+  if (!group) return pamu_alloc(fd, size);
+  PAMU_T_POINTER bit;
+  int tier = _pamu_tier_pick(fd, size, &bit);
+  if (tier != fd) return _pamu_tier_mark(tier, pamu_alloc_group(tier, size, group), bit);
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (PAMU_T_POINTER)(intptr_t)stat;
+  struct pamu_state *state = _pamu_state_require(fd, stat);
+  free(stat);
+  if (!state) return PAMU_ERR_READ_MALFORMED;
+
+  // Keep the group table at most half full
+  size_t i, slot;
+  struct pamu_group *old;
+  if ((state->groupCount + 1) * 2 > state->groupLimit) {
+    old               = state->groups;
+    i                 = state->groupLimit;
+    state->groupLimit = MAX(state->groupLimit * 2, 64);
+    state->groups     = calloc(state->groupLimit, sizeof(struct pamu_group));
+    while(i--) {
+      if (!old[i].group) continue;
+      slot = _pamu_hash(&old[i].group, sizeof(uint64_t), 0) % state->groupLimit;
+      while(state->groups[slot].group) slot = (slot + 1) % state->groupLimit;
+      state->groups[slot] = old[i];
+    }
+    free(old);
+  }
+
+  // Find the group's slot, new groups start near the beginning
+  slot = _pamu_hash(&group, sizeof(uint64_t), 0) % state->groupLimit;
+  while(state->groups[slot].group && (state->groups[slot].group != group)) {
+    slot = (slot + 1) % state->groupLimit;
+  }
+
+  PAMU_T_POINTER addr = pamu_alloc_near(fd, size, state->groups[slot].addr);
+  if (addr <= 0) return addr;
+
+  // Next member of the family goes next to this one
+  if (!state->groups[slot].group) state->groupCount++;
+  state->groups[slot].group = group;
+  state->groups[slot].addr  = addr;
+  return addr;
+}
+
+PAMU_T_POINTER pamu_put(int fd, const void *buf, size_t len) {
+  if (len > UINT32_MAX) return PAMU_ERR_OUT_OF_BOUNDS;
+  PAMU_T_POINTER bit;
+  int tier = _pamu_tier_pick(fd, len, &bit);
+  if (tier != fd) return _pamu_tier_mark(tier, pamu_put(tier, buf, len), bit);
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (PAMU_T_POINTER)(intptr_t)stat;
+  if (!(stat->flags & PAMU_COMPRESS)) {
+    free(stat);
+    return PAMU_ERR_NOT_SUPPORTED;
+  }
+
+  // Make sure this operation fits in the current journal group
+  int rc = _pamu_journal_reserve(fd, PAMU_JOURNAL_OP_RESERVE);
+  if (rc) {
+    free(stat);
+    return rc;
+  }
+
+  // Only take the space the data compresses to
+  char          *frame;
+  PAMU_T_MARKER  size = _pamu_frame_pack(buf, len, &frame);
+  PAMU_T_POINTER addr = _pamu_alloc_fit(fd, stat, MAX(size, (PAMU_T_MARKER)(2*PAMU_T_POINTER_SIZE)));
+  free(stat);
+  if ((addr > 0) && _pamu_blob_write(fd, addr, frame, size)) addr = PAMU_ERR_WRITE;
+  free(frame);
+  return addr;
+}
+
+// Adds a deduplicated blob to the index, kept at most half full
+void _pamu_dedup_add(struct pamu_state *state, uint64_t hash, int64_t addr) {
+  size_t i, slot;
+  struct pamu_dedup *old;
+  if ((state->dedupCount + 1) * 2 > state->dedupLimit) {
+    old               = state->dedup;
+    i                 = state->dedupLimit;
+    state->dedupLimit = MAX(state->dedupLimit * 2, 64);
+    state->dedup      = calloc(state->dedupLimit, sizeof(struct pamu_dedup));
+    state->dedupCount = 0;
+    while(i--) {
+      if (!old[i].addr) continue;
+      slot = old[i].hash % state->dedupLimit;
+      while(state->dedup[slot].hash) slot = (slot + 1) % state->dedupLimit;
+      state->dedup[slot] = old[i];
+      state->dedupCount++;
+    }
+    free(old);
+  }
+  slot = hash % state->dedupLimit;
+  while(state->dedup[slot].hash) slot = (slot + 1) % state->dedupLimit;
+  state->dedup[slot].hash = hash;
+  state->dedup[slot].addr = addr;
+  state->dedupCount++;
+}
+
+// Rebuilds the index by reading the trailer of every allocated blob
+int _pamu_dedup_scan(int fd, struct pamu_medium_stat *stat, struct pamu_state *state) {
+  free(state->dedup);
+  state->dedup        = NULL;
+  state->dedupCount   = 0;
+  state->dedupLimit   = 0;
+  state->dedupScanned = 1;
+
+  PAMU_T_POINTER current = stat->headerSize;
+  PAMU_T_MARKER  csize, cflags;
+  uint64_t       hash;
+  uint32_t       refs, length;
+  while(current < stat->mediumSize) {
+    csize  = _pamu_find_size(fd, current);
+    cflags = _pamu_find_flags(fd, current);
+    if ((csize < 0) || (cflags & (~PAMU_INTERNAL_FLAGS))) {
+      state->dedupScanned = 0;
+      return PAMU_ERR_READ_MALFORMED;
+    }
+    if (!cflags) {
+      if (_pamu_trailer_read(fd, current + PAMU_T_MARKER_SIZE, &hash, &refs, &length)) {
+        state->dedupScanned = 0;
+        return PAMU_ERR_READ_MALFORMED;
+      }
+      if (hash) _pamu_dedup_add(state, hash, current + PAMU_T_MARKER_SIZE);
+    }
+    current += csize + (2 * PAMU_T_MARKER_SIZE);
+  }
+
+  return 0;
+}
+
+// Drops the reference of a blob being freed
+// Returns 1 while other references remain, 0 when it's to be freed or error
+int _pamu_dedup_release(int fd, struct pamu_state *state, PAMU_T_POINTER addr) {
+  uint64_t hash;
+  uint32_t refs, length;
+  if (_pamu_trailer_read(fd, addr, &hash, &refs, &length)) return PAMU_ERR_READ_MALFORMED;
+  if (!hash) return 0;
+  if (refs > 1) {
+    return _pamu_trailer_write(fd, addr, hash, refs - 1, length) ? PAMU_ERR_WRITE : 1;
+  }
+
+  // Last reference, the content can no longer be shared
+  size_t slot;
+  if ((!state) || (!state->dedupScanned) || (!state->dedupLimit)) return 0;
+  slot = hash % state->dedupLimit;
+  while(state->dedup[slot].hash) {
+    if ((state->dedup[slot].hash == hash) && (state->dedup[slot].addr == addr)) {
+      state->dedup[slot].addr = 0;
+      break;
+    }
+    slot = (slot + 1) % state->dedupLimit;
+  }
+  return 0;
+}
+
+PAMU_T_POINTER pamu_alloc_dedup(int fd, const void *buf, size_t len) {
+  if (!len) return PAMU_ERR_NEGATIVE_SIZE;
+  if (len > UINT32_MAX) return PAMU_ERR_OUT_OF_BOUNDS;
+  PAMU_T_POINTER bit;
+  int tier = _pamu_tier_pick(fd, len, &bit);
+  if (tier != fd) return _pamu_tier_mark(tier, pamu_alloc_dedup(tier, buf, len), bit);
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (PAMU_T_POINTER)(intptr_t)stat;
+  if (!(stat->flags & PAMU_DEDUP)) {
+    free(stat);
+    return PAMU_ERR_NOT_SUPPORTED;
+  }
+  struct pamu_state *state = _pamu_state_require(fd, stat);
+  if (!state) {
+    free(stat);
+    return PAMU_ERR_READ_MALFORMED;
+  }
+  int rc = state->dedupScanned ? 0 : _pamu_dedup_scan(fd, stat, state);
+  if (rc) {
+    free(stat);
+    return rc;
+  }
+
+  // Make sure this operation fits in the current journal group
+  rc = _pamu_journal_reserve(fd, PAMU_JOURNAL_OP_RESERVE);
+  if (rc) {
+    free(stat);
+    return rc;
+  }
+
+  // Same content = same hash, compared in full to rule out collisions
+  uint64_t       hash = _pamu_hash(buf, len, 0);
+  uint64_t       otherHash;
+  uint32_t       refs, length;
+  char          *other = NULL;
+  size_t         slot;
+  PAMU_T_POINTER addr;
+  if (!hash) hash = 1;
+  for(slot = hash % MAX(state->dedupLimit, 1); state->dedupLimit && state->dedup[slot].hash; slot = (slot + 1) % state->dedupLimit) {
+    addr = state->dedup[slot].addr;
+    if ((state->dedup[slot].hash != hash) || (!addr)) continue;
+    if (_pamu_trailer_read(fd, addr, &otherHash, &refs, &length)) continue;
+    if ((length != len) || (refs == UINT32_MAX)) continue;
+    if (!other) other = malloc(len);
+    if (_pamu_read(fd, addr, other, len) != (ssize_t)len) continue;
+    if (memcmp(other, buf, len)) continue;
+    free(other);
+    free(stat);
+    return _pamu_trailer_write(fd, addr, hash, refs + 1, length) ? PAMU_ERR_WRITE : addr;
+  }
+  free(other);
+
+  // New content, stored once
+  PAMU_T_MARKER size = MAX((PAMU_T_MARKER)(len + PAMU_TRAILER_SIZE), (PAMU_T_MARKER)(2*PAMU_T_POINTER_SIZE));
+  addr = _pamu_alloc_fit(fd, stat, size);
+  free(stat);
+  if (addr <= 0) return addr;
+  if (_pamu_blob_write(fd, addr, buf, len) || _pamu_trailer_write(fd, addr, hash, 1, len)) return PAMU_ERR_WRITE;
+  _pamu_dedup_add(state, hash, addr);
+  return addr;
+}
+
+// Appends to the bulk write stream, writing it out when full
+int _pamu_bulk_append(int fd, char *buffer, size_t *used, int64_t *flushed, const void *data, size_t len) {
+
+  // No data = skip over the range, leaving whatever is there
+  if (!data) {
+    if (*used && (_pamu_medium_write(fd, *flushed, buffer, *used) < 0)) return PAMU_ERR_WRITE;
+    *flushed += *used + len;
+    *used     = 0;
+    return 0;
+  }
+
+  if (*used + len > PAMU_BULK_BUFFER) {
+    if (_pamu_medium_write(fd, *flushed, buffer, *used) < 0) return PAMU_ERR_WRITE;
+    *flushed += *used;
+    *used     = 0;
+  }
+  if (len > PAMU_BULK_BUFFER) {
+    if (_pamu_medium_write(fd, *flushed, data, len) < 0) return PAMU_ERR_WRITE;
+    *flushed += len;
+    return 0;
+  }
+  memcpy(buffer + *used, data, len);
+  *used += len;
+  return 0;
+}
+
+// Returns the number of blobs loaded or error
+int pamu_bulk_load(int fd, pamu_bulk_next next, void *udata) {
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (int)(intptr_t)stat;
+  if (stat->flags & PAMU_POOL) {
+    free(stat);
+    return PAMU_ERR_NOT_SUPPORTED;
+  }
+  struct pamu_state *state = _pamu_state_require(fd, stat);
+  if (!state) {
+    free(stat);
+    return PAMU_ERR_READ_MALFORMED;
+  }
+  if (state->txn) {
+    free(stat);
+    return PAMU_ERR_TXN;
+  }
+
+  // Only a fresh medium can be written sequentially
+  uint32_t       flags = stat->flags;
+  PAMU_T_POINTER start = stat->headerSize;
+  int64_t        end   = stat->mediumSize;
+  PAMU_T_MARKER  empty = end - start - (2 * PAMU_T_MARKER_SIZE);
+  if (
+    (flags & PAMU_DYNAMIC)
+      ? (end != start)
+      : (_pamu_find_sizeFlags(fd, start) != (empty | PAMU_INTERNAL_FLAG_FREE))
+  ) {
+    free(stat);
+    return PAMU_ERR_NOT_SUPPORTED;
+  }
+
+  free(stat);
+
+  // Make sure the final metadata fits in the current journal group
+  int rc = _pamu_journal_reserve(fd, PAMU_JOURNAL_OP_RESERVE);
+  if (rc) return rc;
+
+  // Stream blobs with their boundary tags, the bytes holding the empty
+  // medium's free block are written last so it stays intact until the load
+  // is complete
+  char          *buffer  = malloc(PAMU_BULK_BUFFER);
+  size_t         used    = 0;
+  int64_t        flushed = start + PAMU_T_MARKER_SIZE;
+  PAMU_T_POINTER block   = start;
+  PAMU_T_MARKER  first   = 0;
+  PAMU_T_MARKER  last    = 0;
+  PAMU_T_MARKER  len, size, beSize, room;
+  const void    *data;
+  char           padding[2*PAMU_T_POINTER_SIZE] = { 0 };
+  char           links[2*PAMU_T_POINTER_SIZE]   = { 0 };
+  int            count   = 0;
+  while((len = next(udata, block + PAMU_T_MARKER_SIZE, &data)) > 0) {
+    size = MAX(len, (PAMU_T_MARKER)(2*PAMU_T_POINTER_SIZE));
+
+    // Static media must keep room for a valid tail free block, or none
+    room = end - block - size - (2 * PAMU_T_MARKER_SIZE);
+    if (
+      (!(flags & PAMU_DYNAMIC)) &&
+      (room != 0) &&
+      (room < (PAMU_T_MARKER)((2 * PAMU_T_MARKER_SIZE) + (2 * PAMU_T_POINTER_SIZE)))
+    ) {
+      rc = PAMU_ERR_MEDIUM_FULL;
+      break;
+    }
+
+    beSize = hton(size);
+    if (count) {
+      rc = _pamu_bulk_append(fd, buffer, &used, &flushed, &beSize, PAMU_T_MARKER_SIZE);
+      if (!rc) rc = _pamu_bulk_append(fd, buffer, &used, &flushed, data, len);
+      if (!rc) rc = _pamu_bulk_append(fd, buffer, &used, &flushed, padding, size - len);
+    } else {
+      first = beSize;
+      if (data) memcpy(links, data, MIN(len, (PAMU_T_MARKER)(2*PAMU_T_POINTER_SIZE)));
+      rc = _pamu_bulk_append(fd, buffer, &used, &flushed, NULL, 2*PAMU_T_POINTER_SIZE);
+      if ((!rc) && (len > (PAMU_T_MARKER)(2*PAMU_T_POINTER_SIZE))) {
+        rc = _pamu_bulk_append(fd, buffer, &used, &flushed, data ? ((const char *)data) + (2*PAMU_T_POINTER_SIZE) : NULL, len - (2*PAMU_T_POINTER_SIZE));
+      }
+    }
+    if ((!rc) && (!(flags & PAMU_DYNAMIC)) && (!room)) last = beSize;
+    else if (!rc) rc = _pamu_bulk_append(fd, buffer, &used, &flushed, &beSize, PAMU_T_MARKER_SIZE);
+    if (rc) break;
+
+    block += size + (2 * PAMU_T_MARKER_SIZE);
+    count++;
+  }
+  if (len < 0) rc = len;
+  if ((!rc) && used && (_pamu_medium_write(fd, flushed, buffer, used) < 0)) rc = PAMU_ERR_WRITE;
+  free(buffer);
+
+  // Undo the partial load, a static medium's free block was never touched
+  if (rc) {
+    if (flags & PAMU_DYNAMIC) {
+      _pamu_cache_trim(fd, state, start);
+      if (_pamu_ftruncate(fd, start)) rc = PAMU_ERR_WRITE;
+    }
+    return rc;
+  }
+  if (!count) return 0;
+
+  // Pending metadata from before the load must not overwrite it
+  _pamu_claim(fd, start, block);
+  state->indexBuilt   = 0;
+  state->dedupScanned = 0;
+
+  // The rest of a static medium becomes a single free block
+  int64_t zero = 0;
+  if ((!(flags & PAMU_DYNAMIC)) && (block < end)) {
+    beSize = hton((PAMU_T_MARKER)(end - block - (2 * PAMU_T_MARKER_SIZE)) | PAMU_INTERNAL_FLAG_FREE);
+    _pamu_write(fd, block                                            , &beSize, PAMU_T_MARKER_SIZE);  // Start marker
+    _pamu_write(fd, block + PAMU_T_MARKER_SIZE                       , &zero  , PAMU_T_POINTER_SIZE); // Previous free
+    _pamu_write(fd, block + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE , &zero  , PAMU_T_POINTER_SIZE); // Next free
+    _pamu_write(fd, end - PAMU_T_MARKER_SIZE                         , &beSize, PAMU_T_MARKER_SIZE);  // End marker
+  }
+
+  // Publish the loaded blobs
+  if (last) _pamu_write(fd, end - PAMU_T_MARKER_SIZE, &last, PAMU_T_MARKER_SIZE);
+  _pamu_write(fd, start + PAMU_T_MARKER_SIZE, links, 2*PAMU_T_POINTER_SIZE);
+  _pamu_write(fd, start, &first, PAMU_T_MARKER_SIZE);
+  if (flags & PAMU_DYNAMIC) state->mediumSize = block;
+  if (flags & PAMU_DYNAMIC) _pamu_publish(state, block);
+
+  // The blobs were written in-place, they must be durable before the record is
+  if (state->flags & PAMU_JOURNAL) {
+    state->journalUnsynced = 1;
+    rc = _pamu_journal_commit(fd, state);
+    if (rc) return rc;
+  }
+
+  return count;
+}
+
+// Uses outer address of an allocated block
+// Frees it, merging with free neighbours
+int _pamu_free_block(int fd, struct pamu_medium_stat *stat, PAMU_T_POINTER block) {
+  int64_t zero          = 0;
+  PAMU_T_POINTER beBlock       = hton(block);
+  PAMU_T_MARKER blockSize      = _pamu_find_size(fd, block);
+
+  // Actually free the block
+  PAMU_T_MARKER blockMarker = hton(blockSize | PAMU_INTERNAL_FLAG_FREE);
+  _pamu_write(fd, block, &blockMarker, PAMU_T_MARKER_SIZE);
+  _pamu_write(fd, block + blockSize + PAMU_T_MARKER_SIZE, &blockMarker, PAMU_T_MARKER_SIZE);
+  _pamu_index_set(fd, block, blockSize);
+
+  // Keep track of blocks freed within a transaction, their content must
+  // survive until it commits
+  struct pamu_state *state = _pamu_state(fd);
+  if (state && state->txn) {
+    if (state->txnFreedCount == state->txnFreedLimit) {
+      state->txnFreedLimit = MAX(state->txnFreedLimit * 2, 16);
+      state->txnFreed      = realloc(state->txnFreed, state->txnFreedLimit * sizeof(struct pamu_range));
+    }
+    state->txnFreed[state->txnFreedCount].start = block;
+    state->txnFreed[state->txnFreedCount].end   = block + blockSize + (2 * PAMU_T_MARKER_SIZE);
+    state->txnFreedCount++;
+  }
+
+  // Find next free block (or medium end)
+  PAMU_T_POINTER nextFree          = _pamu_find_next(fd, block);
+  PAMU_T_MARKER  nextFreeFlags     = 0;
+  PAMU_T_POINTER previousFree      = 0;
+  PAMU_T_MARKER  previousFreeFlags = 0;
+  while(
+    (nextFree) &&
+    (nextFree < stat->mediumSize)
+  ) {
+    nextFreeFlags = _pamu_find_flags(fd, nextFree);
+    if (nextFreeFlags & PAMU_INTERNAL_FLAG_FREE) { break; }
+    nextFree = _pamu_find_next(fd, nextFree);
+  }
+  if (nextFreeFlags & PAMU_INTERNAL_FLAG_FREE) {
+    _pamu_read(fd, nextFree + PAMU_T_MARKER_SIZE, &previousFree, PAMU_T_POINTER_SIZE);
+    nextFree = hton(nextFree);
+  } else {
+    nextFree = 0;
+  }
+
+  // Find previous free block (or header) if not found yet
+  if (!previousFree) {
+    previousFree = _pamu_find_previous(fd, block, stat->headerSize);
+    while(
+      (previousFree) &&
+      (previousFree >= stat->headerSize)
+    ) {
+      previousFreeFlags = _pamu_find_flags(fd, previousFree);
+      if (previousFreeFlags & PAMU_INTERNAL_FLAG_FREE) break;
+      previousFree = _pamu_find_previous(fd, previousFree, stat->headerSize);
+    }
+    if ((previousFreeFlags & PAMU_INTERNAL_FLAG_FREE) && (!(previousFreeFlags & PAMU_INTERNAL_FLAG_ERR))) {
+      previousFree = hton(previousFree);
+    } else {
+      previousFree = 0;
+    }
+  }
+
+  // Write next & previous pointers to current block
+  _pamu_write(fd, block + PAMU_T_MARKER_SIZE                      , &previousFree, PAMU_T_POINTER_SIZE);
+  _pamu_write(fd, block + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, &nextFree    , PAMU_T_POINTER_SIZE);
+
+  // Update next block's previous pointer
+  if (nextFree) {
+    _pamu_write(fd, ntoh(nextFree) + PAMU_T_MARKER_SIZE, &beBlock, PAMU_T_POINTER_SIZE);
+  }
+
+  // Update the previous block's next pointer
+  if (previousFree) {
+    _pamu_write(fd, ntoh(previousFree) + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, &beBlock, PAMU_T_POINTER_SIZE);
+  }
+
+  // Merge with previous block if it's our neighbour
+  // Find previous block and it's flags
+  // TODO: check if _pamu_find_previous == ntoh(previousFree)
+  PAMU_T_POINTER previousAdjacent = _pamu_find_previous(fd, block, stat->headerSize);
+  PAMU_T_MARKER  previousAdjacentFlags, previousAdjacentSize, previousAdjacentMarker;
+  if (previousAdjacent >= 0) {
+    previousAdjacentFlags = _pamu_find_flags(fd, previousAdjacent);
+    previousAdjacentSize  = _pamu_find_size(fd, previousAdjacent);
+    if (previousAdjacentFlags & PAMU_INTERNAL_FLAG_FREE) {
+      // Merge the 2 blocks
+      _pamu_guard(fd, block - PAMU_T_MARKER_SIZE, block + PAMU_T_MARKER_SIZE + (2 * PAMU_T_POINTER_SIZE));
+      previousAdjacentSize   += blockSize + (2 * PAMU_T_MARKER_SIZE);
+      previousAdjacentMarker  = hton(previousAdjacentSize | PAMU_INTERNAL_FLAG_FREE);
+      _pamu_write(fd, previousAdjacent, &previousAdjacentMarker, PAMU_T_MARKER_SIZE);
+      _pamu_read( fd, previousAdjacent + PAMU_T_MARKER_SIZE, &previousFree, PAMU_T_POINTER_SIZE);
+      _pamu_write(fd, previousAdjacent + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, &nextFree, PAMU_T_POINTER_SIZE);
+      _pamu_write(fd, previousAdjacent + PAMU_T_MARKER_SIZE + previousAdjacentSize, &previousAdjacentMarker, PAMU_T_MARKER_SIZE);
+      _pamu_index_del(fd, block);
+      _pamu_index_set(fd, previousAdjacent, previousAdjacentSize);
+      PAMU_PROBE(merge, PAMU_TRACE_MERGE, fd, previousAdjacent, previousAdjacentSize);
+      // Update our own references
+      block     = previousAdjacent;
+      beBlock   = hton(block);
+      blockSize = previousAdjacentSize;
+      // Update nextFree's previous pointer, unless it's about to be absorbed as well
+      if (nextFree && (ntoh(nextFree) != _pamu_find_next(fd, block))) {
+        _pamu_write(fd, ntoh(nextFree) + PAMU_T_MARKER_SIZE, &beBlock, PAMU_T_POINTER_SIZE);
+      }
+    } else {
+      // Previous block is not free, ignore it
+    }
+  }
+
+  // Merge with next block if it's our neighbour
+  // Find next block and it's flags
+  // TODO: check if _pamu_find_next == ntoh(nextFree)
+  PAMU_T_POINTER nextAdjacent = _pamu_find_next(fd, block);
+  PAMU_T_MARKER nextAdjacentFlags, nextAdjacentSize;
+  if (nextAdjacent < stat->mediumSize) {
+    nextAdjacentFlags = _pamu_find_flags(fd, nextAdjacent);
+    nextAdjacentSize  = _pamu_find_size(fd, nextAdjacent);
+    if (nextAdjacentFlags & PAMU_INTERNAL_FLAG_FREE) {
+      // Merge the 2 blocks
+      _pamu_guard(fd, nextAdjacent - PAMU_T_MARKER_SIZE, nextAdjacent + PAMU_T_MARKER_SIZE + (2 * PAMU_T_POINTER_SIZE));
+      // Update block stats
+      blockSize   += nextAdjacentSize + (2 * PAMU_T_MARKER_SIZE);
+      blockMarker  = hton(blockSize | PAMU_INTERNAL_FLAG_FREE);
+      // Read new next
+      _pamu_read(fd, nextAdjacent + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, &nextFree, PAMU_T_POINTER_SIZE);
+      // Update our current block
+      _pamu_write(fd, block, &blockMarker, PAMU_T_MARKER_SIZE);
+      _pamu_write(fd, block + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, &nextFree, PAMU_T_POINTER_SIZE);
+      _pamu_write(fd, block + blockSize + PAMU_T_MARKER_SIZE, &blockMarker, PAMU_T_MARKER_SIZE);
+      // Update nextFree's previous pointer
+      if (nextFree) {
+        _pamu_write(fd, ntoh(nextFree) + PAMU_T_MARKER_SIZE, &beBlock, PAMU_T_POINTER_SIZE);
+      }
+      _pamu_index_del(fd, nextAdjacent);
+      _pamu_index_set(fd, block, blockSize);
+      PAMU_PROBE(merge, PAMU_TRACE_MERGE, fd, block, blockSize);
+      // Update references?
+    } else {
+      // Next block is not free, ignore it
+    }
+  } else if (stat->flags & PAMU_DYNAMIC) {
+    // Truncate the file if in dynamic mode
+    // Set previousFree's next pointer to 0
+    if (previousFree) {
+      _pamu_write(fd, ntoh(previousFree) + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, &zero, PAMU_T_POINTER_SIZE);
+    }
+    _pamu_index_del(fd, block);
+    _pamu_guard(fd, block, block + PAMU_T_MARKER_SIZE + (2 * PAMU_T_POINTER_SIZE));
+    _pamu_guard(fd, stat->mediumSize - PAMU_T_MARKER_SIZE, stat->mediumSize);
+    PAMU_PROBE(truncate, PAMU_TRACE_TRUNCATE, fd, block, blockSize);
+    if (_pamu_truncate(fd, stat->mediumSize - (2 * PAMU_T_MARKER_SIZE) - blockSize)) {
+      exit(1);
+    }
+    return 0;
+  }
+
+  _pamu_punch_block(fd, block, blockSize);
+  return 0;
+}
+
+// Uses outer address of an allocated block
+// Tags it as pending, the free list is left alone
+int _pamu_lazy_free(int fd, struct pamu_medium_stat *stat, PAMU_T_POINTER block, PAMU_T_MARKER blockSize) {
+  struct pamu_state *state = _pamu_state_require(fd, stat);
+  if (!state) return PAMU_ERR_READ_MALFORMED;
+
+  PAMU_T_MARKER blockMarker = hton(blockSize | PAMU_INTERNAL_FLAG_PENDING);
+  _pamu_write(fd, block                                , &blockMarker, PAMU_T_MARKER_SIZE);
+  _pamu_write(fd, block + blockSize + PAMU_T_MARKER_SIZE, &blockMarker, PAMU_T_MARKER_SIZE);
+
+  if (state->pendingCount == state->pendingLimit) {
+    state->pendingLimit  = MAX(64, state->pendingLimit * 2);
+    state->pending       = realloc(state->pending      , state->pendingLimit * sizeof(int64_t));
+    state->pendingEpochs = realloc(state->pendingEpochs, state->pendingLimit * sizeof(uint64_t));
+  }
+  state->pending[state->pendingCount]       = block;
+  state->pendingEpochs[state->pendingCount] = atomic_load(&state->epoch);
+  state->pendingCount++;
+
+  // Readers pinned from here on see the block as pending
+  if (state->readerLimit) atomic_fetch_add(&state->epoch, 1);
+  return 0;
+}
+
+// Rebuilds the pending list by walking the whole medium
+int _pamu_lazy_scan(int fd, struct pamu_medium_stat *stat, struct pamu_state *state) {
+  state->pendingCount   = 0;
+  state->pendingScanned = 1;
+
+  PAMU_T_POINTER current = stat->headerSize;
+  PAMU_T_MARKER  csize, cflags;
+  while(current < stat->mediumSize) {
+    csize  = _pamu_find_size(fd, current);
+    cflags = _pamu_find_flags(fd, current);
+    if ((csize < 0) || (cflags & (~PAMU_INTERNAL_FLAGS))) {
+      state->pendingScanned = 0;
+      return PAMU_ERR_READ_MALFORMED;
+    }
+    if (cflags & PAMU_INTERNAL_FLAG_PENDING) {
+      if (state->pendingCount == state->pendingLimit) {
+        state->pendingLimit  = MAX(64, state->pendingLimit * 2);
+        state->pending       = realloc(state->pending      , state->pendingLimit * sizeof(int64_t));
+        state->pendingEpochs = realloc(state->pendingEpochs, state->pendingLimit * sizeof(uint64_t));
+      }
+      state->pending[state->pendingCount]       = current;
+      state->pendingEpochs[state->pendingCount] = atomic_load(&state->epoch);
+      state->pendingCount++;
+    }
+    current += csize + (2 * PAMU_T_MARKER_SIZE);
+  }
+
+  return 0;
+}
+
+int _pamu_lazy_compare(const void *a, const void *b) {
+  int64_t ia = *(const int64_t *)a;
+  int64_t ib = *(const int64_t *)b;
+  return (ia > ib) - (ia < ib);
+}
+
+// Returns the number of blocks still pending or error
+int pamu_maintain(int fd, size_t budget) {
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (int)(intptr_t)stat;
+  if (!(stat->flags & PAMU_LAZY)) {
+    free(stat);
+    return 0;
+  }
+  struct pamu_state *state = _pamu_state_require(fd, stat);
+  if (!state) {
+    free(stat);
+    return PAMU_ERR_READ_MALFORMED;
+  }
+  int rc = state->pendingScanned ? 0 : _pamu_lazy_scan(fd, stat, state);
+  free(stat);
+  if (rc) return rc;
+  size_t i = 0, j;
+
+  // Concurrent readers pinned before a block was freed may still read it, so
+  // only the blocks freed before the oldest reader are taken, oldest first
+  size_t   avail = state->pendingCount;
+  uint64_t oldest;
+  if (state->readerLimit) {
+    oldest = _pamu_readers_oldest(state);
+    for(avail = 0; (avail < state->pendingCount) && (state->pendingEpochs[avail] < oldest); avail++);
+  }
+
+  // Take the batch from the end of the list, in address order
+  size_t    count  = (budget && (budget < avail)) ? budget : avail;
+  size_t    first  = state->readerLimit ? 0 : state->pendingCount - count;
+  int64_t  *batch  = state->pending + first;
+  uint64_t *epochs = state->pendingEpochs + first;
+  for(j = 0; j < count; j++) epochs[j] = epochs[count - 1];
+  qsort(batch, count, sizeof(int64_t), _pamu_lazy_compare);
+
+  PAMU_T_POINTER run;
+  PAMU_T_MARKER  runSize, runMarker;
+  while(i < count) {
+
+    // Adjacent pending blocks are joined without touching the free list
+    run     = batch[i];
+    runSize = _pamu_find_size(fd, run);
+    for(j = i + 1; (j < count) && (batch[j] == run + runSize + (2 * PAMU_T_MARKER_SIZE)); j++) {
+      _pamu_guard(fd, batch[j] - PAMU_T_MARKER_SIZE, batch[j] + PAMU_T_MARKER_SIZE);
+      runSize += _pamu_find_size(fd, batch[j]) + (2 * PAMU_T_MARKER_SIZE);
+    }
+
+    // Make sure this run fits in the current journal group
+    rc = _pamu_journal_reserve(fd, PAMU_JOURNAL_OP_RESERVE);
+    if (rc) break;
+
+    // Hand the run to the regular free as a single block, still pending so
+    // readers & crashes never take it for an allocated one
+    runMarker = hton(runSize | PAMU_INTERNAL_FLAG_PENDING);
+    _pamu_write(fd, run                              , &runMarker, PAMU_T_MARKER_SIZE);
+    _pamu_write(fd, run + runSize + PAMU_T_MARKER_SIZE, &runMarker, PAMU_T_MARKER_SIZE);
+    stat = _pamu_medium_stat(fd);
+    if (stat < 0) {
+      rc = (int)(intptr_t)stat;
+      break;
+    }
+    rc = _pamu_free_block(fd, stat, run);
+    free(stat);
+    if (rc) break;
+    i = j;
+  }
+
+  // Drop what we've coalesced from the list
+  size_t rest = state->pendingCount - first - i;
+  memmove(batch , batch  + i, rest * sizeof(int64_t));
+  memmove(epochs, epochs + i, rest * sizeof(uint64_t));
+  state->pendingCount -= i;
+
+  // Readers that were walking may still stand on the old boundaries, which
+  // must stay intact until they've left
+  if (state->readerLimit && i) {
+    uint64_t epoch = atomic_fetch_add(&state->epoch, 1);
+    while(_pamu_readers_oldest(state) <= epoch) sched_yield();
+    _pamu_punch_queued(fd, state);
+  }
+
+  return rc ? rc : (int)state->pendingCount;
+}
+
+int _pamu_free(int fd, PAMU_T_POINTER addr) {
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (int)(intptr_t)stat;
+
+  // Catch out-of-bounds
+  if (
+      (addr >= stat->mediumSize) ||
+      (addr <  stat->headerSize)
+  ) {
+    free(stat);
+    return PAMU_ERR_OUT_OF_BOUNDS;
+  }
+
+  // Make sure this operation fits in the current journal group
+  int rc = _pamu_journal_reserve(fd, PAMU_JOURNAL_OP_RESERVE);
+  if (rc) {
+    free(stat);
+    return rc;
+  }
+
+  // Record pools only flip a bit
+  if (stat->flags & PAMU_POOL) {
+    rc = _pamu_pool_free(fd, stat, addr);
+    free(stat);
+    return rc;
+  }
+
+  // Fetch block info
+  PAMU_T_POINTER block         = addr - PAMU_T_MARKER_SIZE;
+  PAMU_T_MARKER blockSizeFlags = hton(_pamu_find_sizeFlags(fd, block));
+  PAMU_T_MARKER blockSize      = _pamu_find_size(fd, block);
+  PAMU_T_MARKER blockFlags     = _pamu_find_flags(fd, block);
+
+  // Verify the block is supposed to be allocated
+  if (blockFlags & (PAMU_INTERNAL_FLAG_FREE|PAMU_INTERNAL_FLAG_PENDING)) {
+    free(stat);
+    return PAMU_ERR_DOUBLE_FREE;
+  }
+
+  // Verify the end marker matches the start marker
+  PAMU_T_MARKER endMarker;
+  if (_pamu_read(fd, block + blockSize + PAMU_T_MARKER_SIZE, &endMarker, PAMU_T_MARKER_SIZE) != PAMU_T_MARKER_SIZE) {
+    free(stat);
+    return PAMU_ERR_READ_MALFORMED;
+  }
+  if (endMarker != blockSizeFlags) {
+    free(stat);
+    return PAMU_ERR_INVALID_ADDRESS;
+  }
+
+  // Shared content is only freed along with it's last reference
+  if (stat->flags & PAMU_DEDUP) {
+    rc = _pamu_dedup_release(fd, _pamu_state_require(fd, stat), addr);
+    if (rc) {
+      free(stat);
+      return rc < 0 ? rc : 0;
+    }
+  }
+
+  // Lazy media only tag the block, coalescing happens in batches later
+  if (stat->flags & PAMU_LAZY) {
+    rc = _pamu_lazy_free(fd, stat, block, blockSize);
+    free(stat);
+    return rc;
+  }
+
+  rc = _pamu_free_block(fd, stat, block);
+  free(stat);
+  return rc;
+}
+
+int pamu_free(int fd, PAMU_T_POINTER addr) {
+  _pamu_tier_route(&fd, &addr);
+  PAMU_PROBE_ENTRY(free__entry, PAMU_TRACE_FREE_ENTRY, fd, addr, 0);
+  int rc = _pamu_free(fd, addr);
+  PAMU_PROBE_EXIT(free__exit, PAMU_TRACE_FREE_EXIT, fd, addr, rc);
+  return rc;
+}
+
+// Free blocks a large blob is spread over, all from the index in address order
+// unless a single one fits, the last slot is kept for growing the medium
+int _pamu_extents_plan(struct pamu_state *state, int64_t size, struct pamu_free_block *plan, int64_t *planned) {
+  size_t i;
+  int    count = 0;
+  *planned = 0;
+  for(i = 0; i < state->indexCount; i++) {
+    if (state->index[i].size >= size) {
+      plan[0]  = state->index[i];
+      *planned = state->index[i].size;
+      return 1;
+    }
+    if ((state->index[i].size < PAMU_EXTENT_MIN) || (*planned >= size) || (count == PAMU_EXTENT_MAX - 1)) continue;
+    plan[count++]  = state->index[i];
+    *planned      += state->index[i].size;
+  }
+  return count;
+}
+
+// Returns inner address of the extent list or error
+PAMU_T_POINTER pamu_alloc_extents(int fd, int64_t size) {
+  if (size <= 0) return PAMU_ERR_NEGATIVE_SIZE;
+  if (size >= (int64_t)PAMU_INTERNAL_FLAG_PENDING) return PAMU_ERR_OUT_OF_BOUNDS;
+  PAMU_T_POINTER bit;
+  int tier = _pamu_tier_pick(fd, size, &bit);
+  if (tier != fd) return _pamu_tier_mark(tier, pamu_alloc_extents(tier, size), bit);
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (PAMU_T_POINTER)(intptr_t)stat;
+  if (stat->flags & (PAMU_COMPRESS | PAMU_DEDUP | PAMU_POOL)) {
+    free(stat);
+    return PAMU_ERR_NOT_SUPPORTED;
+  }
+  struct pamu_state *state = _pamu_state_require(fd, stat);
+  int rc = state ? _pamu_index_build(fd, stat, state) : PAMU_ERR_READ_MALFORMED;
+  if (rc) {
+    free(stat);
+    return rc;
+  }
+
+  // Static media must hold it all in existing free blocks
+  struct pamu_free_block plan[PAMU_EXTENT_MAX];
+  int64_t planned;
+  int     count = _pamu_extents_plan(state, size, plan, &planned);
+  if ((planned < size) && !(stat->flags & PAMU_DYNAMIC)) {
+    free(stat);
+    return PAMU_ERR_MEDIUM_FULL;
+  }
+
+  // Take the planned blocks, splitting the last one, & grow for the rest
+  int64_t  remaining = size;
+  uint64_t list[2 + (2 * PAMU_EXTENT_MAX)];
+  PAMU_T_POINTER addr;
+  int      i, taken = 0;
+  for(i = 0; (i < count) && (remaining > 0); i++) {
+    rc = _pamu_journal_reserve(fd, PAMU_JOURNAL_OP_RESERVE);
+    if (rc) break;
+    addr = _pamu_alloc_block(fd, stat, plan[i].addr, MAX(MIN(remaining, plan[i].size), (int64_t)(2*PAMU_T_POINTER_SIZE)));
+    list[2 + (2 * taken)]     = hton((uint64_t)addr);
+    list[2 + (2 * taken) + 1] = hton((uint64_t)_pamu_find_size(fd, addr - PAMU_T_MARKER_SIZE));
+    remaining -= _pamu_find_size(fd, addr - PAMU_T_MARKER_SIZE);
+    taken++;
+  }
+  if (!rc && (remaining > 0)) {
+    rc = _pamu_journal_reserve(fd, PAMU_JOURNAL_OP_RESERVE);
+    addr = rc ? rc : _pamu_alloc_fit(fd, stat, MAX(remaining, (int64_t)(2*PAMU_T_POINTER_SIZE)));
+    if (addr < 0) rc = (int)addr;
+    if (!rc) {
+      list[2 + (2 * taken)]     = hton((uint64_t)addr);
+      list[2 + (2 * taken) + 1] = hton((uint64_t)_pamu_find_size(fd, addr - PAMU_T_MARKER_SIZE));
+      taken++;
+    }
+  }
+  free(stat);
+
+  // And the list pointing at them
+  list[0] = hton((uint64_t)size);
+  list[1] = hton((uint64_t)taken << 32);
+  addr    = rc ? rc : _pamu_alloc(fd, (2 + (2 * taken)) * sizeof(uint64_t));
+  if ((addr > 0) && _pamu_blob_write(fd, addr, list, (2 + (2 * taken)) * sizeof(uint64_t))) addr = PAMU_ERR_WRITE;
+  if (addr > 0) return addr;
+  for(i = 0; i < taken; i++) _pamu_free(fd, ntoh(list[2 + (2 * i)]));
+  return addr;
+}
+
+// Reads the extent list of a blob, caller frees it
+int _pamu_extents_load(int fd, PAMU_T_POINTER addr, int64_t *length, uint64_t **extents) {
+  uint64_t head[2];
+  *extents = NULL;
+  if (_pamu_read(fd, addr, head, sizeof(head)) != sizeof(head)) return PAMU_ERR_READ_MALFORMED;
+  *length = ntoh(head[0]);
+  uint32_t count = ntoh(head[1]) >> 32;
+  if ((count > PAMU_EXTENT_MAX) || ((2 + (2 * (PAMU_T_MARKER)count)) * (PAMU_T_MARKER)sizeof(uint64_t) > pamu_size(fd, addr))) {
+    return PAMU_ERR_READ_MALFORMED;
+  }
+  *extents = malloc((2 * count + 1) * sizeof(uint64_t));
+  if (_pamu_read(fd, addr + sizeof(head), *extents, 2 * count * sizeof(uint64_t)) != (ssize_t)(2 * count * sizeof(uint64_t))) {
+    free(*extents);
+    *extents = NULL;
+    return PAMU_ERR_READ_MALFORMED;
+  }
+  uint32_t i;
+  for(i = 0; i < 2 * count; i++) (*extents)[i] = ntoh((*extents)[i]);
+  (*extents)[2 * count] = 0;
+  return 0;
+}
+
+// Streams len bytes at offset of a large blob from/to buf, extent by extent
+int _pamu_extents_io(int fd, PAMU_T_POINTER addr, int64_t offset, char *buf, size_t len, int write) {
+  int64_t   length;
+  uint64_t *extents;
+  int       rc = _pamu_extents_load(fd, addr, &length, &extents);
+  if (rc) return rc;
+  if ((offset < 0) || (offset + (int64_t)len > length)) {
+    free(extents);
+    return PAMU_ERR_OUT_OF_BOUNDS;
+  }
+
+  uint64_t *extent;
+  int64_t   chunk;
+  for(extent = extents; len && extent[0]; extent += 2) {
+    if (offset >= (int64_t)extent[1]) {
+      offset -= extent[1];
+      continue;
+    }
+    chunk = MIN((int64_t)len, (int64_t)extent[1] - offset);
+    if (write) {
+      rc = _pamu_blob_write(fd, extent[0] + offset, buf, chunk);
+    } else {
+      rc = (_pamu_read(fd, extent[0] + offset, buf, chunk) == chunk) ? 0 : PAMU_ERR_READ_MALFORMED;
+    }
+    if (rc) break;
+    buf    += chunk;
+    len    -= chunk;
+    offset  = 0;
+  }
+  free(extents);
+  return rc;
+}
+
+int pamu_extents_write(int fd, PAMU_T_POINTER addr, int64_t offset, const void *buf, size_t len) {
+  _pamu_tier_route(&fd, &addr);
+  return _pamu_extents_io(fd, addr, offset, (char *)buf, len, 1);
+}
+
+int pamu_extents_read(int fd, PAMU_T_POINTER addr, int64_t offset, void *buf, size_t len) {
+  _pamu_tier_route(&fd, &addr);
+  return _pamu_extents_io(fd, addr, offset, buf, len, 0);
+}
+
+int64_t pamu_extents_size(int fd, PAMU_T_POINTER addr) {
+  _pamu_tier_route(&fd, &addr);
+  int64_t   length;
+  uint64_t *extents;
+  int       rc = _pamu_extents_load(fd, addr, &length, &extents);
+  free(extents);
+  return rc ? rc : length;
+}
+
+// Frees the extents of a large blob, then it's list
+int pamu_free_extents(int fd, PAMU_T_POINTER addr) {
+  _pamu_tier_route(&fd, &addr);
+  int64_t   length;
+  uint64_t *extents, *extent;
+  int       rc = _pamu_extents_load(fd, addr, &length, &extents);
+  if (rc) return rc;
+  for(extent = extents; (!rc) && extent[0]; extent += 2) rc = pamu_free(fd, extent[0]);
+  free(extents);
+  return rc ? rc : pamu_free(fd, addr);
+}
+
+// End of the last block, a device or file may have been grown past it
+int64_t _pamu_layout_end(int fd, struct pamu_medium_stat *stat) {
+  PAMU_T_POINTER current = stat->headerSize;
+  PAMU_T_MARKER  sizeFlags, size;
+  while(current < stat->mediumSize) {
+    sizeFlags = _pamu_find_sizeFlags(fd, current);
+    size      = sizeFlags & (~PAMU_INTERNAL_FLAGS);
+    if (
+      (sizeFlags & PAMU_INTERNAL_FLAG_ERR) ||
+      (size < (PAMU_T_MARKER)(2 * PAMU_T_POINTER_SIZE)) ||
+      (current + size + (2 * PAMU_T_MARKER_SIZE) > stat->mediumSize) ||
+      (_pamu_find_sizeFlags(fd, current + size + PAMU_T_MARKER_SIZE) != sizeFlags)
+    ) break;
+    current += size + (2 * PAMU_T_MARKER_SIZE);
+  }
+  return current;
+}
+
+int pamu_resize(int fd, int64_t size) {
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (int)(intptr_t)stat;
+  if (stat->flags & (PAMU_DYNAMIC | PAMU_POOL)) {
+    free(stat);
+    return PAMU_ERR_NOT_SUPPORTED;
+  }
+  struct pamu_state *state = _pamu_state_require(fd, stat);
+  if (!state) {
+    free(stat);
+    return PAMU_ERR_READ_MALFORMED;
+  }
+  if (state->txn) {
+    free(stat);
+    return PAMU_ERR_TXN;
+  }
+
+  // Make sure this operation fits in the current journal group
+  int rc = _pamu_journal_reserve(fd, PAMU_JOURNAL_OP_RESERVE);
+  if (rc) {
+    free(stat);
+    return rc;
+  }
+
+  int64_t       end      = _pamu_layout_end(fd, stat);
+  int64_t       minBlock = (2 * PAMU_T_MARKER_SIZE) + (2 * PAMU_T_POINTER_SIZE);
+  PAMU_T_MARKER marker;
+  free(stat);
+  if (size == end) return 0;
+
+  // Growing appends a block at the end, freed to merge with a free tail
+  if (size > end) {
+    if (size - end < minBlock) return PAMU_ERR_MEDIUM_SIZE;
+    marker = hton((PAMU_T_MARKER)(size - end - (2 * PAMU_T_MARKER_SIZE)));
+    if (
+      (_pamu_write(fd, size - PAMU_T_MARKER_SIZE, &marker, PAMU_T_MARKER_SIZE) < 0) ||
+      (_pamu_write(fd, end, &marker, PAMU_T_MARKER_SIZE) < 0)
+    ) return PAMU_ERR_WRITE;
+    state->mediumSize = size;
+    stat = _pamu_medium_stat(fd);
+    if (stat < 0) return (int)(intptr_t)stat;
+    rc = _pamu_free_block(fd, stat, end);
+    free(stat);
+    if (!rc) _pamu_publish(state, size);
+    return rc;
+  }
+
+  // A device keeps it's size, readers may stand on the tail
+  struct stat st;
+  if (fstat(fd, &st) || S_ISBLK(st.st_mode)) return PAMU_ERR_NOT_SUPPORTED;
+  if (state->readerLimit && (_pamu_readers_oldest(state) != UINT64_MAX)) return PAMU_ERR_READER;
+  if (state->flags & PAMU_LAZY) {
+    rc = pamu_maintain(fd, 0);
+    if (rc) return rc < 0 ? rc : PAMU_ERR_MEDIUM_FULL;
+  }
+
+  // Shrinking only cuts into a free tail, blobs are never moved
+  PAMU_T_MARKER tailFlags = _pamu_find_sizeFlags(fd, end - PAMU_T_MARKER_SIZE);
+  PAMU_T_MARKER tailSize  = tailFlags & (~PAMU_INTERNAL_FLAGS);
+  int64_t       tail      = end - tailSize - (2 * PAMU_T_MARKER_SIZE);
+  if (tailFlags & PAMU_INTERNAL_FLAG_ERR) return PAMU_ERR_READ_MALFORMED;
+  if ((!(tailFlags & PAMU_INTERNAL_FLAG_FREE)) || (size < tail)) return PAMU_ERR_MEDIUM_FULL;
+  if ((size > tail) && (size - tail < minBlock)) return PAMU_ERR_MEDIUM_SIZE;
+  _pamu_guard(fd, end - PAMU_T_MARKER_SIZE, end);
+  if (size == tail) {
+    // The whole tail goes, taken out of the free list first
+    stat = _pamu_medium_stat(fd);
+    if (stat < 0) return (int)(intptr_t)stat;
+    PAMU_T_POINTER taken = _pamu_alloc_block(fd, stat, tail, tailSize);
+    free(stat);
+    if (taken < 0) return (int)taken;
+  } else {
+    tailSize = size - tail - (2 * PAMU_T_MARKER_SIZE);
+    marker   = hton(tailSize | PAMU_INTERNAL_FLAG_FREE);
+    if (
+      (_pamu_write(fd, tail, &marker, PAMU_T_MARKER_SIZE) < 0) ||
+      (_pamu_write(fd, size - PAMU_T_MARKER_SIZE, &marker, PAMU_T_MARKER_SIZE) < 0)
+    ) return PAMU_ERR_WRITE;
+    _pamu_index_set(fd, tail, tailSize);
+  }
+  return _pamu_truncate(fd, size);
+}
+
+PAMU_T_MARKER pamu_size(int fd, PAMU_T_POINTER addr) {
+  _pamu_tier_route(&fd, &addr);
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (PAMU_T_MARKER)(intptr_t)stat;
+  int32_t flags = stat->flags;
+  struct pamu_state *state = (flags & PAMU_POOL) ? _pamu_state_require(fd, stat) : NULL;
+  free(stat);
+
+  // Every record of a pool has the same size
+  if (flags & PAMU_POOL) {
+    return state ? (PAMU_T_MARKER)state->recordSize : PAMU_ERR_READ_MALFORMED;
+  }
+
+  // Logical size of the blob, as stored in it's frame or trailer
+  uint64_t hash;
+  uint32_t length, packed;
+  if (flags & PAMU_COMPRESS) {
+    return _pamu_frame_read(fd, addr, &length, &packed) ? PAMU_ERR_READ_MALFORMED : length;
+  }
+  if (flags & PAMU_DEDUP) {
+    return _pamu_trailer_read(fd, addr, &hash, &packed, &length) ? PAMU_ERR_READ_MALFORMED : length;
+  }
+  return _pamu_find_size(fd, addr - PAMU_T_MARKER_SIZE);
+}
+
+// Iteration, so clients can find a reference
+PAMU_T_POINTER _pamu_next(int fd, PAMU_T_POINTER addr) {
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (PAMU_T_POINTER)(intptr_t)stat;
+  if (stat->flags & PAMU_POOL) {
+    PAMU_T_POINTER record = _pamu_pool_next(fd, stat, addr);
+    free(stat);
+    return record;
+  }
+
+  // Find the outer addr of current block
+  PAMU_T_POINTER block = addr - PAMU_T_MARKER_SIZE;
+  if (block < stat->headerSize) {
+    block = stat->headerSize;
+  } else {
+    block = _pamu_find_next(fd, block);
+  }
+
+  PAMU_T_MARKER flags;
+  while(block < stat->mediumSize) {
+    flags = _pamu_find_flags(fd, block);
+    PAMU_PROBE_WALK();
+    if (!(flags & (PAMU_INTERNAL_FLAG_FREE|PAMU_INTERNAL_FLAG_PENDING))) break;
+    block = _pamu_find_next(fd, block);
+  }
+
+  // End of medium
+  if (block == stat->mediumSize) {
+    free(stat);
+    return 0;
+  }
+
+  // Return the inner addr of the found allocated block
+  free(stat);
+  return block + PAMU_T_MARKER_SIZE;
+}
+
+PAMU_T_POINTER pamu_next(int fd, PAMU_T_POINTER addr) {
+  PAMU_PROBE_ENTRY(next__entry, PAMU_TRACE_NEXT_ENTRY, fd, addr, 0);
+
+  // Tiered handles walk the fast medium, then the slow one
+  struct pamu_state *state = _pamu_state(fd);
+  PAMU_T_POINTER     next  = 0;
+  if (!state || !state->tierThreshold || !(addr & PAMU_TIER_BIT)) {
+    next = _pamu_next(fd, addr);
+    addr = 0;
+  }
+  if (!next && state && state->tierThreshold) {
+    next = _pamu_next(state->tierFd, addr & ~PAMU_TIER_BIT);
+    if (next > 0) next |= PAMU_TIER_BIT;
+  }
+  PAMU_PROBE_EXIT(next__exit, PAMU_TRACE_NEXT_EXIT, fd, next, 0);
+  return next;
+}
+
+// Writes all of buf to the stream
+int _pamu_stream_write(int outFd, const void *buf, size_t len) {
+  ssize_t n;
+  while(len) {
+    n = write(outFd, buf, len);
+    if (n <= 0) return PAMU_ERR_WRITE;
+    buf  = (const char *)buf + n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Reads all of buf from the stream
+int _pamu_stream_read(int inFd, void *buf, size_t len) {
+  ssize_t n;
+  while(len) {
+    n = read(inFd, buf, len);
+    if (n <= 0) return PAMU_ERR_READ_MALFORMED;
+    buf  = (char *)buf + n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Copies len bytes at addr to the stream without passing them through
+// userspace when the kernel allows it
+int _pamu_stream_copy(int fd, int outFd, int64_t addr, size_t len) {
+  off_t   off = addr;
+  ssize_t n   = 1;
+  while(len && (n > 0)) {
+    n = copy_file_range(fd, &off, outFd, NULL, len, 0);
+    if (n <= 0) n = sendfile(outFd, fd, &off, len);
+    if (n > 0) len -= n;
+  }
+
+  // Fall back to plain reads & writes
+  char buf[PAMU_EXPORT_DIRECT];
+  while(len) {
+    n = _pamu_pread(fd, off, buf, MIN(len, sizeof(buf)));
+    if (n <= 0) return PAMU_ERR_READ_MALFORMED;
+    if (_pamu_stream_write(outFd, buf, n)) return PAMU_ERR_WRITE;
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
 
-    newFree       = hton((PAMU_T_POINTER)(block     + size + (2 * PAMU_T_MARKER_SIZE)));
-    newFreeSize   =          blockSize - size - (2 * PAMU_T_MARKER_SIZE) ;
-    newFreeMarker = hton((PAMU_T_MARKER)(newFreeSize | PAMU_INTERNAL_FLAG_FREE));
+// Returns the number of blobs exported or error
+int pamu_export(int fd, int outFd) {
 
-    // Update the current block
-    blockSize   = size;
-    blockMarker = hton(blockSize | PAMU_INTERNAL_FLAG_FREE);
-    lseek(fd, block, SEEK_SET);
-    write(fd, &blockMarker , PAMU_T_MARKER_SIZE);  // Start marker
-    write(fd, &previousFree, PAMU_T_POINTER_SIZE); // Previous free
-    write(fd, &newFree     , PAMU_T_POINTER_SIZE); // Next/new free
-    lseek(fd, block + blockSize + PAMU_T_MARKER_SIZE, SEEK_SET);
-    write(fd, &blockMarker , PAMU_T_MARKER_SIZE);  // End marker
-
-    // Build new free block
-    write(fd, &newFreeMarker, PAMU_T_MARKER_SIZE); // Start marker
-    write(fd, &beBlock      , PAMU_T_POINTER_SIZE); // Previous/current free
-    write(fd, &nextFree     , PAMU_T_POINTER_SIZE); // Next free
-    lseek(fd, ntoh(newFree) + newFreeSize + PAMU_T_MARKER_SIZE, SEEK_SET);
-    write(fd, &newFreeMarker, PAMU_T_MARKER_SIZE); // End marker
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (int)(intptr_t)stat;
+  if (stat->flags & PAMU_POOL) {
+    free(stat);
+    return PAMU_ERR_NOT_SUPPORTED;
+  }
 
-    // Update next block to point it's previous to the new free
-    if (nextFree) {
-      lseek(fd, ntoh(nextFree) + PAMU_T_MARKER_SIZE, SEEK_SET);
-      write(fd, &newFree, PAMU_T_POINTER_SIZE);
+  // Blob data must be in-place for the kernel to copy it
+  struct pamu_state *state = _pamu_state(fd);
+  int rc = 0;
+  if (state && state->txn) rc = PAMU_ERR_TXN;
+  if (!rc && state && state->tierThreshold) rc = PAMU_ERR_NOT_SUPPORTED;
+  if (!rc && state) rc = _pamu_journal_commit(fd, state);
+  if (!rc && state && state->cacheLimit && _pamu_cache_writeback(fd, state)) rc = PAMU_ERR_WRITE;
+  if (rc) {
+    free(stat);
+    return rc;
+  }
+
+  // Keyword + storage mode and pointer & marker widths, so imports don't
+  // misread the stream or the payloads within it
+  char    *buffer = malloc(PAMU_BULK_BUFFER);
+  size_t   used   = PAMU_KEYWORD_LEN + sizeof(uint32_t);
+  uint32_t widths = hton((uint32_t)((stat->flags & (PAMU_COMPRESS|PAMU_DEDUP)) | (PAMU_T_POINTER_SIZE << 8) | PAMU_T_MARKER_SIZE));
+  memcpy(buffer, PAMU_EXPORT_KEYWORD, PAMU_KEYWORD_LEN);
+  memcpy(buffer + PAMU_KEYWORD_LEN, &widths, sizeof(uint32_t));
+
+  // Address, size & payload of every allocated block, in address order
+  PAMU_T_POINTER block = stat->headerSize;
+  PAMU_T_POINTER beAddr;
+  PAMU_T_MARKER  sizeFlags, size, beSize;
+  int            count = 0;
+  while(block < stat->mediumSize) {
+    sizeFlags = _pamu_find_sizeFlags(fd, block);
+    if (sizeFlags & PAMU_INTERNAL_FLAG_ERR) {
+      rc = PAMU_ERR_READ_MALFORMED;
+      break;
+    }
+    size = sizeFlags & ~PAMU_INTERNAL_FLAGS;
+    if (sizeFlags & PAMU_INTERNAL_FLAGS) {
+      block += size + (2 * PAMU_T_MARKER_SIZE);
+      continue;
     }
 
-    // And the new free is now our next free
-    nextFree = newFree;
-    // No need to update previous free block in this step
+    // Flush the buffer if the record won't fit or is copied directly
+    if ((used + PAMU_T_POINTER_SIZE + PAMU_T_MARKER_SIZE + size > PAMU_BULK_BUFFER) || (size >= PAMU_EXPORT_DIRECT)) {
+      if ((rc = _pamu_stream_write(outFd, buffer, used))) break;
+      used = 0;
+    }
+    beAddr = hton((PAMU_T_POINTER)(block + PAMU_T_MARKER_SIZE));
+    beSize = hton(size);
+    memcpy(buffer + used, &beAddr, PAMU_T_POINTER_SIZE);
+    used += PAMU_T_POINTER_SIZE;
+    memcpy(buffer + used, &beSize, PAMU_T_MARKER_SIZE);
+    used += PAMU_T_MARKER_SIZE;
+    if (size >= PAMU_EXPORT_DIRECT) {
+      if ((rc = _pamu_stream_write(outFd, buffer, used))) break;
+      used = 0;
+      if ((rc = _pamu_stream_copy(fd, outFd, block + PAMU_T_MARKER_SIZE, size))) break;
+    } else {
+      if (_pamu_read(fd, block + PAMU_T_MARKER_SIZE, buffer + used, size) < 0) {
+        rc = PAMU_ERR_READ_MALFORMED;
+        break;
+      }
+      used += size;
+    }
+
+    block += size + (2 * PAMU_T_MARKER_SIZE);
+    count++;
   }
+  free(stat);
 
-  // Grow medium in dynamic mode
-  // Init as free block without prev/next
-  if (
-    (stat->flags & PAMU_DYNAMIC) &&
-    (block == stat->mediumSize)
-  ) {
-    lseek(fd, block, SEEK_SET);
-    write(fd, &blockMarker, PAMU_T_MARKER_SIZE);  // Start marker
-    write(fd, &zero       , PAMU_T_POINTER_SIZE); // Previous free
-    write(fd, &zero       , PAMU_T_POINTER_SIZE); // Next free
-    lseek(fd, block + blockSize + PAMU_T_MARKER_SIZE, SEEK_SET);
-    write(fd, &blockMarker, PAMU_T_MARKER_SIZE);  // End marker
+  // Terminated by an empty record
+  if (!rc) {
+    memset(buffer + used, 0, PAMU_T_POINTER_SIZE + PAMU_T_MARKER_SIZE);
+    used += PAMU_T_POINTER_SIZE + PAMU_T_MARKER_SIZE;
+    rc = _pamu_stream_write(outFd, buffer, used);
   }
+  free(buffer);
+  return rc ? rc : count;
+}
 
-  // We don't need the stat anymore
-  free(stat);
+struct pamu_import {
+  int             inFd;
+  int             keep;
+  int             done;
+  PAMU_T_POINTER  addr;     // Pointer of the record read, 0 = none
+  PAMU_T_MARKER   size;
+  char           *data;
+  PAMU_T_MARKER   dataLimit;
+  PAMU_T_POINTER *fillers;  // Blocks that pad gaps, freed after the load
+  size_t          fillerCount;
+  size_t          fillerLimit;
+};
 
-  // Mark the current block as allocated & read previous/next free pointers
-  blockMarker = hton(blockSize);
-  lseek(fd, block, SEEK_SET);
-  write(fd, &blockMarker, PAMU_T_MARKER_SIZE);
-  read(fd, &previousFree, PAMU_T_POINTER_SIZE);
-  read(fd, &nextFree    , PAMU_T_POINTER_SIZE);
-  lseek(fd, block + blockSize + PAMU_T_MARKER_SIZE, SEEK_SET);
-  write(fd, &blockMarker, PAMU_T_MARKER_SIZE);
+// Bulk iterator over an export stream
+PAMU_T_MARKER _pamu_import_next(void *udata, PAMU_T_POINTER addr, const void **data) {
+  struct pamu_import *import = udata;
+  PAMU_T_POINTER beAddr;
+  PAMU_T_MARKER  beSize;
 
-  // Update the previous free's next pointer
-  if (previousFree) {
-    lseek(fd, ntoh(previousFree) + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, SEEK_SET);
-    write(fd, &nextFree, PAMU_T_POINTER_SIZE);
+  // Read the next record header
+  if (!import->addr) {
+    if (import->done) return 0;
+    if (_pamu_stream_read(import->inFd, &beAddr, PAMU_T_POINTER_SIZE)) return PAMU_ERR_READ_MALFORMED;
+    if (_pamu_stream_read(import->inFd, &beSize, PAMU_T_MARKER_SIZE )) return PAMU_ERR_READ_MALFORMED;
+    import->addr = ntoh(beAddr);
+    import->size = ntoh(beSize);
+    if (!import->addr) {
+      import->done = 1;
+      return 0;
+    }
+    if (import->size < (PAMU_T_MARKER)(2 * PAMU_T_POINTER_SIZE)) return PAMU_ERR_READ_MALFORMED;
+    if (import->size > import->dataLimit) {
+      free(import->data);
+      import->data      = malloc(import->size);
+      import->dataLimit = import->data ? import->size : 0;
+      if (!import->data) return PAMU_ERR_READ_MALFORMED;
+    }
+    if (_pamu_stream_read(import->inFd, import->data, import->size)) return PAMU_ERR_READ_MALFORMED;
   }
 
-  // Update the next free's previous pointer
-  if (nextFree) {
-    lseek(fd, ntoh(nextFree) + PAMU_T_MARKER_SIZE, SEEK_SET);
-    write(fd, &previousFree, PAMU_T_POINTER_SIZE);
+  // Pad the gap up to the original address with a filler block
+  if (import->keep && (import->addr != addr)) {
+    int64_t gap = (int64_t)import->addr - addr - (2 * PAMU_T_MARKER_SIZE);
+    if (gap < (int64_t)(2 * PAMU_T_POINTER_SIZE)) return PAMU_ERR_INVALID_ADDRESS;
+    if (import->fillerCount == import->fillerLimit) {
+      import->fillerLimit = import->fillerLimit ? import->fillerLimit * 2 : 64;
+      import->fillers     = realloc(import->fillers, import->fillerLimit * sizeof(PAMU_T_POINTER));
+    }
+    import->fillers[import->fillerCount++] = addr;
+    *data = NULL;
+    return gap;
   }
 
-  // Return pointer to innards
-  return block + PAMU_T_MARKER_SIZE;
+  import->addr = 0;
+  *data = import->data;
+  return import->size;
 }
 
-int pamu_free(int fd, PAMU_T_POINTER addr) {
+// Returns the number of blobs imported or error
+int pamu_import(int fd, int inFd, int keep) {
+  char     keyword[PAMU_KEYWORD_LEN];
+  uint32_t widths;
+  if (_pamu_stream_read(inFd, keyword, PAMU_KEYWORD_LEN)) return PAMU_ERR_READ_MALFORMED;
+  if (_pamu_stream_read(inFd, &widths, sizeof(uint32_t))) return PAMU_ERR_READ_MALFORMED;
+  if (memcmp(keyword, PAMU_EXPORT_KEYWORD, PAMU_KEYWORD_LEN)) return PAMU_ERR_READ_MALFORMED;
 
-  // Fetch info (or return error code)
+  // Payloads are stored as-is, both media must frame them the same way
   struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
-  if (stat < 0) return (int)stat;
+  if (stat < 0) return (int)(intptr_t)stat;
+  uint32_t expect = (stat->flags & (PAMU_COMPRESS|PAMU_DEDUP)) | (PAMU_T_POINTER_SIZE << 8) | PAMU_T_MARKER_SIZE;
+  free(stat);
+  if (ntoh(widths) != expect) return PAMU_ERR_NOT_SUPPORTED;
 
-  // Catch out-of-bounds
-  if (
-      (addr >= stat->mediumSize) ||
-      (addr <  stat->headerSize)
-  ) {
-    return PAMU_ERR_OUT_OF_BOUNDS;
+  // Dense by default, gaps are only kept to preserve addresses
+  struct pamu_import import = { inFd, keep, 0, 0, 0, NULL, 0, NULL, 0, 0 };
+  int rc = pamu_bulk_load(fd, _pamu_import_next, &import);
+
+  // Release the fillers into the free list
+  size_t i;
+  for(i = 0; (rc >= 0) && (i < import.fillerCount); i++) {
+    int frc = pamu_free(fd, import.fillers[i]);
+    if (frc) rc = frc;
   }
+  if (rc >= 0) rc -= import.fillerCount;
 
-  // Fetch block info
-  int64_t zero          = 0;
-  PAMU_T_POINTER block         = addr - PAMU_T_MARKER_SIZE;
-  PAMU_T_POINTER beBlock       = hton(block);
-  PAMU_T_MARKER blockSizeFlags = hton(_pamu_find_sizeFlags(fd, block));
-  PAMU_T_MARKER blockSize      = _pamu_find_size(fd, block);
-  PAMU_T_MARKER blockFlags     = _pamu_find_flags(fd, block);
+  free(import.data);
+  free(import.fillers);
+  return rc;
+}
 
-  // Verify the block is supposed to be allocated
-  if (blockFlags & PAMU_INTERNAL_FLAG_FREE) {
-    free(stat);
-    return PAMU_ERR_DOUBLE_FREE;
+// Makes sure [lo, hi) of the medium is in the scan buffer, refilling from lo
+int _pamu_scan_window(int fd, char *buffer, int64_t *base, int64_t *filled, int64_t lo, int64_t hi) {
+  if ((lo >= *base) && (hi <= *base + *filled)) return 0;
+  *base   = lo;
+  *filled = _pamu_pread(fd, lo, buffer, PAMU_BULK_BUFFER);
+  if (*filled < hi - lo) return PAMU_ERR_READ_MALFORMED;
+  return 0;
+}
+
+// Walks every block with large sequential reads straight from the medium,
+// which may be in use by another process, returns the number of blocks
+int64_t pamu_scan(int fd, pamu_scan_cb cb, void *udata) {
+  char     header[PAMU_KEYWORD_LEN + sizeof(uint32_t)];
+  uint32_t beFlaggedSize;
+  if (_pamu_pread(fd, 0, header, sizeof(header)) != sizeof(header)) return PAMU_ERR_READ_MALFORMED;
+  if (memcmp(header, PAMU_KEYWORD, PAMU_KEYWORD_LEN)) return PAMU_ERR_MEDIUM_UNINITIALIZED;
+  memcpy(&beFlaggedSize, header + PAMU_KEYWORD_LEN, sizeof(uint32_t));
+  uint32_t flags      = ntoh(beFlaggedSize) &  PAMU_FLAGS;
+  int64_t  headerSize = ntoh(beFlaggedSize) & ~PAMU_FLAGS;
+  if (flags & PAMU_POOL) return PAMU_ERR_NOT_SUPPORTED;
+
+  char             *buffer = malloc(PAMU_BULK_BUFFER);
+  int64_t           base = 0, filled = 0, count = 0;
+  int64_t           end  = lseek(fd, 0, SEEK_END);
+  int64_t           pos  = headerSize;
+  int               rc   = 0;
+  PAMU_T_MARKER     marker, startMarker = 0;
+  PAMU_T_POINTER    link;
+  struct pamu_block block;
+  for(;;) {
+
+    // The end marker of the previous block must match it's start marker
+    if (pos > headerSize) {
+      rc = _pamu_scan_window(fd, buffer, &base, &filled, pos - PAMU_T_MARKER_SIZE, pos);
+      if (rc) break;
+      memcpy(&marker, buffer + (pos - PAMU_T_MARKER_SIZE - base), PAMU_T_MARKER_SIZE);
+      if (marker != startMarker) {
+        rc = PAMU_ERR_READ_MALFORMED;
+        break;
+      }
+    }
+    if (pos >= end) break;
+
+    // A grown device may continue past the last block
+    rc = _pamu_scan_window(fd, buffer, &base, &filled, pos, MIN(end, pos + PAMU_T_MARKER_SIZE + (2 * PAMU_T_POINTER_SIZE)));
+    if (rc) break;
+    memcpy(&startMarker, buffer + (pos - base), PAMU_T_MARKER_SIZE);
+    if (!startMarker) break;
+    marker         = ntoh(startMarker);
+    block.addr     = pos;
+    block.size     = marker & ~PAMU_INTERNAL_FLAGS;
+    block.flags    = ((marker & PAMU_INTERNAL_FLAG_FREE) ? PAMU_BLOCK_FREE : 0) | ((marker & PAMU_INTERNAL_FLAG_PENDING) ? PAMU_BLOCK_PENDING : 0);
+    block.prevFree = 0;
+    block.nextFree = 0;
+    if (
+      (block.size < (int64_t)(2 * PAMU_T_POINTER_SIZE)) ||
+      (pos + block.size + (2 * (int64_t)PAMU_T_MARKER_SIZE) > end)
+    ) {
+      rc = PAMU_ERR_READ_MALFORMED;
+      break;
+    }
+    if (block.flags & PAMU_BLOCK_FREE) {
+      memcpy(&link, buffer + (pos + PAMU_T_MARKER_SIZE - base), PAMU_T_POINTER_SIZE);
+      block.prevFree = ntoh(link);
+      memcpy(&link, buffer + (pos + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE - base), PAMU_T_POINTER_SIZE);
+      block.nextFree = ntoh(link);
+    }
+
+    count++;
+    rc = cb ? cb(udata, &block) : 0;
+    if (rc) break;
+    pos += block.size + (2 * PAMU_T_MARKER_SIZE);
   }
 
-  // Verify the end marker matches the start marker
-  PAMU_T_MARKER endMarker;
-  lseek(fd, block + blockSize + PAMU_T_MARKER_SIZE, SEEK_SET);
-  if (read(fd, &endMarker, PAMU_T_MARKER_SIZE) != PAMU_T_MARKER_SIZE) {
+  free(buffer);
+  return rc ? rc : count;
+}
+
+// Enables concurrent readers, or disables them with 0 slots
+int pamu_readers(int fd, int slots) {
+  if (slots < 0) return PAMU_ERR_NEGATIVE_SIZE;
+
+  // Fetch info (or return error code)
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (int)(intptr_t)stat;
+  struct pamu_state *state = _pamu_state_require(fd, stat);
+  if (!state) {
     free(stat);
     return PAMU_ERR_READ_MALFORMED;
   }
-  if (endMarker != blockSizeFlags) {
+
+  // Readers only follow in-place tags & raw data, frees must leave them intact
+  if (
+    (!(stat->flags & PAMU_LAZY)) ||
+    (stat->flags & (PAMU_JOURNAL | PAMU_COMPRESS)) ||
+    state->cacheLimit
+  ) {
     free(stat);
-    return PAMU_ERR_INVALID_ADDRESS;
+    return PAMU_ERR_NOT_SUPPORTED;
+  }
+  if (state->readerLimit && (_pamu_readers_oldest(state) != UINT64_MAX)) {
+    free(stat);
+    return PAMU_ERR_READER;
   }
 
-  // Actually free the block
-  PAMU_T_MARKER blockMarker = hton(blockSize | PAMU_INTERNAL_FLAG_FREE);
-  lseek(fd, block, SEEK_SET);
-  write(fd, &blockMarker, PAMU_T_MARKER_SIZE);
-  lseek(fd, block + blockSize + PAMU_T_MARKER_SIZE, SEEK_SET);
-  write(fd, &blockMarker, PAMU_T_MARKER_SIZE);
+  free((void *)state->readers);
+  state->readers     = slots ? calloc(slots, sizeof(uint64_t)) : NULL;
+  state->readerLimit = slots;
+  atomic_store(&state->epoch, 1);
+  _pamu_publish(state, stat->mediumSize);
+  free(stat);
+  return 0;
+}
 
-  // Find next free block (or medium end)
-  PAMU_T_POINTER nextFree          = _pamu_find_next(fd, block);
-  PAMU_T_MARKER  nextFreeFlags     = 0;
-  PAMU_T_POINTER previousFree      = 0;
-  PAMU_T_MARKER  previousFreeFlags = 0;
-  while(
-    (nextFree) &&
-    (nextFree < stat->mediumSize)
-  ) {
-    nextFreeFlags = _pamu_find_flags(fd, nextFree);
-    if (nextFreeFlags & PAMU_INTERNAL_FLAG_FREE) { break; }
-    nextFree = _pamu_find_next(fd, nextFree);
+// Returns the reader's slot or error
+int pamu_reader_enter(int fd) {
+  struct pamu_state *state = _pamu_state(fd);
+  if (!state || !state->readerLimit) return PAMU_ERR_NOT_SUPPORTED;
+
+  uint64_t idle, epoch;
+  size_t   i;
+  for(i = 0; i < state->readerLimit; i++) {
+    idle  = 0;
+    epoch = atomic_load(&state->epoch);
+    if (!atomic_compare_exchange_strong(&state->readers[i], &idle, epoch)) continue;
+
+    // The writer may have moved on before it could see us
+    while(epoch != atomic_load(&state->epoch)) {
+      epoch = atomic_load(&state->epoch);
+      atomic_store(&state->readers[i], epoch);
+    }
+    return (int)i;
   }
-  if (nextFreeFlags & PAMU_INTERNAL_FLAG_FREE) {
-    lseek(fd, nextFree + PAMU_T_MARKER_SIZE, SEEK_SET);
-    read(fd, &previousFree, PAMU_T_POINTER_SIZE);
-    nextFree = hton(nextFree);
+
+  return PAMU_ERR_READER;
+}
+
+// Returns the state of fd if reader is a pinned slot
+struct pamu_state * _pamu_reader_state(int fd, int reader) {
+  struct pamu_state *state = _pamu_state(fd);
+  if (!state || (reader < 0) || ((size_t)reader >= state->readerLimit)) return NULL;
+  if (!atomic_load(&state->readers[reader])) return NULL;
+  return state;
+}
+
+int pamu_reader_leave(int fd, int reader) {
+  struct pamu_state *state = _pamu_reader_state(fd, reader);
+  if (!state) return PAMU_ERR_READER;
+  atomic_store(&state->readers[reader], 0);
+  return 0;
+}
+
+// Reads a start marker without touching shared state
+// Returns 0 at the end of the medium
+PAMU_T_MARKER _pamu_reader_marker(int fd, struct pamu_state *state, PAMU_T_POINTER block) {
+  PAMU_T_MARKER beMarker;
+  int64_t       end;
+  while(block < (end = atomic_load(&state->readerSize))) {
+    if (_pamu_pread(fd, block, &beMarker, PAMU_T_MARKER_SIZE) == PAMU_T_MARKER_SIZE) return ntoh(beMarker);
+
+    // A short read is fine if the medium was truncated underneath us
+    if (end == atomic_load(&state->readerSize)) return PAMU_ERR_READ_MALFORMED;
+  }
+  return 0;
+}
+
+// Iteration for concurrent readers
+PAMU_T_POINTER pamu_reader_next(int fd, int reader, PAMU_T_POINTER addr) {
+  struct pamu_state *state = _pamu_reader_state(fd, reader);
+  if (!state) return PAMU_ERR_READER;
+
+  // Find the outer addr of the block after the current one
+  PAMU_T_POINTER block = addr - PAMU_T_MARKER_SIZE;
+  PAMU_T_MARKER  marker;
+  if (block < (PAMU_T_POINTER)state->headerSize) {
+    block = state->headerSize;
   } else {
-    nextFree = 0;
+    marker = _pamu_reader_marker(fd, state, block);
+    if (!marker) return 0;
+    if (marker & PAMU_INTERNAL_FLAG_ERR) return PAMU_ERR_READ_MALFORMED;
+    block += (marker & ~PAMU_INTERNAL_FLAGS) + (2 * PAMU_T_MARKER_SIZE);
   }
 
-  // Find previous free block (or header) if not found yet
-  if (!previousFree) {
-    previousFree = _pamu_find_previous(fd, block, stat->headerSize);
-    while(
-      (previousFree) &&
-      (previousFree >= stat->headerSize)
-    ) {
-      previousFreeFlags = _pamu_find_flags(fd, previousFree);
-      if (previousFreeFlags & PAMU_INTERNAL_FLAG_FREE) break;
-      previousFree = _pamu_find_previous(fd, previousFree, stat->headerSize);
-    }
-    if ((previousFreeFlags & PAMU_INTERNAL_FLAG_FREE) && (!(previousFreeFlags & PAMU_INTERNAL_FLAG_ERR))) {
-      previousFree = hton(previousFree);
-    } else {
-      previousFree = 0;
-    }
+  // Skip free & pending blocks
+  while((marker = _pamu_reader_marker(fd, state, block))) {
+    if (marker & PAMU_INTERNAL_FLAG_ERR) return PAMU_ERR_READ_MALFORMED;
+    if (!(marker & PAMU_INTERNAL_FLAGS)) return block + PAMU_T_MARKER_SIZE;
+    block += (marker & ~PAMU_INTERNAL_FLAGS) + (2 * PAMU_T_MARKER_SIZE);
   }
 
-  // Write next & previous pointers to current block
-  lseek(fd, block + PAMU_T_MARKER_SIZE, SEEK_SET);
-  write(fd, &previousFree, PAMU_T_POINTER_SIZE);
-  write(fd, &nextFree    , PAMU_T_POINTER_SIZE);
+  // End of medium
+  return 0;
+}
 
-  // Update next block's previous pointer
-  if (nextFree) {
-    lseek(fd, ntoh(nextFree) + PAMU_T_MARKER_SIZE, SEEK_SET);
-    write(fd, &beBlock, PAMU_T_POINTER_SIZE);
+int pamu_reader_read(int fd, int reader, PAMU_T_POINTER addr, void *buf, size_t len) {
+  struct pamu_state *state = _pamu_reader_state(fd, reader);
+  if (!state) return PAMU_ERR_READER;
+
+  // Catch out-of-bounds
+  if (
+    (addr < (PAMU_T_POINTER)state->headerSize) ||
+    (addr + (int64_t)len > atomic_load(&state->readerSize))
+  ) {
+    return PAMU_ERR_OUT_OF_BOUNDS;
   }
 
-  // Update the previous block's next pointer
-  if (previousFree) {
-    lseek(fd, ntoh(previousFree) + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, SEEK_SET);
-    write(fd, &beBlock, PAMU_T_POINTER_SIZE);
+  return _pamu_pread(fd, addr, buf, len) == (ssize_t)len ? 0 : PAMU_ERR_READ_MALFORMED;
+}
+
+// Copies name into a zero-padded root table key
+// Returns 0 or error
+int _pamu_root_key(const char *name, char *key) {
+  size_t len = name ? strlen(name) : 0;
+  if ((!len) || (len > PAMU_ROOT_NAME_LEN)) return PAMU_ERR_INVALID_NAME;
+  memset(key, 0, PAMU_ROOT_NAME_LEN);
+  memcpy(key, name, len);
+  return 0;
+}
+
+// Returns the slot holding key, or the empty slot ending it's probe sequence
+// Returns -1 = not found & table full
+int _pamu_root_slot(const char *table, const char *key) {
+  size_t i;
+  size_t slot = _pamu_hash(key, PAMU_ROOT_NAME_LEN, 0) % PAMU_ROOT_SLOTS;
+  for(i = 0; i < PAMU_ROOT_SLOTS; i++) {
+    const char *entry = table + (slot * PAMU_ROOT_ENTRY);
+    if (!entry[0]) return slot;
+    if (!memcmp(entry, key, PAMU_ROOT_NAME_LEN)) return slot;
+    slot = (slot + 1) % PAMU_ROOT_SLOTS;
   }
+  return -1;
+}
 
-  // Merge with previous block if it's our neighbour
-  // Find previous block and it's flags
-  // TODO: check if _pamu_find_previous == ntoh(previousFree)
-  PAMU_T_POINTER previousAdjacent = _pamu_find_previous(fd, block, stat->headerSize);
-  PAMU_T_MARKER  previousAdjacentFlags, previousAdjacentSize, previousAdjacentMarker;
-  if (previousAdjacent >= 0) {
-    previousAdjacentFlags = _pamu_find_flags(fd, previousAdjacent);
-    previousAdjacentSize  = _pamu_find_size(fd, previousAdjacent);
-    if (previousAdjacentFlags & PAMU_INTERNAL_FLAG_FREE) {
-      // Merge the 2 blocks
-      previousAdjacentSize   += blockSize + (2 * PAMU_T_MARKER_SIZE);
-      previousAdjacentMarker  = hton(previousAdjacentSize | PAMU_INTERNAL_FLAG_FREE);
-      lseek(fd, previousAdjacent, SEEK_SET);
-      write(fd, &previousAdjacentMarker, PAMU_T_MARKER_SIZE);
-      read( fd, &previousFree, PAMU_T_POINTER_SIZE);
-      write(fd, &nextFree, PAMU_T_POINTER_SIZE);
-      lseek(fd, previousAdjacent + PAMU_T_MARKER_SIZE + previousAdjacentSize, SEEK_SET);
-      write(fd, &previousAdjacentMarker, PAMU_T_MARKER_SIZE);
-      // Update our own references
-      block     = previousAdjacent;
-      beBlock   = hton(block);
-      blockSize = previousAdjacentSize;
-    } else {
-      // Previous block is not free, ignore it
-    }
+// Reads the whole root table in one go
+// Returns table or error code
+char * _pamu_root_load(int fd) {
+  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
+  if (stat < 0) return (void*)stat;
+  uint32_t flags = stat->flags;
+  free(stat);
+  if (!(flags & PAMU_ROOTS)) return (void*)PAMU_ERR_NOT_SUPPORTED;
+
+  char *table = malloc(PAMU_ROOT_SLOTS * PAMU_ROOT_ENTRY);
+  if (_pamu_read(fd, PAMU_ROOT_OFFSET, table, PAMU_ROOT_SLOTS * PAMU_ROOT_ENTRY) != PAMU_ROOT_SLOTS * PAMU_ROOT_ENTRY) {
+    free(table);
+    return (void*)PAMU_ERR_READ_MALFORMED;
   }
+  return table;
+}
 
-  // Merge with next block if it's our neighbour
-  // Find next block and it's flags
-  // TODO: check if _pamu_find_next == ntoh(nextFree)
-  PAMU_T_POINTER nextAdjacent = _pamu_find_next(fd, block);
-  PAMU_T_MARKER nextAdjacentFlags, nextAdjacentSize;
-  if (nextAdjacent < stat->mediumSize) {
-    nextAdjacentFlags = _pamu_find_flags(fd, nextAdjacent);
-    nextAdjacentSize  = _pamu_find_size(fd, nextAdjacent);
-    if (nextAdjacentFlags & PAMU_INTERNAL_FLAG_FREE) {
-      // Merge the 2 blocks
-      // Update block stats
-      blockSize   += nextAdjacentSize + (2 * PAMU_T_MARKER_SIZE);
-      blockMarker  = hton(blockSize | PAMU_INTERNAL_FLAG_FREE);
-      // Read new next
-      lseek(fd, nextAdjacent + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, SEEK_SET);
-      read(fd, &nextFree, PAMU_T_POINTER_SIZE);
-      // Update our current block
-      lseek(fd, block, SEEK_SET);
-      write(fd, &blockMarker, PAMU_T_MARKER_SIZE);
-      lseek(fd, block + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, SEEK_SET);
-      write(fd, &nextFree, PAMU_T_POINTER_SIZE);
-      lseek(fd, block + blockSize + PAMU_T_MARKER_SIZE, SEEK_SET);
-      write(fd, &blockMarker, PAMU_T_MARKER_SIZE);
-      // Update nextFree's previous pointer
-      if (nextFree) {
-        lseek(fd, ntoh(nextFree) + PAMU_T_MARKER_SIZE, SEEK_SET);
-        write(fd, &beBlock, PAMU_T_POINTER_SIZE);
-      }
-      // Update references?
-    } else {
-      // Next block is not free, ignore it
-    }
-  } else if (stat->flags & PAMU_DYNAMIC) {
-    // Truncate the file if in dynamic mode
-    // Set previousFree's next pointer to 0
-    lseek(fd, ntoh(previousFree) + PAMU_T_MARKER_SIZE + PAMU_T_POINTER_SIZE, SEEK_SET);
-    write(fd, &zero, PAMU_T_POINTER_SIZE);
-    if (ftruncate(fd, stat->mediumSize - (2 * PAMU_T_MARKER_SIZE) - blockSize)) {
-      perror("ftruncate");
-      exit(1);
-    }
+int pamu_root_set(int fd, const char *name, PAMU_T_POINTER addr) {
+  char key[PAMU_ROOT_NAME_LEN];
+  int rc = _pamu_root_key(name, key);
+  if (rc) return rc;
+
+  char *table = _pamu_root_load(fd);
+  if (table < 0) return (int)(intptr_t)table;
+
+  // Make sure this operation fits in the current journal group
+  rc = _pamu_journal_reserve(fd, PAMU_ROOT_SLOTS * PAMU_ROOT_ENTRY);
+  if (rc) {
+    free(table);
+    return rc;
+  }
+
+  int slot = _pamu_root_slot(table, key);
+  free(table);
+  if (slot < 0) return PAMU_ERR_ROOT_FULL;
+
+  // Name & pointer, written as a single entry
+  char entry[PAMU_ROOT_ENTRY];
+  PAMU_T_POINTER beAddr = hton(addr);
+  memcpy(entry, key, PAMU_ROOT_NAME_LEN);
+  memcpy(entry + PAMU_ROOT_NAME_LEN, &beAddr, PAMU_T_POINTER_SIZE);
+  if (_pamu_write(fd, PAMU_ROOT_OFFSET + (slot * PAMU_ROOT_ENTRY), entry, PAMU_ROOT_ENTRY) < 0) {
+    return PAMU_ERR_WRITE;
   }
 
-  free(stat);
   return 0;
 }
 
-PAMU_T_MARKER pamu_size(int fd, PAMU_T_POINTER addr) {
-  return _pamu_find_size(fd, addr - PAMU_T_MARKER_SIZE);
+// Returns the pointer stored under name, 0 = not set
+PAMU_T_POINTER pamu_root_get(int fd, const char *name) {
+  char key[PAMU_ROOT_NAME_LEN];
+  int rc = _pamu_root_key(name, key);
+  if (rc) return rc;
+
+  char *table = _pamu_root_load(fd);
+  if (table < 0) return (PAMU_T_POINTER)(intptr_t)table;
+
+  PAMU_T_POINTER beAddr = 0;
+  int slot = _pamu_root_slot(table, key);
+  if ((slot >= 0) && table[slot * PAMU_ROOT_ENTRY]) {
+    memcpy(&beAddr, table + (slot * PAMU_ROOT_ENTRY) + PAMU_ROOT_NAME_LEN, PAMU_T_POINTER_SIZE);
+  }
+
+  free(table);
+  return ntoh(beAddr);
 }
 
-// Iteration, so clients can find a reference
-PAMU_T_POINTER pamu_next(int fd, PAMU_T_POINTER addr) {
+int pamu_root_del(int fd, const char *name) {
+  char key[PAMU_ROOT_NAME_LEN];
+  int rc = _pamu_root_key(name, key);
+  if (rc) return rc;
 
-  // Fetch info (or return error code)
-  struct pamu_medium_stat *stat = _pamu_medium_stat(fd);
-  if (stat < 0) return (PAMU_T_POINTER)stat;
+  char *table = _pamu_root_load(fd);
+  if (table < 0) return (int)(intptr_t)table;
 
-  // Find the outer addr of current block
-  PAMU_T_POINTER block = addr - PAMU_T_MARKER_SIZE;
-  if (block < stat->headerSize) {
-    block = stat->headerSize;
-  } else {
-    block = _pamu_find_next(fd, block);
+  // Not set = nothing to do
+  int slot = _pamu_root_slot(table, key);
+  if ((slot < 0) || !table[slot * PAMU_ROOT_ENTRY]) {
+    free(table);
+    return 0;
   }
 
-  PAMU_T_MARKER flags;
-  while(block < stat->mediumSize) {
-    flags = _pamu_find_flags(fd, block);
-    if (!(flags & PAMU_INTERNAL_FLAG_FREE)) break;
-    block = _pamu_find_next(fd, block);
+  // Make sure this operation fits in the current journal group
+  rc = _pamu_journal_reserve(fd, PAMU_ROOT_SLOTS * PAMU_ROOT_ENTRY);
+  if (rc) {
+    free(table);
+    return rc;
   }
 
-  // End of medium
-  if (block == stat->mediumSize) {
-    free(stat);
-    return 0;
+  // Shift later entries of the probe sequence back, no tombstones needed
+  size_t i = slot;
+  size_t j = slot;
+  size_t home;
+  memset(table + (i * PAMU_ROOT_ENTRY), 0, PAMU_ROOT_ENTRY);
+  for(;;) {
+    j = (j + 1) % PAMU_ROOT_SLOTS;
+    if (!table[j * PAMU_ROOT_ENTRY]) break;
+    home = _pamu_hash(table + (j * PAMU_ROOT_ENTRY), PAMU_ROOT_NAME_LEN, 0) % PAMU_ROOT_SLOTS;
+    if ((i <= j) ? ((i < home) && (home <= j)) : ((i < home) || (home <= j))) continue;
+    memcpy(table + (i * PAMU_ROOT_ENTRY), table + (j * PAMU_ROOT_ENTRY), PAMU_ROOT_ENTRY);
+    memset(table + (j * PAMU_ROOT_ENTRY), 0, PAMU_ROOT_ENTRY);
+    i = j;
   }
 
-  // Return the inner addr of the found allocated block
-  free(stat);
-  return block + PAMU_T_MARKER_SIZE;
+  rc = _pamu_write(fd, PAMU_ROOT_OFFSET, table, PAMU_ROOT_SLOTS * PAMU_ROOT_ENTRY) < 0 ? PAMU_ERR_WRITE : 0;
+  free(table);
+  return rc;
 }
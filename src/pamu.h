@@ -11,12 +11,37 @@
 #define PAMU_T_POINTER  int64_t
 #endif
 
+#ifndef PAMU_JOURNAL_SIZE
+#define PAMU_JOURNAL_SIZE  16384
+#endif
+
+#ifndef PAMU_ROOT_SLOTS
+#define PAMU_ROOT_SLOTS  32
+#endif
+#define PAMU_ROOT_NAME_LEN  24
+
+#ifndef PAMU_EXTENT_MIN
+#define PAMU_EXTENT_MIN  4096
+#endif
+
+#ifndef PAMU_EXTENT_MAX
+#define PAMU_EXTENT_MAX  64
+#endif
+
 #define PAMU_T_MARKER_SIZE  sizeof(PAMU_T_MARKER)
 #define PAMU_T_POINTER_SIZE sizeof(PAMU_T_POINTER)
+#define PAMU_TIER_BIT       ((PAMU_T_POINTER)1 << ((8 * PAMU_T_POINTER_SIZE) - 2))
 
 #define  PAMU_DEFAULT  (0)
-#define  PAMU_DYNAMIC  (1 << 31)
-#define  PAMU_FLAGS    (PAMU_DYNAMIC)
+#define  PAMU_DYNAMIC  ((int)(1U << 31))
+#define  PAMU_JOURNAL  (1 << 30)
+#define  PAMU_LAZY     (1 << 29)
+#define  PAMU_ROOTS    (1 << 28)
+#define  PAMU_COMPRESS (1 << 27)
+#define  PAMU_DEDUP    (1 << 26)
+#define  PAMU_POOL     (1 << 25)
+#define  PAMU_CLEAN    (1 << 24)
+#define  PAMU_FLAGS    (PAMU_DYNAMIC|PAMU_JOURNAL|PAMU_LAZY|PAMU_ROOTS|PAMU_COMPRESS|PAMU_DEDUP|PAMU_POOL|PAMU_CLEAN)
 
 #define  PAMU_ERR_NONE                 (  0)
 #define  PAMU_ERR_MEDIUM_SIZE          (- 1)
@@ -29,11 +54,36 @@
 #define  PAMU_ERR_OUT_OF_BOUNDS        (- 8)
 #define  PAMU_ERR_INVALID_ADDRESS      (- 9)
 #define  PAMU_ERR_DOUBLE_FREE          (-10)
+#define  PAMU_ERR_JOURNAL_FULL         (-11)
+#define  PAMU_ERR_NOT_SUPPORTED        (-12)
+#define  PAMU_ERR_TXN                  (-13)
+#define  PAMU_ERR_ROOT_FULL            (-14)
+#define  PAMU_ERR_INVALID_NAME         (-15)
+#define  PAMU_ERR_READER               (-16)
 
 // In-file structure
 //   header:
 //     "PAMU"     Keyword           To check if an FD was already initialized
 //     uint32_t   flags|headerSize  Feature flags + size of the header on medium
+//     char[]     roots             Root table, only with PAMU_ROOTS
+//     char[2][]  journal           Journal slots, only with PAMU_JOURNAL
+//     int64_t    snapshot          State snapshot, 0 = not closed cleanly, only with PAMU_CLEAN
+//     uint64_t   length            Size of the state snapshot
+//     uint32_t   recordSize        Size of a pool record, only with PAMU_POOL
+//     uint32_t   reserved          Zero
+//   root:
+//     char[24]   name              Zero-padded, empty = unused slot
+//     uint64_t   pointer           Pointer stored under the name
+//   journal record:
+//     "PAMJ"     Keyword           To check if a slot holds a record
+//     uint32_t   length            Size of the entries following the record header
+//     uint64_t   sequence          Group sequence number, latest valid one is replayed
+//     int64_t    mediumSize        Logical medium size after the group
+//     uint64_t   checksum          Hash of the record with this field zeroed
+//     entries:
+//       int64_t  address           Where to write the data
+//       uint32_t length            Size of the data
+//       char[]   data              Metadata to write in-place
 //   entry_free:
 //     uint64_t   free|size         Free marker/flag + size of the entry
 //     uint64_t   pointer           Pointer to the previous free entry
@@ -42,18 +92,167 @@
 //     uint64_t   free|size         Free marker/flag + size of the entry
 //   entry_allocated:
 //     uint64_t   size              Size of the entry
-//     char[16+]  blob              Application data
+//     char[16+]  blob              Application data, framed with PAMU_COMPRESS
+//     char[16]   trailer           Only with PAMU_DEDUP
 //     uint64_t   size              Size of the entry
+//   entry_pending:
+//     uint64_t   pending|size      Freed with PAMU_LAZY, not coalesced yet
+//     char[16+]  blob              Unused space
+//     uint64_t   pending|size      Freed with PAMU_LAZY, not coalesced yet
+//   frame:
+//     uint32_t   length            Logical size of the blob
+//     uint32_t   packed            Size of the compressed data, 0 = stored as-is
+//     char[]     data              LZ4 block format when packed
+//   trailer:
+//     uint64_t   hash              Hash of the content, 0 = not deduplicated
+//     uint32_t   references        Pointers handed out for the content
+//     uint32_t   length            Logical size of the blob
+//   extent list:                   Blob returned by pamu_alloc_extents
+//     uint64_t   length            Logical size of the large blob
+//     uint32_t   count             Number of extents
+//     uint32_t   reserved          Zero
+//     extents:
+//       int64_t  pointer           Blob holding the extent
+//       int64_t  size              Size of that blob
+//   state snapshot:                Written by pamu_close into a free block
+//     "PAMS"     Keyword           To check if the snapshot is still there
+//     uint32_t   contents          1 = free index, 2 = dedup table, 4 = no lazy frees
+//     int64_t    mediumSize        Medium size at the time of the snapshot
+//     uint64_t   indexCount        Free blocks in the index
+//     uint64_t   dedupLimit        Slots of the dedup table
+//     uint64_t   dedupCount        Used slots of the dedup table
+//     uint64_t   checksum          Hash of the snapshot with this field zeroed
+//     int64_t[2][] index           Address & size of each free block
+//     uint64_t[2][] dedup          Hash & pointer of each dedup slot
+//   pool chunk:                    Replaces the entries with PAMU_POOL
+//     uint64_t[64] bitmap          Bit set = record allocated, LSB first
+//     char[4096][] records         Fixed-size records, no markers
 
 // Open/close functionality
 int pamu_init(int fd, uint32_t flags);
+int pamu_init_pool(int fd, uint32_t flags, uint32_t recordSize);
+int pamu_flush(int fd);
+int pamu_close(int fd);
+
+// Clones the medium into a new file, reflinked when the filesystem allows
+int pamu_snapshot(int fd, const char *path);
+
+// Change log for incremental replication, the callback is given each range of
+// the file modified since the checkpoint and the file's current size
+typedef int (*pamu_change_cb)(void *udata, int64_t addr, int64_t len, int64_t size);
+int64_t pamu_checkpoint(int fd);
+int64_t pamu_changes_since(int fd, int64_t checkpoint, pamu_change_cb cb, void *udata);
+int64_t pamu_replicate(int fd, int replicaFd, int64_t checkpoint);
+
+// Write-back page cache of medium metadata, 0 pages disables it
+int pamu_cache(int fd, size_t pages);
+
+// Releases disk space of free blocks of at least size bytes, 0 disables it
+int pamu_punch(int fd, PAMU_T_MARKER size);
+
+// Places blobs of at least threshold bytes on a second, slower medium, their
+// pointers carry PAMU_TIER_BIT, 0 unbinds it
+int pamu_tier(int fd, int slowFd, PAMU_T_MARKER threshold);
+
+// Grows or shrinks a static medium in-place, never moving blobs
+int pamu_resize(int fd, int64_t size);
 
 // Core, alloc & free within the medium
 PAMU_T_POINTER  pamu_alloc(int fd, PAMU_T_MARKER   size);
+PAMU_T_POINTER  pamu_alloc_near(int fd, PAMU_T_MARKER size, PAMU_T_POINTER hint);
+PAMU_T_POINTER  pamu_alloc_group(int fd, PAMU_T_MARKER size, uint64_t group);
 int             pamu_free(int fd , PAMU_T_POINTER  addr);
 PAMU_T_MARKER   pamu_size(int fd , PAMU_T_POINTER  addr);
 
+// Coalesces up to budget lazily freed blocks, 0 = all of them
+int             pamu_maintain(int fd, size_t budget);
+
+// Bulk loading into an empty medium, the iterator is given the pointer of the
+// next blob and returns it's size & data, 0 = done
+typedef PAMU_T_MARKER (*pamu_bulk_next)(void *udata, PAMU_T_POINTER addr, const void **data);
+int             pamu_bulk_load(int fd, pamu_bulk_next next, void *udata);
+
+// Blob data, staged when within a transaction
+int             pamu_write(int fd, PAMU_T_POINTER addr, const void *buf, size_t len);
+int             pamu_read(int fd , PAMU_T_POINTER addr, void *buf, size_t len);
+
+// Allocates a blob holding buf, only as large as it compresses to
+PAMU_T_POINTER  pamu_put(int fd, const void *buf, size_t len);
+
+// Returns a blob holding buf, shared with any other holding the same content
+PAMU_T_POINTER  pamu_alloc_dedup(int fd, const void *buf, size_t len);
+
+// Large blobs spread over free blocks of at least PAMU_EXTENT_MIN bytes, at
+// most PAMU_EXTENT_MAX of them, read & written as a stream
+PAMU_T_POINTER  pamu_alloc_extents(int fd, int64_t size);
+int             pamu_extents_write(int fd, PAMU_T_POINTER addr, int64_t offset, const void *buf, size_t len);
+int             pamu_extents_read(int fd, PAMU_T_POINTER addr, int64_t offset, void *buf, size_t len);
+int64_t         pamu_extents_size(int fd, PAMU_T_POINTER addr);
+int             pamu_free_extents(int fd, PAMU_T_POINTER addr);
+
+// Transactions, atomic groups of operations on journaled media
+int pamu_txn_begin(int fd);
+int pamu_txn_commit(int fd);
+int pamu_txn_abort(int fd);
+
 // Iteration, so clients can find a reference
 PAMU_T_POINTER  pamu_next(int fd , PAMU_T_POINTER  addr);
 
+// Streams live blobs out of a medium & loads them into an empty one, keep
+// places them at their original addresses instead of packing them
+int             pamu_export(int fd, int outFd);
+int             pamu_import(int fd, int inFd, int keep);
+
+// Walks all blocks of a medium with large sequential reads, straight from disk,
+// the callback stops the scan by returning non-zero
+#define  PAMU_BLOCK_FREE     1
+#define  PAMU_BLOCK_PENDING  2
+struct pamu_block {
+  int64_t addr;     // Outer address, pointing at the start marker
+  int64_t size;     // Size between the markers
+  int     flags;    // PAMU_BLOCK_*, 0 = allocated
+  int64_t prevFree; // Free list links, free blocks only
+  int64_t nextFree;
+};
+typedef int (*pamu_scan_cb)(void *udata, const struct pamu_block *block);
+int64_t         pamu_scan(int fd, pamu_scan_cb cb, void *udata);
+
+// Concurrent readers next to a single writer on lazy media, each reader
+// thread pins a slot while it iterates & reads
+int             pamu_readers(int fd, int slots);
+int             pamu_reader_enter(int fd);
+int             pamu_reader_leave(int fd, int reader);
+PAMU_T_POINTER  pamu_reader_next(int fd, int reader, PAMU_T_POINTER addr);
+int             pamu_reader_read(int fd, int reader, PAMU_T_POINTER addr, void *buf, size_t len);
+
+// Tracing, only compiled in with PAMU_TRACE
+#ifdef PAMU_TRACE
+#define  PAMU_TRACE_ALLOC_ENTRY  ( 1)
+#define  PAMU_TRACE_ALLOC_EXIT   ( 2)
+#define  PAMU_TRACE_FREE_ENTRY   ( 3)
+#define  PAMU_TRACE_FREE_EXIT    ( 4)
+#define  PAMU_TRACE_NEXT_ENTRY   ( 5)
+#define  PAMU_TRACE_NEXT_EXIT    ( 6)
+#define  PAMU_TRACE_SPLIT        ( 7)
+#define  PAMU_TRACE_MERGE        ( 8)
+#define  PAMU_TRACE_GROW         ( 9)
+#define  PAMU_TRACE_TRUNCATE     (10)
+
+struct pamu_trace_event {
+  int      type;
+  int      fd;
+  int64_t  addr; // Pointer or block the event is about
+  int64_t  size; // Size involved, or the return code of pamu_free
+  int64_t  walk; // Blocks visited so far within the operation
+  int64_t  ns;   // Duration of the operation, on exit only
+};
+typedef void (*pamu_trace_hook)(const struct pamu_trace_event *event, void *udata);
+void pamu_trace(pamu_trace_hook hook, void *udata);
+#endif
+
+// Named root pointers, only with PAMU_ROOTS
+int             pamu_root_set(int fd, const char *name, PAMU_T_POINTER addr);
+PAMU_T_POINTER  pamu_root_get(int fd, const char *name);
+int             pamu_root_del(int fd, const char *name);
+
 #endif // __FINWO_PAMU_H__
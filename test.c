@@ -3,9 +3,12 @@
 
 #include <endian.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 // Overloaded ntoh & hton
@@ -417,6 +420,1709 @@ void test_comfort_next() {
   free(tempfile);
 }
 
+void test_journal() {
+  PAMU_T_MARKER  marker = 0;
+  PAMU_T_POINTER current;
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  // Basic initialize
+  int rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC | PAMU_JOURNAL);
+  ASSERT("Medium initialized without errors", rc == 0);
+  off_t headerSize = lseek(fd, 0, SEEK_END);
+  ASSERT("Header includes both journal slots", headerSize == 8 + (2 * PAMU_JOURNAL_SIZE));
+
+  PAMU_T_POINTER a0 = pamu_alloc(fd,  64);
+  PAMU_T_POINTER a1 = pamu_alloc(fd, 128);
+  PAMU_T_POINTER a2 = pamu_alloc(fd,  64);
+  pamu_free(fd, a1);
+
+  // Operations are visible before they are committed
+  ASSERT("Pending group is not written in-place", lseek(fd, 0, SEEK_END) == headerSize);
+  ASSERT("next(0)  == a0", (current = pamu_next(fd, 0)) == a0);
+  ASSERT("next(a0) == a2", (current = pamu_next(fd, current)) == a2);
+  ASSERT("a2.size  == 64", pamu_size(fd, a2) == 64);
+
+  // Group commit
+  ASSERT("Flush commits without errors", pamu_flush(fd) == 0);
+  ASSERT("Committed group is written in-place", lseek(fd, 0, SEEK_END) == a2 + 64 + PAMU_T_MARKER_SIZE);
+
+  // Lose the in-place writes, as if we crashed before they reached the disk
+  pwrite(fd, &marker, PAMU_T_MARKER_SIZE, a0 - PAMU_T_MARKER_SIZE);
+  pwrite(fd, &marker, PAMU_T_MARKER_SIZE, a2 - PAMU_T_MARKER_SIZE);
+
+  // Uncommitted operations must not survive
+  pamu_alloc(fd, 32);
+
+  // Re-open, which replays the journal
+  int fd2 = open(tempfile, O_RDWR);
+  ASSERT("replay: next(0)  == a0", (current = pamu_next(fd2, 0)) == a0);
+  ASSERT("replay: next(a0) == a2", (current = pamu_next(fd2, current)) == a2);
+  ASSERT("replay: next(a2) ==  0", (current = pamu_next(fd2, current)) ==  0);
+  ASSERT("replay: a0.size  == 64", pamu_size(fd2, a0) == 64);
+
+  // Remove the temporary file
+  pamu_close(fd2);
+  close(fd2);
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+}
+
+void test_journal_static() {
+  char          *zero = calloc(1, 65536);
+  char           data[256], buf[256];
+  PAMU_T_POINTER current;
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  // Basic initialize
+  pwrite(fd, zero, 65536, 0);
+  int rc = pamu_init(fd, PAMU_DEFAULT | PAMU_JOURNAL);
+  ASSERT("Medium initialized without errors", rc == 0);
+
+  PAMU_T_POINTER a0 = pamu_alloc(fd, 64);
+  PAMU_T_POINTER a1 = pamu_alloc(fd, 64);
+  PAMU_T_POINTER a2 = pamu_alloc(fd, 64);
+  PAMU_T_POINTER a3 = pamu_alloc(fd, 64);
+  PAMU_T_POINTER a4 = pamu_alloc(fd, 64);
+  pamu_free(fd, a3);
+  ASSERT("Flush commits without errors", pamu_flush(fd) == 0);
+
+  // The last commit only rewrites the metadata around a3
+  ASSERT("Allocation reuses a3", pamu_alloc(fd, 64) == a3);
+  ASSERT("Flush commits without errors", pamu_flush(fd) == 0);
+
+  // Blob data is written before the group that allocated it is committed,
+  // over the markers of freed blobs & the links of the free tail
+  memset(data, 'X', sizeof(data));
+  pamu_free(fd, a1);
+  pamu_free(fd, a0);
+  current = pamu_alloc(fd, 128 + (2 * PAMU_T_MARKER_SIZE));
+  ASSERT("Allocation reuses the freed blobs", current == a0);
+  ASSERT("Write over the freed blobs", pamu_write(fd, current, data, 128 + (2 * PAMU_T_MARKER_SIZE)) == 0);
+  pamu_read(fd, current, buf, 128 + (2 * PAMU_T_MARKER_SIZE));
+  ASSERT("Pending blob reads back", !memcmp(buf, data, 128 + (2 * PAMU_T_MARKER_SIZE)));
+  current = pamu_alloc(fd, 64);
+  ASSERT("Allocation reuses the free tail", current > a4);
+  ASSERT("Write into the free tail", pamu_write(fd, current, data, 64) == 0);
+
+  // Re-open as if we crashed before the commit
+  int fd2 = open(tempfile, O_RDWR);
+  ASSERT("replay: next(0)  == a0", (current = pamu_next(fd2, 0)) == a0);
+  ASSERT("replay: next(a0) == a1", (current = pamu_next(fd2, current)) == a1);
+  ASSERT("replay: next(a1) == a2", (current = pamu_next(fd2, current)) == a2);
+  ASSERT("replay: next(a2) == a3", (current = pamu_next(fd2, current)) == a3);
+  ASSERT("replay: next(a3) == a4", (current = pamu_next(fd2, current)) == a4);
+  ASSERT("replay: next(a4) ==  0", (current = pamu_next(fd2, current)) ==  0);
+  ASSERT("replay: a1.size  == 64", pamu_size(fd2, a1) == 64);
+  ASSERT("replay: free tail is usable", pamu_alloc(fd2, 20000) > a4);
+  ASSERT("replay: commits without errors", pamu_flush(fd2) == 0);
+
+  // Remove the temporary file
+  pamu_close(fd2);
+  close(fd2);
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+  free(zero);
+}
+
+void test_txn() {
+  char buf[16];
+  PAMU_T_POINTER current;
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  // Basic initialize
+  int rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC | PAMU_JOURNAL);
+  ASSERT("Medium initialized without errors", rc == 0);
+
+  PAMU_T_POINTER a0 = pamu_alloc(fd, 64);
+  PAMU_T_POINTER a1 = pamu_alloc(fd, 64);
+  pamu_write(fd, a0, "old record", 11);
+  ASSERT("Flush commits without errors", pamu_flush(fd) == 0);
+  off_t size = lseek(fd, 0, SEEK_END);
+
+  // Aborted: new record, overwrite & free never reach the medium
+  ASSERT("Transaction started", pamu_txn_begin(fd) == 0);
+  ASSERT("Nested transaction rejected", pamu_txn_begin(fd) == PAMU_ERR_TXN);
+  PAMU_T_POINTER a2 = pamu_alloc(fd, 64);
+  ASSERT("Allocation within transaction", a2 > a1);
+  ASSERT("Write new record", pamu_write(fd, a2, "new record", 11) == 0);
+  ASSERT("Overwrite old record", pamu_write(fd, a0, "bad record", 11) == 0);
+  pamu_read(fd, a0, buf, 11);
+  ASSERT("Transaction reads it's own writes", !strcmp(buf, "bad record"));
+  pamu_free(fd, a0);
+  ASSERT("Flush refused within transaction", pamu_flush(fd) == PAMU_ERR_TXN);
+  ASSERT("Transaction aborted", pamu_txn_abort(fd) == 0);
+  ASSERT("Medium size unchanged", lseek(fd, 0, SEEK_END) == size);
+  ASSERT("abort: next(0)  == a0", (current = pamu_next(fd, 0)) == a0);
+  ASSERT("abort: next(a0) == a1", (current = pamu_next(fd, current)) == a1);
+  ASSERT("abort: next(a1) ==  0", (current = pamu_next(fd, current)) ==  0);
+  pamu_read(fd, a0, buf, 11);
+  ASSERT("Old record untouched", !strcmp(buf, "old record"));
+
+  // Committed: allocate new record, write it, free old record
+  ASSERT("Transaction started", pamu_txn_begin(fd) == 0);
+  a2 = pamu_alloc(fd, 64);
+  pamu_write(fd, a2, "new record", 11);
+  pamu_free(fd, a0);
+  ASSERT("Transaction committed", pamu_txn_commit(fd) == 0);
+  ASSERT("commit: next(0)  == a1", (current = pamu_next(fd, 0)) == a1);
+  ASSERT("commit: next(a1) == a2", (current = pamu_next(fd, current)) == a2);
+
+  // Survives a re-open
+  int fd2 = open(tempfile, O_RDWR);
+  ASSERT("replay: next(0)  == a1", (current = pamu_next(fd2, 0)) == a1);
+  ASSERT("replay: next(a1) == a2", (current = pamu_next(fd2, current)) == a2);
+  pamu_read(fd2, a2, buf, 11);
+  ASSERT("replay: new record written", !strcmp(buf, "new record"));
+
+  // Aborting keeps the last commit's tail, even when the group cut it off
+  size = lseek(fd, 0, SEEK_END);
+  pamu_free(fd, a2);
+  ASSERT("Transaction started", pamu_txn_begin(fd) == 0);
+  pamu_alloc(fd, 16);
+  ASSERT("Transaction aborted", pamu_txn_abort(fd) == 0);
+  ASSERT("Committed tail kept", lseek(fd, 0, SEEK_END) == size);
+
+  // Remove the temporary file
+  pamu_close(fd2);
+  close(fd2);
+  pamu_close(fd);
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+}
+
+void test_txn_static() {
+  char          *zero = calloc(1, 65536);
+  char           buf[16];
+  PAMU_T_POINTER current;
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  // Basic initialize
+  pwrite(fd, zero, 65536, 0);
+  int rc = pamu_init(fd, PAMU_DEFAULT | PAMU_JOURNAL);
+  ASSERT("Medium initialized without errors", rc == 0);
+
+  PAMU_T_POINTER a0 = pamu_alloc(fd, 64);
+  pamu_write(fd, a0, "old record", 11);
+  ASSERT("Flush commits without errors", pamu_flush(fd) == 0);
+
+  // Aborted: the new record reuses the free tail & is written in-place
+  ASSERT("Transaction started", pamu_txn_begin(fd) == 0);
+  PAMU_T_POINTER a1 = pamu_alloc(fd, 64);
+  ASSERT("Allocation reuses the free tail", a1 > a0);
+  ASSERT("Write new record", pamu_write(fd, a1, "new record, longer than the links", 34) == 0);
+  ASSERT("Transaction aborted", pamu_txn_abort(fd) == 0);
+  ASSERT("abort: next(0)  == a0", (current = pamu_next(fd, 0)) == a0);
+  ASSERT("abort: next(a0) ==  0", (current = pamu_next(fd, current)) ==  0);
+
+  // The free tail is intact
+  ASSERT("Allocation reuses the free tail", pamu_alloc(fd, 64) == a1);
+  ASSERT("Allocation of the remainder", pamu_alloc(fd, 20000) > a1);
+  ASSERT("Flush commits without errors", pamu_flush(fd) == 0);
+  pamu_read(fd, a0, buf, 11);
+  ASSERT("Old record untouched", !strcmp(buf, "old record"));
+
+  // Aborted: a record freed within the transaction is handed out again
+  char data[53];
+  pamu_write(fd, a0, "OLD-RECORD-DATA-OLD-RECORD-DATA-OLD-RECORD-DATA-OLD", 52);
+  ASSERT("Flush commits without errors", pamu_flush(fd) == 0);
+  ASSERT("Transaction started", pamu_txn_begin(fd) == 0);
+  ASSERT("Old record freed", pamu_free(fd, a0) == 0);
+  ASSERT("Allocation reuses the freed record", pamu_alloc(fd, 64) == a0);
+  ASSERT("Write over the freed record", pamu_write(fd, a0, "NEW-RECORD-DATA-NEW-RECORD-DATA-NEW-RECORD-DATA-NEW", 52) == 0);
+  ASSERT("Transaction aborted", pamu_txn_abort(fd) == 0);
+  ASSERT("abort: size is unchanged", pamu_size(fd, a0) == 64);
+  pamu_read(fd, a0, data, 52);
+  ASSERT("abort: old record is back", !strcmp(data, "OLD-RECORD-DATA-OLD-RECORD-DATA-OLD-RECORD-DATA-OLD"));
+
+  // Crashed: the same, re-opened without committing
+  ASSERT("Transaction started", pamu_txn_begin(fd) == 0);
+  pamu_free(fd, a0);
+  ASSERT("Allocation reuses the freed record", pamu_alloc(fd, 64) == a0);
+  pamu_write(fd, a0, "NEW-RECORD-DATA-NEW-RECORD-DATA-NEW-RECORD-DATA-NEW", 52);
+  int fd2 = open(tempfile, O_RDWR);
+  ASSERT("crash: next(0) == a0", pamu_next(fd2, 0) == a0);
+  ASSERT("crash: size is unchanged", pamu_size(fd2, a0) == 64);
+  pamu_read(fd2, a0, data, 52);
+  ASSERT("crash: old record is intact", !strcmp(data, "OLD-RECORD-DATA-OLD-RECORD-DATA-OLD-RECORD-DATA-OLD"));
+  pamu_close(fd2);
+  close(fd2);
+  pamu_txn_abort(fd);
+
+  // Remove the temporary file
+  pamu_close(fd);
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+  free(zero);
+}
+
+void test_alloc_near() {
+  int i;
+  PAMU_T_POINTER a[16];
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  // Emulate a block device with fixed size
+  char *buf = calloc(1, 4096);
+  write(fd, buf, 4096);
+  free(buf);
+
+  // Basic initialize
+  int rc = pamu_init(fd, PAMU_DEFAULT);
+  ASSERT("Medium initialized without errors", rc == 0);
+
+  // Punch some holes in a row of blobs
+  for(i=0; i<16; i++) a[i] = pamu_alloc(fd, 64);
+  pamu_free(fd, a[2]);
+  pamu_free(fd, a[12]);
+
+  // First-fit would return the 1st hole for both
+  ASSERT("near(a11) == a12", pamu_alloc_near(fd, 64, a[11]) == a[12]);
+  ASSERT("near(a3)  == a2 ", pamu_alloc_near(fd, 64, a[3])  == a[2]);
+
+  // Members of a group are placed next to each other
+  pamu_free(fd, a[9]);
+  PAMU_T_POINTER g0 = pamu_alloc_group(fd, 16, 42);
+  PAMU_T_POINTER g1 = pamu_alloc_group(fd, 16, 42);
+  ASSERT("group member 2 follows member 1", g1 == g0 + 16 + PAMU_T_MARKER_SIZE + PAMU_T_MARKER_SIZE);
+
+  // Carves the end of a free block before the hint
+  pamu_free(fd, a[5]);
+  PAMU_T_POINTER n = pamu_alloc_near(fd, 16, a[6]);
+  ASSERT("near(a6) is within the a5 hole", (n >= a[5]) && (n + 16 <= a[5] + 64));
+  ASSERT("near(a6) is the end of the a5 hole", (n + 16 == a[5] + 64) || (n == a[5]));
+
+  // Remove the temporary file
+  pamu_close(fd);
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+}
+
+void test_cache() {
+  PAMU_T_MARKER  marker;
+  PAMU_T_POINTER current;
+  int i;
+  PAMU_T_POINTER a[32];
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  // Basic initialize
+  int rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC);
+  ASSERT("Medium initialized without errors", rc == 0);
+  ASSERT("Cache enabled without errors", pamu_cache(fd, 2) == 0);
+
+  // Metadata stays in memory until flushed
+  PAMU_T_POINTER a0 = pamu_alloc(fd, 64);
+  PAMU_T_POINTER a1 = pamu_alloc(fd, 64);
+  ASSERT("Cached allocations are not written", lseek(fd, 0, SEEK_END) == 8);
+  ASSERT("next(0)  == a0", (current = pamu_next(fd, 0)) == a0);
+  ASSERT("next(a0) == a1", (current = pamu_next(fd, current)) == a1);
+  ASSERT("a1.size  == 64", pamu_size(fd, a1) == 64);
+
+  // Blob data shares pages with metadata, but is not overwritten by it
+  char buf[64];
+  memset(buf, 'x', sizeof(buf));
+  ASSERT("Blob written without errors", pamu_write(fd, a0, buf, sizeof(buf)) == 0);
+  pamu_free(fd, a1);
+  ASSERT("Flush writes back without errors", pamu_flush(fd) == 0);
+  ASSERT("Written back medium ends after a0", lseek(fd, 0, SEEK_END) == a0 + 64 + PAMU_T_MARKER_SIZE);
+  pread(fd, &marker, PAMU_T_MARKER_SIZE, a0 - PAMU_T_MARKER_SIZE);
+  ASSERT("a0 marker is written back", tntoh(marker) == 64);
+  memset(buf, 0, sizeof(buf));
+  pread(fd, buf, sizeof(buf), a0);
+  ASSERT("a0 blob is intact", (buf[0] == 'x') && (buf[63] == 'x'));
+
+  // Spread blocks over more pages than the cache holds
+  for(i=0; i<32; i++) a[i] = pamu_alloc(fd, 1000);
+  for(i=0; i<32; i+=2) pamu_free(fd, a[i]);
+  ASSERT("Cache disabled without errors", pamu_cache(fd, 0) == 0);
+  current = pamu_next(fd, a0);
+  for(i=1; i<32; i+=2) {
+    ASSERT("evicted: next == a[i]", current == a[i]);
+    current = pamu_next(fd, current);
+  }
+  ASSERT("evicted: iteration ends", current == 0);
+
+  // Journaled, the links of a grown blob straddle a page & are kept in the
+  // journal, the data after them must still read back
+  ftruncate(fd, 0);
+  rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC | PAMU_JOURNAL);
+  ASSERT("Medium initialized without errors", rc == 0);
+  ASSERT("Cache enabled without errors", pamu_cache(fd, 4) == 0);
+  a0 = pamu_alloc(fd, 64);
+  a1 = pamu_alloc(fd, 4096 + ((4096 - ((a0 + 64 + (4 * PAMU_T_MARKER_SIZE) + PAMU_T_POINTER_SIZE) % 4096)) % 4096));
+  current = pamu_alloc(fd, sizeof(buf));
+  ASSERT("Links straddle a page", (current + PAMU_T_POINTER_SIZE) % 4096 == 0);
+  memset(buf, 'z', sizeof(buf));
+  ASSERT("Blob written without errors", pamu_write(fd, current, buf, sizeof(buf)) == 0);
+  memset(buf, 0, sizeof(buf));
+  pamu_read(fd, current, buf, sizeof(buf));
+  ASSERT("Blob reads back", (buf[0] == 'z') && (buf[2 * PAMU_T_POINTER_SIZE] == 'z') && (buf[63] == 'z'));
+
+  // Remove the temporary file
+  pamu_close(fd);
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+}
+
+void test_lazy() {
+  PAMU_T_POINTER current;
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  // Emulate a block device, leaving 96 bytes free after 6 blobs of 64
+  size_t mediumSize = 8 + (7 * (64 + (2 * PAMU_T_MARKER_SIZE))) + 32;
+  char *buf = calloc(1, mediumSize);
+  write(fd, buf, mediumSize);
+  free(buf);
+
+  // Basic initialize
+  int rc = pamu_init(fd, PAMU_DEFAULT | PAMU_LAZY);
+  ASSERT("Medium initialized without errors", rc == 0);
+
+  PAMU_T_POINTER a0 = pamu_alloc(fd, 64);
+  PAMU_T_POINTER a1 = pamu_alloc(fd, 64);
+  PAMU_T_POINTER a2 = pamu_alloc(fd, 64);
+  PAMU_T_POINTER a3 = pamu_alloc(fd, 64);
+  PAMU_T_POINTER a4 = pamu_alloc(fd, 64);
+
+  // Freed blocks are skipped, but not reused yet
+  ASSERT("free(a1) without errors", pamu_free(fd, a1) == 0);
+  ASSERT("free(a2) without errors", pamu_free(fd, a2) == 0);
+  ASSERT("free(a1) again is a double free", pamu_free(fd, a1) == PAMU_ERR_DOUBLE_FREE);
+  ASSERT("next(a0) == a3", pamu_next(fd, a0) == a3);
+  ASSERT("alloc(64) does not reuse a1", pamu_alloc(fd, 64) > a4);
+
+  // Coalesce within a budget
+  ASSERT("maintain(1) leaves 1 pending", pamu_maintain(fd, 1) == 1);
+  ASSERT("maintain(0) leaves 0 pending", pamu_maintain(fd, 0) == 0);
+  ASSERT("alloc(64) reuses a1", pamu_alloc(fd, 64) == a1);
+
+  // Running out of space coalesces as well
+  ASSERT("free(a3) without errors", pamu_free(fd, a3) == 0);
+  ASSERT("alloc(160) uses the a2+a3 hole", pamu_alloc(fd, 64 + 64 + (2 * PAMU_T_MARKER_SIZE)) == a2);
+
+  // Another handle finds pending blocks by scanning
+  ASSERT("free(a4) without errors", pamu_free(fd, a4) == 0);
+  int fd2 = open(tempfile, O_RDWR);
+  ASSERT("fd2: next(a1) == a2", (current = pamu_next(fd2, a1)) == a2);
+  ASSERT("fd2: next(a2) != a4", pamu_next(fd2, current) != a4);
+  ASSERT("fd2: maintain(0) leaves 0 pending", pamu_maintain(fd2, 0) == 0);
+  ASSERT("fd2: alloc(64) reuses a4", pamu_alloc(fd2, 64) == a4);
+
+  // Remove the temporary file
+  pamu_close(fd2);
+  pamu_close(fd);
+  close(fd2);
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+}
+
+void test_roots() {
+  int i;
+  char name[PAMU_ROOT_NAME_LEN + 2];
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  // Basic initialize
+  int rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC | PAMU_JOURNAL | PAMU_ROOTS);
+  ASSERT("Medium initialized without errors", rc == 0);
+
+  PAMU_T_POINTER a0 = pamu_alloc(fd, 64);
+  PAMU_T_POINTER a1 = pamu_alloc(fd, 64);
+  ASSERT("set(index) without errors", pamu_root_set(fd, "index", a0) == 0);
+  ASSERT("set(meta) without errors" , pamu_root_set(fd, "meta" , a1) == 0);
+  ASSERT("get(index) == a0"         , pamu_root_get(fd, "index") == a0);
+  ASSERT("get(meta)  == a1"         , pamu_root_get(fd, "meta" ) == a1);
+  ASSERT("get(other) == 0"          , pamu_root_get(fd, "other") == 0);
+  ASSERT("Empty names are refused"  , pamu_root_set(fd, "", a0) == PAMU_ERR_INVALID_NAME);
+  memset(name, 'x', PAMU_ROOT_NAME_LEN + 1);
+  name[PAMU_ROOT_NAME_LEN + 1] = 0;
+  ASSERT("Long names are refused"   , pamu_root_set(fd, name, a0) == PAMU_ERR_INVALID_NAME);
+
+  // Survives re-opening
+  ASSERT("Flush without errors", pamu_flush(fd) == 0);
+  int fd2 = open(tempfile, O_RDWR);
+  ASSERT("fd2: get(index) == a0", pamu_root_get(fd2, "index") == a0);
+  pamu_close(fd2);
+  close(fd2);
+
+  // Overwrite & delete
+  ASSERT("set(index) again without errors", pamu_root_set(fd, "index", a1) == 0);
+  ASSERT("get(index) == a1"               , pamu_root_get(fd, "index") == a1);
+  ASSERT("del(index) without errors"      , pamu_root_del(fd, "index") == 0);
+  ASSERT("get(index) == 0"                , pamu_root_get(fd, "index") == 0);
+  ASSERT("get(meta)  == a1"               , pamu_root_get(fd, "meta" ) == a1);
+
+  // Fill the table, then delete half of it
+  pamu_root_del(fd, "meta");
+  for(i=0; i<PAMU_ROOT_SLOTS; i++) {
+    sprintf(name, "root-%d", i);
+    pamu_root_set(fd, name, 100 + i);
+  }
+  ASSERT("Full table is reported", pamu_root_set(fd, "one-more", a0) == PAMU_ERR_ROOT_FULL);
+  for(i=0; i<PAMU_ROOT_SLOTS; i+=2) {
+    sprintf(name, "root-%d", i);
+    pamu_root_del(fd, name);
+  }
+  for(i=0; i<PAMU_ROOT_SLOTS; i++) {
+    sprintf(name, "root-%d", i);
+    ASSERT("Remaining roots are found", pamu_root_get(fd, name) == ((i % 2) ? (100 + i) : 0));
+  }
+
+  // Remove the temporary file
+  pamu_close(fd);
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+}
+
+struct bulk_source {
+  int            count;
+  int            limit;
+  PAMU_T_POINTER pointers[64];
+  char           data[64];
+};
+
+PAMU_T_MARKER bulk_next(void *udata, PAMU_T_POINTER addr, const void **data) {
+  struct bulk_source *source = udata;
+  if (source->count == source->limit) return 0;
+  source->pointers[source->count] = addr;
+  memset(source->data, 'a' + (source->count % 26), sizeof(source->data));
+  *data = source->data;
+  return 16 + (source->count++ % 48);
+}
+
+// Hands out a blob larger than the load buffer, then fails
+PAMU_T_MARKER bulk_fail_next(void *udata, PAMU_T_POINTER addr, const void **data) {
+  static char large[1600000];
+  int *calls = udata;
+  if ((*calls)++) return PAMU_ERR_READ_MALFORMED;
+  memset(large, 'X', sizeof(large));
+  *data = large;
+  return sizeof(large);
+}
+
+void test_bulk_load() {
+  int i;
+  char buf[64];
+  PAMU_T_POINTER current;
+  struct bulk_source source;
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  // Dynamic & journaled
+  int rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC | PAMU_JOURNAL);
+  ASSERT("Medium initialized without errors", rc == 0);
+  source.count = 0;
+  source.limit = 64;
+  ASSERT("Loaded 64 blobs", pamu_bulk_load(fd, bulk_next, &source) == 64);
+  current = 0;
+  for(i=0; i<64; i++) {
+    current = pamu_next(fd, current);
+    ASSERT("next == loaded pointer", current == source.pointers[i]);
+    ASSERT("size == loaded size"   , pamu_size(fd, current) == 16 + (i % 48));
+    pamu_read(fd, current, buf, 16);
+    ASSERT("data == loaded data"   , (buf[0] == 'a' + (i % 26)) && (buf[15] == 'a' + (i % 26)));
+  }
+  ASSERT("iteration ends", pamu_next(fd, current) == 0);
+  ASSERT("No tail free block", lseek(fd, 0, SEEK_END) == current + pamu_size(fd, current) + PAMU_T_MARKER_SIZE);
+  ASSERT("Loaded medium is not empty", pamu_bulk_load(fd, bulk_next, &source) == PAMU_ERR_NOT_SUPPORTED);
+  pamu_free(fd, source.pointers[1]);
+  ASSERT("alloc reuses a freed blob", pamu_alloc(fd, 16) == source.pointers[1]);
+  pamu_close(fd);
+
+  // Static, ending with a tail free block
+  ftruncate(fd, 0);
+  lseek(fd, 0, SEEK_SET);
+  char *zero = calloc(1, 2048);
+  write(fd, zero, 2048);
+  free(zero);
+  rc = pamu_init(fd, PAMU_DEFAULT);
+  ASSERT("Medium initialized without errors", rc == 0);
+  source.count = 0;
+  source.limit = 64;
+  ASSERT("Overflowing load is refused", pamu_bulk_load(fd, bulk_next, &source) == PAMU_ERR_MEDIUM_FULL);
+  ASSERT("Refused load leaves the medium empty", pamu_next(fd, 0) == 0);
+  source.count = 0;
+  source.limit = 8;
+  ASSERT("Loaded 8 blobs", pamu_bulk_load(fd, bulk_next, &source) == 8);
+  ASSERT("next(0) == first loaded", pamu_next(fd, 0) == source.pointers[0]);
+  PAMU_T_POINTER tail = source.pointers[7] + pamu_size(fd, source.pointers[7]) + (2 * PAMU_T_MARKER_SIZE);
+  ASSERT("alloc uses the tail free block", pamu_alloc(fd, 64) == tail);
+
+  // A failed load leaves the free block's links alone, even when streamed
+  ftruncate(fd, 0);
+  lseek(fd, 0, SEEK_SET);
+  zero = calloc(1, 4*1024*1024);
+  write(fd, zero, 4*1024*1024);
+  rc = pamu_init(fd, PAMU_DEFAULT);
+  ASSERT("Medium initialized without errors", rc == 0);
+  i = 0;
+  ASSERT("Failing load is refused", pamu_bulk_load(fd, bulk_fail_next, &i) == PAMU_ERR_READ_MALFORMED);
+  ASSERT("Failed load leaves the medium empty", pamu_next(fd, 0) == 0);
+  current = pamu_alloc(fd, 64);
+  ASSERT("alloc uses the free block", current > 0);
+  pread(fd, zero, 2 * PAMU_T_POINTER_SIZE, current + 64 + (2 * PAMU_T_MARKER_SIZE));
+  ASSERT("Split free block has no previous", !memcmp(zero, zero + 64, PAMU_T_POINTER_SIZE));
+  ASSERT("Split free block has no next"    , !memcmp(zero + PAMU_T_POINTER_SIZE, zero + 64, PAMU_T_POINTER_SIZE));
+  ASSERT("alloc uses the remainder", pamu_alloc(fd, 3*1024*1024) > current);
+  free(zero);
+
+  // Remove the temporary file
+  pamu_close(fd);
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+}
+
+void test_punch() {
+  struct stat st;
+  blkcnt_t before;
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  // Emulate a block device with fixed size, fully allocated on disk
+  char *buf = calloc(1, 1024*1024);
+  write(fd, buf, 1024*1024);
+  fdatasync(fd);
+
+  // Basic initialize
+  int rc = pamu_init(fd, PAMU_DEFAULT);
+  ASSERT("Medium initialized without errors", rc == 0);
+  ASSERT("Punching enabled without errors", pamu_punch(fd, 65536) == 0);
+
+  PAMU_T_POINTER a0 = pamu_alloc(fd, 64);
+  PAMU_T_POINTER a1 = pamu_alloc(fd, 256*1024);
+  PAMU_T_POINTER a2 = pamu_alloc(fd, 64);
+  memset(buf, 'x', 256*1024);
+  pamu_write(fd, a1, buf, 256*1024);
+  fdatasync(fd);
+
+  // Large free blocks release their interior
+  fstat(fd, &st);
+  before = st.st_blocks;
+  ASSERT("free(a1) without errors", pamu_free(fd, a1) == 0);
+  fstat(fd, &st);
+  ASSERT("Freed interior is released", st.st_blocks <= before - 400);
+  ASSERT("next(a0) == a2", pamu_next(fd, a0) == a2);
+  ASSERT("alloc reuses the punched block", pamu_alloc(fd, 128*1024) == a1);
+  ASSERT("a1.size == 128K", pamu_size(fd, a1) == 128*1024);
+  pamu_close(fd);
+
+  // Journaled media release it once the free is committed
+  ftruncate(fd, 0);
+  rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC | PAMU_JOURNAL);
+  ASSERT("Medium initialized without errors", rc == 0);
+  ASSERT("Punching enabled without errors", pamu_punch(fd, 65536) == 0);
+  a0 = pamu_alloc(fd, 64);
+  a1 = pamu_alloc(fd, 256*1024);
+  a2 = pamu_alloc(fd, 64);
+  pamu_flush(fd);
+  pamu_write(fd, a1, buf, 256*1024);
+  fdatasync(fd);
+  fstat(fd, &st);
+  before = st.st_blocks;
+  ASSERT("free(a1) without errors", pamu_free(fd, a1) == 0);
+  fstat(fd, &st);
+  ASSERT("Uncommitted free keeps the interior", st.st_blocks >= before);
+  ASSERT("Flush without errors", pamu_flush(fd) == 0);
+  fstat(fd, &st);
+  ASSERT("Committed free releases the interior", st.st_blocks <= before - 400);
+  ASSERT("next(a0) == a2", pamu_next(fd, a0) == a2);
+
+  // Remove the temporary file
+  free(buf);
+  pamu_close(fd);
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+}
+
+void test_export_import() {
+  int i;
+  char buf[8192];
+  PAMU_T_POINTER current;
+  PAMU_T_POINTER blobs[16];
+
+  // Open tmp files, the medium, the stream & the imported medium
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+  char * streamfile = strdup(tempfile);
+  strcpy(streamfile + strlen(streamfile) - 6, "XXXXXX");
+  int sfd = mkstemp(streamfile);
+  char * importfile = strdup(tempfile);
+  strcpy(importfile + strlen(importfile) - 6, "XXXXXX");
+  int ifd = mkstemp(importfile);
+
+  // Fragmented source, with one blob large enough to be copied directly
+  int rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC | PAMU_JOURNAL);
+  ASSERT("Medium initialized without errors", rc == 0);
+  for(i=0; i<16; i++) {
+    blobs[i] = pamu_alloc(fd, i == 5 ? 8192 : 32 + i);
+    memset(buf, 'a' + i, 8192);
+    pamu_write(fd, blobs[i], buf, pamu_size(fd, blobs[i]));
+  }
+  for(i=0; i<16; i+=3) pamu_free(fd, blobs[i]);
+  ASSERT("Exported 10 blobs", pamu_export(fd, sfd) == 10);
+
+  // Dense import packs the blobs in their original order
+  rc = pamu_init(ifd, PAMU_DEFAULT | PAMU_DYNAMIC);
+  ASSERT("Medium initialized without errors", rc == 0);
+  lseek(sfd, 0, SEEK_SET);
+  ASSERT("Imported 10 blobs", pamu_import(ifd, sfd, 0) == 10);
+  current = 0;
+  for(i=0; i<16; i++) {
+    if (!(i % 3)) continue;
+    current = pamu_next(ifd, current);
+    ASSERT("size == exported size", pamu_size(ifd, current) == pamu_size(fd, blobs[i]));
+    pamu_read(ifd, current, buf, pamu_size(ifd, current));
+    ASSERT("data == exported data", (buf[0] == 'a' + i) && (buf[pamu_size(ifd, current) - 1] == 'a' + i));
+  }
+  ASSERT("iteration ends", pamu_next(ifd, current) == 0);
+  ASSERT("Dense import has no gaps", lseek(ifd, 0, SEEK_END) == current + pamu_size(ifd, current) + PAMU_T_MARKER_SIZE);
+  pamu_close(ifd);
+
+  // Keeping addresses turns the gaps into free blocks
+  ftruncate(ifd, 0);
+  rc = pamu_init(ifd, PAMU_DEFAULT | PAMU_DYNAMIC | PAMU_JOURNAL);
+  ASSERT("Medium initialized without errors", rc == 0);
+  lseek(sfd, 0, SEEK_SET);
+  ASSERT("Imported 10 blobs", pamu_import(ifd, sfd, 1) == 10);
+  current = 0;
+  for(i=0; i<16; i++) {
+    if (!(i % 3)) continue;
+    current = pamu_next(ifd, current);
+    ASSERT("next == original pointer", current == blobs[i]);
+    pamu_read(ifd, current, buf, 32);
+    ASSERT("data == exported data", (buf[0] == 'a' + i) && (buf[31] == 'a' + i));
+  }
+  ASSERT("iteration ends", pamu_next(ifd, current) == 0);
+  ASSERT("alloc reuses a gap", pamu_alloc(ifd, 32) == blobs[0]);
+  ASSERT("Non-empty medium is refused", pamu_import(ifd, sfd, 1) == PAMU_ERR_READ_MALFORMED);
+  lseek(sfd, 0, SEEK_SET);
+  ASSERT("Non-empty medium is refused", pamu_import(ifd, sfd, 1) == PAMU_ERR_NOT_SUPPORTED);
+
+  // Payloads only load into a medium framing them the same way
+  pamu_close(ifd);
+  ftruncate(ifd, 0);
+  pamu_init(ifd, PAMU_DEFAULT | PAMU_DYNAMIC | PAMU_COMPRESS);
+  lseek(sfd, 0, SEEK_SET);
+  ASSERT("Plain stream into a compressed medium is refused", pamu_import(ifd, sfd, 0) == PAMU_ERR_NOT_SUPPORTED);
+  ftruncate(sfd, 0);
+  lseek(sfd, 0, SEEK_SET);
+  ASSERT("Exported 10 blobs", pamu_export(fd, sfd) == 10);
+  pamu_close(fd);
+  ftruncate(fd, 0);
+  pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC | PAMU_COMPRESS);
+  current = pamu_alloc(fd, 4096);
+  memset(buf, 'q', 4096);
+  pamu_write(fd, current, buf, 4096);
+  ftruncate(sfd, 0);
+  lseek(sfd, 0, SEEK_SET);
+  ASSERT("Exported 1 compressed blob", pamu_export(fd, sfd) == 1);
+  lseek(sfd, 0, SEEK_SET);
+  ASSERT("Imported 1 compressed blob", pamu_import(ifd, sfd, 0) == 1);
+  memset(buf, 0, 4096);
+  ASSERT("Compressed blob reads back", pamu_read(ifd, pamu_next(ifd, 0), buf, 4096) == 0);
+  ASSERT("data == exported data", (buf[0] == 'q') && (buf[4095] == 'q'));
+  pamu_close(ifd);
+  ftruncate(ifd, 0);
+  pamu_init(ifd, PAMU_DEFAULT | PAMU_DYNAMIC);
+  lseek(sfd, 0, SEEK_SET);
+  ASSERT("Compressed stream into a plain medium is refused", pamu_import(ifd, sfd, 0) == PAMU_ERR_NOT_SUPPORTED);
+
+  // Remove the temporary files
+  pamu_close(fd);
+  pamu_close(ifd);
+  close(fd);
+  close(sfd);
+  close(ifd);
+  unlink(tempfile);
+  unlink(streamfile);
+  unlink(importfile);
+  free(tempfile);
+  free(streamfile);
+  free(importfile);
+}
+
+struct reader_job {
+  int             fd;
+  PAMU_T_POINTER *stable;
+  int             stableCount;
+  atomic_int     *stop;
+  int             walks;
+  int             errors;
+};
+
+// Walks the medium over & over, every stable blob must show up intact
+void * reader_thread(void *udata) {
+  struct reader_job *job = udata;
+  PAMU_T_POINTER current, previous, value;
+  int found, reader;
+  while(!atomic_load(job->stop)) {
+    reader = pamu_reader_enter(job->fd);
+    if (reader < 0) continue;
+    current  = 0;
+    previous = 0;
+    found    = 0;
+    while((current = pamu_reader_next(job->fd, reader, current)) > 0) {
+      if (current <= previous) job->errors++;
+      previous = current;
+      if ((found < job->stableCount) && (current == job->stable[found])) {
+        pamu_reader_read(job->fd, reader, current, &value, sizeof(value));
+        if (value != current) job->errors++;
+        found++;
+      }
+    }
+    if (current < 0) job->errors++;
+    if (found != job->stableCount) job->errors++;
+    pamu_reader_leave(job->fd, reader);
+    job->walks++;
+  }
+  return NULL;
+}
+
+void test_readers() {
+  int i;
+  PAMU_T_POINTER churn[64];
+  PAMU_T_POINTER stable[32];
+  struct reader_job jobs[4];
+  pthread_t threads[4];
+  atomic_int stop = 0;
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  int rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC);
+  ASSERT("Medium initialized without errors", rc == 0);
+  ASSERT("Readers need a lazy medium", pamu_readers(fd, 4) == PAMU_ERR_NOT_SUPPORTED);
+  ftruncate(fd, 0);
+  rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC | PAMU_LAZY);
+  ASSERT("Medium initialized without errors", rc == 0);
+  ASSERT("Readers enabled without errors", pamu_readers(fd, 4) == 0);
+
+  // Stable blobs hold their own pointer, churn in between
+  for(i=0; i<32; i++) {
+    churn[i]  = pamu_alloc(fd, 40);
+    stable[i] = pamu_alloc(fd, 24);
+    pamu_write(fd, stable[i], &stable[i], sizeof(PAMU_T_POINTER));
+  }
+
+  // Old readers hold back coalescing of what they may have seen
+  int r0 = pamu_reader_enter(fd);
+  int r1 = pamu_reader_enter(fd);
+  ASSERT("reader slots are handed out", (r0 >= 0) && (r1 >= 0) && (r0 != r1));
+  ASSERT("next(0) == churn[0]", pamu_reader_next(fd, r0, 0) == churn[0]);
+  ASSERT("free(churn[0]) without errors", pamu_free(fd, churn[0]) == 0);
+  ASSERT("freed blob is skipped", pamu_reader_next(fd, r1, 0) == stable[0]);
+  ASSERT("pinned readers block coalescing", pamu_maintain(fd, 0) == 1);
+  ASSERT("leave without errors", pamu_reader_leave(fd, r0) == 0);
+  ASSERT("leave twice is refused", pamu_reader_leave(fd, r0) == PAMU_ERR_READER);
+  ASSERT("next on a left slot is refused", pamu_reader_next(fd, r0, 0) == PAMU_ERR_READER);
+  ASSERT("pinned readers block coalescing", pamu_maintain(fd, 0) == 1);
+  ASSERT("leave without errors", pamu_reader_leave(fd, r1) == 0);
+  ASSERT("coalesced once readers left", pamu_maintain(fd, 0) == 0);
+  ASSERT("cache is refused", pamu_cache(fd, 4) == PAMU_ERR_NOT_SUPPORTED);
+
+  // A writer churning blocks next to concurrent readers
+  for(i=0; i<4; i++) {
+    jobs[i].fd          = fd;
+    jobs[i].stable      = stable;
+    jobs[i].stableCount = 32;
+    jobs[i].stop        = &stop;
+    jobs[i].walks       = 0;
+    jobs[i].errors      = 0;
+    pthread_create(&threads[i], NULL, reader_thread, &jobs[i]);
+  }
+  churn[0] = pamu_alloc(fd, 40);
+  for(i=0; i<4000; i++) {
+    pamu_free(fd, churn[i % 32]);
+    churn[i % 32] = pamu_alloc(fd, 8 + ((i * 7) % 120));
+    if (!(i % 50)) pamu_maintain(fd, 0);
+  }
+  for(i=0; i<32; i++) pamu_free(fd, churn[i]);
+  pamu_maintain(fd, 0);
+  atomic_store(&stop, 1);
+  for(i=0; i<4; i++) {
+    pthread_join(threads[i], NULL);
+    ASSERT("reader walked the medium", jobs[i].walks > 0);
+    ASSERT("reader saw a consistent medium", jobs[i].errors == 0);
+  }
+  ASSERT("stable blobs are intact", pamu_next(fd, 0) == stable[0]);
+
+  // Remove the temporary file
+  pamu_close(fd);
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+}
+
+void test_snapshot() {
+  int i;
+  char buf[64];
+  PAMU_T_POINTER blobs[8];
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+  char * snapfile = calloc(1,strlen(tempfile)+6);
+  strcat(snapfile, tempfile);
+  strcat(snapfile, ".snap");
+
+  // Journaled & cached, so pending changes must land before cloning
+  int rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC | PAMU_JOURNAL);
+  ASSERT("Medium initialized without errors", rc == 0);
+  pamu_cache(fd, 4);
+  for(i=0; i<8; i++) {
+    blobs[i] = pamu_alloc(fd, 64);
+    memset(buf, 'a' + i, 64);
+    pamu_write(fd, blobs[i], buf, 64);
+  }
+  pamu_free(fd, blobs[3]);
+  ASSERT("Snapshot without errors", pamu_snapshot(fd, snapfile) == 0);
+
+  // Changes after the snapshot don't show up in it
+  pamu_free(fd, blobs[7]);
+  memset(buf, 'z', 64);
+  pamu_write(fd, blobs[0], buf, 64);
+  pamu_flush(fd);
+
+  int sfd = open(snapfile, O_RDWR);
+  ASSERT("Snapshot opens", sfd >= 0);
+  PAMU_T_POINTER current = 0;
+  for(i=0; i<8; i++) {
+    if (i == 3) continue;
+    current = pamu_next(sfd, current);
+    ASSERT("next == blob at snapshot time", current == blobs[i]);
+    pamu_read(sfd, current, buf, 64);
+    ASSERT("data == data at snapshot time", (buf[0] == 'a' + i) && (buf[63] == 'a' + i));
+  }
+  ASSERT("iteration ends", pamu_next(sfd, current) == 0);
+  ASSERT("Snapshot is a usable medium", pamu_alloc(sfd, 64) == blobs[3]);
+  ASSERT("Snapshot within a transaction is refused", (pamu_txn_begin(fd) == 0) && (pamu_snapshot(fd, snapfile) == PAMU_ERR_TXN));
+  pamu_txn_abort(fd);
+
+  // Remove the temporary files
+  pamu_close(sfd);
+  pamu_close(fd);
+  close(sfd);
+  close(fd);
+  unlink(snapfile);
+  unlink(tempfile);
+  free(snapfile);
+  free(tempfile);
+}
+
+// Whether two files hold the same bytes
+int files_equal(int a, int b) {
+  char x[4096], y[4096];
+  off_t size = lseek(a, 0, SEEK_END);
+  if (size != lseek(b, 0, SEEK_END)) return 0;
+  off_t off;
+  ssize_t n;
+  for(off = 0; off < size; off += n) {
+    n = pread(a, x, sizeof(x), off);
+    if ((n <= 0) || (pread(b, y, n, off) != n) || memcmp(x, y, n)) return 0;
+  }
+  return 1;
+}
+
+void test_replicate() {
+  int i, round, ok = 1;
+  char buf[512];
+  PAMU_T_POINTER blobs[64] = {0};
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+  char * replicafile = calloc(1,strlen(tempfile)+9);
+  strcat(replicafile, tempfile);
+  strcat(replicafile, ".replica");
+
+  // Untracked media have no changes to hand out
+  int rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC | PAMU_JOURNAL);
+  ASSERT("Medium initialized without errors", rc == 0);
+  pamu_cache(fd, 4);
+  ASSERT("Changes without a checkpoint are refused", pamu_replicate(fd, fd, 1) == PAMU_ERR_NOT_SUPPORTED);
+
+  // Seed the replica with a full copy taken at the checkpoint
+  int64_t checkpoint = pamu_checkpoint(fd);
+  ASSERT("Checkpoint without errors", checkpoint > 0);
+  ASSERT("Initial copy without errors", pamu_snapshot(fd, replicafile) == 0);
+  int rfd = open(replicafile, O_RDWR);
+
+  // Random churn, growing & truncating the medium, shipped every round
+  srand(38);
+  for(round = 0; round < 20; round++) {
+    for(i = 0; i < 32; i++) {
+      int k = rand() % 64;
+      if (blobs[k]) {
+        pamu_free(fd, blobs[k]);
+        blobs[k] = 0;
+        continue;
+      }
+      size_t len = 1 + rand() % sizeof(buf);
+      blobs[k] = pamu_alloc(fd, len);
+      memset(buf, 'a' + (rand() % 26), len);
+      pamu_write(fd, blobs[k], buf, len);
+    }
+    checkpoint = pamu_replicate(fd, rfd, checkpoint);
+    ok = ok && (checkpoint > 0) && files_equal(fd, rfd);
+  }
+  ASSERT("Replica stays byte-identical through churn", ok);
+
+  // Older checkpoints have been forgotten
+  ASSERT("Forgotten checkpoint is refused", pamu_replicate(fd, rfd, checkpoint - 2) == PAMU_ERR_NOT_SUPPORTED);
+  ASSERT("Replicating within a transaction is refused", (pamu_txn_begin(fd) == 0) && (pamu_replicate(fd, rfd, checkpoint) == PAMU_ERR_TXN));
+  pamu_txn_abort(fd);
+
+  // The replica opens as the same medium
+  PAMU_T_POINTER a = 0, b = 0;
+  do {
+    a = pamu_next(fd, a);
+    b = pamu_next(rfd, b);
+    ok = ok && (a == b);
+  } while(a > 0);
+  ASSERT("Replica iterates like the medium", ok);
+
+  // Remove the temporary files
+  pamu_close(rfd);
+  pamu_close(fd);
+  close(rfd);
+  close(fd);
+  unlink(replicafile);
+  unlink(tempfile);
+  free(replicafile);
+  free(tempfile);
+}
+
+void test_compress() {
+  int i, ok = 1;
+  char json[4096], back[4096], noise[512], line[33];
+  for(i = 0; i < (int)sizeof(json); i += 32) {
+    snprintf(line, sizeof(line), "{\"id\":%08d,\"kind\":\"blob\"}   ", i);
+    memcpy(json + i, line, 32);
+  }
+  for(i = 0; i < (int)sizeof(noise); i++) noise[i] = rand();
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  // Plain media store raw bytes only
+  int rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC);
+  ASSERT("Medium initialized without errors", rc == 0);
+  ASSERT("Put on a plain medium is refused", pamu_put(fd, json, sizeof(json)) == PAMU_ERR_NOT_SUPPORTED);
+
+  rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC | PAMU_JOURNAL | PAMU_COMPRESS);
+  ASSERT("Compressed medium initialized without errors", rc == 0);
+  off_t empty = lseek(fd, 0, SEEK_END);
+
+  // Compressible data only takes the space it compresses to
+  PAMU_T_POINTER packed = pamu_put(fd, json, sizeof(json));
+  ASSERT("Put without errors", packed > 0);
+  pamu_flush(fd);
+  ASSERT("Footprint is smaller than the data", lseek(fd, 0, SEEK_END) - empty < (off_t)sizeof(json) / 2);
+  ASSERT("Size is the logical size", pamu_size(fd, packed) == sizeof(json));
+  ASSERT("Read decompresses", (pamu_read(fd, packed, back, sizeof(json)) == 0) && !memcmp(back, json, sizeof(json)));
+  memset(back, 0, sizeof(back));
+  ASSERT("Partial read decompresses", (pamu_read(fd, packed, back, 100) == 0) && !memcmp(back, json, 100) && !back[100]);
+  ASSERT("Read past the logical size is refused", pamu_read(fd, packed, back, sizeof(json) + 1) == PAMU_ERR_OUT_OF_BOUNDS);
+
+  // Incompressible data is stored as-is
+  PAMU_T_POINTER raw = pamu_put(fd, noise, sizeof(noise));
+  ASSERT("Raw size is the logical size", pamu_size(fd, raw) == sizeof(noise));
+  ASSERT("Raw read", (pamu_read(fd, raw, back, sizeof(noise)) == 0) && !memcmp(back, noise, sizeof(noise)));
+
+  // Allocated blobs are rewritten whole, as long as the result fits
+  PAMU_T_POINTER blob = pamu_alloc(fd, 256);
+  ASSERT("Allocated size is the requested size", pamu_size(fd, blob) == 256);
+  ASSERT("Larger compressible write fits", pamu_write(fd, blob, json, 1024) == 0);
+  ASSERT("Size follows the write", pamu_size(fd, blob) == 1024);
+  ASSERT("Read back the write", (pamu_read(fd, blob, back, 1024) == 0) && !memcmp(back, json, 1024));
+  ASSERT("Larger incompressible write is refused", pamu_write(fd, blob, noise, 512) == PAMU_ERR_OUT_OF_BOUNDS);
+  ASSERT("Blob survives a transaction", (pamu_txn_begin(fd) == 0) && (pamu_write(fd, blob, noise, 100) == 0) && (pamu_txn_commit(fd) == 0));
+  ASSERT("Read back the transaction", (pamu_read(fd, blob, back, 100) == 0) && !memcmp(back, noise, 100));
+
+  // Mixed content of every length round-trips
+  for(i = 1; i < 600; i += 7) {
+    memcpy(back, json + (i % 64), i);
+    memcpy(back + (i / 2), noise, i / 4);
+    PAMU_T_POINTER p = pamu_put(fd, back, i);
+    char check[600];
+    ok = ok && (p > 0) && (pamu_size(fd, p) == i) && (pamu_read(fd, p, check, i) == 0) && !memcmp(check, back, i);
+  }
+  ASSERT("Mixed content round-trips", ok);
+
+  // Remove the temporary file
+  pamu_close(fd);
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+}
+
+void test_dedup() {
+  char doc[300], other[300], back[300];
+  memset(doc  , 'd', sizeof(doc));
+  memset(other, 'o', sizeof(other));
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  // Plain media have nothing to share
+  ASSERT("Compressed & deduplicated is refused", pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC | PAMU_COMPRESS | PAMU_DEDUP) == PAMU_ERR_NOT_SUPPORTED);
+  int rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC);
+  ASSERT("Medium initialized without errors", rc == 0);
+  ASSERT("Dedup on a plain medium is refused", pamu_alloc_dedup(fd, doc, sizeof(doc)) == PAMU_ERR_NOT_SUPPORTED);
+
+  rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC | PAMU_JOURNAL | PAMU_DEDUP);
+  ASSERT("Deduplicated medium initialized without errors", rc == 0);
+
+  // Identical content is stored once
+  PAMU_T_POINTER first = pamu_alloc_dedup(fd, doc, sizeof(doc));
+  ASSERT("Dedup alloc without errors", first > 0);
+  pamu_flush(fd);
+  off_t size = lseek(fd, 0, SEEK_END);
+  ASSERT("Same content, same pointer", pamu_alloc_dedup(fd, doc, sizeof(doc)) == first);
+  pamu_flush(fd);
+  ASSERT("Same content takes no space", lseek(fd, 0, SEEK_END) == size);
+  PAMU_T_POINTER second = pamu_alloc_dedup(fd, other, sizeof(other));
+  ASSERT("Other content, other pointer", (second > 0) && (second != first));
+  ASSERT("Size is the logical size", pamu_size(fd, first) == sizeof(doc));
+  ASSERT("Content is stored", (pamu_read(fd, first, back, sizeof(back)) == 0) && !memcmp(back, doc, sizeof(doc)));
+  ASSERT("Writing into shared content is refused", pamu_write(fd, first, other, 10) == PAMU_ERR_NOT_SUPPORTED);
+  ASSERT("Shared content is unchanged", (pamu_read(fd, first, back, sizeof(back)) == 0) && !memcmp(back, doc, sizeof(doc)));
+
+  // Regular blobs live next to shared ones
+  PAMU_T_POINTER plain = pamu_alloc(fd, 100);
+  ASSERT("Regular size is the requested size", pamu_size(fd, plain) == 100);
+  ASSERT("Regular blob is writable", (pamu_write(fd, plain, other, 100) == 0) && (pamu_read(fd, plain, back, 100) == 0) && !memcmp(back, other, 100));
+  ASSERT("Regular blob is freed right away", (pamu_free(fd, plain) == 0) && (pamu_free(fd, plain) < 0));
+
+  // The index is rebuilt from the trailers on another handle
+  pamu_close(fd);
+  int fd2 = open(tempfile, O_RDWR);
+  ASSERT("Reopened handle shares content", pamu_alloc_dedup(fd2, doc, sizeof(doc)) == first);
+
+  // Freed references, content stays until the last one is gone
+  ASSERT("First reference freed", pamu_free(fd2, first) == 0);
+  ASSERT("Second reference freed", pamu_free(fd2, first) == 0);
+  ASSERT("Content still there", (pamu_read(fd2, first, back, sizeof(back)) == 0) && !memcmp(back, doc, sizeof(doc)));
+  ASSERT("Last reference freed", pamu_free(fd2, first) == 0);
+  ASSERT("Block is free after the last one", pamu_free(fd2, first) < 0);
+
+  // Aborted references are forgotten
+  ASSERT("Reference within a transaction", (pamu_txn_begin(fd2) == 0) && (pamu_alloc_dedup(fd2, other, sizeof(other)) == second));
+  pamu_txn_abort(fd2);
+  ASSERT("Single reference left", (pamu_free(fd2, second) == 0) && (pamu_free(fd2, second) < 0));
+  ASSERT("Freed content is stored anew", pamu_alloc_dedup(fd2, other, sizeof(other)) > 0);
+
+  // Remove the temporary file
+  pamu_close(fd2);
+  close(fd2);
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+}
+
+void test_resize() {
+  int i, mode, ok = 1;
+  char buf[64], *zero = calloc(1, 65536);
+  PAMU_T_POINTER blobs[8];
+  uint32_t modes[] = { PAMU_DEFAULT, PAMU_JOURNAL, PAMU_LAZY, PAMU_DEFAULT };
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  // Dynamic media size themselves
+  int rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC);
+  ASSERT("Medium initialized without errors", rc == 0);
+  ASSERT("Resizing a dynamic medium is refused", pamu_resize(fd, 262144) == PAMU_ERR_NOT_SUPPORTED);
+
+  for(mode = 0; mode < 4; mode++) {
+    ftruncate(fd, 0);
+    pwrite(fd, zero, 65536, 0);
+    rc = pamu_init(fd, modes[mode]);
+    ok = ok && (rc == 0);
+    if (mode == 3) pamu_cache(fd, 4);
+    for(i = 0; i < 8; i++) {
+      blobs[i] = pamu_alloc(fd, 64);
+      memset(buf, 'a' + i, 64);
+      pamu_write(fd, blobs[i], buf, 64);
+    }
+    ASSERT("Static medium initialized without errors", ok);
+    ASSERT("Full static medium refuses a large blob", pamu_alloc(fd, 98304) == PAMU_ERR_MEDIUM_FULL);
+
+    // Growing makes room without touching the blobs
+    ASSERT("Grown without errors", pamu_resize(fd, 262144) == 0);
+    pamu_flush(fd);
+    ASSERT("File follows the new size", lseek(fd, 0, SEEK_END) == 262144);
+    PAMU_T_POINTER large = pamu_alloc(fd, 98304);
+    ASSERT("Grown medium fits a large blob", large > 0);
+    pamu_read(fd, blobs[7], buf, 64);
+    ASSERT("Blobs are left in place", (buf[0] == 'h') && (buf[63] == 'h'));
+
+    // Shrinking stops at live data
+    ASSERT("Shrinking over live data is refused", pamu_resize(fd, large) == PAMU_ERR_MEDIUM_FULL);
+    ASSERT("Growing by less than a block is refused", pamu_resize(fd, 262144 + 8) == PAMU_ERR_MEDIUM_SIZE);
+    pamu_free(fd, large);
+    ASSERT("Shrunk without errors", pamu_resize(fd, 65536) == 0);
+    pamu_flush(fd);
+    ASSERT("File follows the smaller size", lseek(fd, 0, SEEK_END) == 65536);
+
+    // Another handle sees the same medium
+    pamu_close(fd);
+    int fd2 = open(tempfile, O_RDWR);
+    PAMU_T_POINTER current = 0;
+    for(i = 0; i < 8; i++) {
+      current = pamu_next(fd2, current);
+      pamu_read(fd2, current, buf, 64);
+      ok = ok && (current == blobs[i]) && (buf[0] == 'a' + i);
+    }
+    ASSERT("Reopened medium holds the blobs", ok && (pamu_next(fd2, current) == 0));
+    ASSERT("Reopened medium is usable", pamu_alloc(fd2, 64) > 0);
+
+    // Space added to the file beforehand is laid out as well
+    ftruncate(fd2, 262144);
+    ASSERT("Extended file grown without errors", pamu_resize(fd2, 262144) == 0);
+    ASSERT("Extended file fits a large blob", pamu_alloc(fd2, 98304) > 0);
+    ASSERT("Extended file commits without errors", pamu_flush(fd2) == 0);
+    pamu_close(fd2);
+    close(fd2);
+  }
+
+  // Remove the temporary file
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+  free(zero);
+}
+
+void test_pool() {
+  int i, ok = 1;
+  char buf[24], *zero = calloc(1, 1024);
+  PAMU_T_POINTER records[4200], current;
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  // Pools leave blob-level features out
+  ASSERT("Pool without record size is refused", pamu_init_pool(fd, PAMU_DYNAMIC, 0) == PAMU_ERR_NEGATIVE_SIZE);
+  ASSERT("Lazy pool is refused", pamu_init_pool(fd, PAMU_DYNAMIC | PAMU_LAZY, 24) == PAMU_ERR_NOT_SUPPORTED);
+  ASSERT("Compressed pool is refused", pamu_init_pool(fd, PAMU_DYNAMIC | PAMU_COMPRESS, 24) == PAMU_ERR_NOT_SUPPORTED);
+
+  // Header, one bitmap & exactly ten records
+  pwrite(fd, zero, 16 + 512 + (10 * 24), 0);
+  int rc = pamu_init_pool(fd, PAMU_DEFAULT, 24);
+  ASSERT("Static pool initialized without errors", rc == 0);
+  for(i = 0; i < 10; i++) {
+    records[i] = pamu_alloc(fd, 24);
+    ok = ok && (records[i] == 16 + 512 + (i * 24));
+    memset(buf, 'a' + i, 24);
+    pamu_write(fd, records[i], buf, 24);
+  }
+  ASSERT("Records are handed out in order", ok);
+  ASSERT("Full pool is reported", pamu_alloc(fd, 24) == PAMU_ERR_MEDIUM_FULL);
+  ASSERT("Oversized record is refused", pamu_alloc(fd, 25) == PAMU_ERR_OUT_OF_BOUNDS);
+  ASSERT("Records have a fixed size", pamu_size(fd, records[4]) == 24);
+
+  // Freed slots are skipped and reused
+  ASSERT("Record freed without errors", pamu_free(fd, records[3]) == 0);
+  ASSERT("Double free is detected", pamu_free(fd, records[3]) == PAMU_ERR_DOUBLE_FREE);
+  ASSERT("Unaligned free is refused", pamu_free(fd, records[4] + 1) == PAMU_ERR_INVALID_ADDRESS);
+  ASSERT("Iteration skips the free slot", pamu_next(fd, records[2]) == records[4]);
+  ASSERT("Lowest free slot is reused", pamu_alloc(fd, 8) == records[3]);
+  pamu_free(fd, records[9]);
+  ASSERT("Iteration ends at the last record", pamu_next(fd, records[8]) == 0);
+  ASSERT("Export of a pool is refused", pamu_export(fd, fd) == PAMU_ERR_NOT_SUPPORTED);
+  ASSERT("Resize of a pool is refused", pamu_resize(fd, 4096) == PAMU_ERR_NOT_SUPPORTED);
+
+  // Dynamic pools grow by the record and span chunks
+  ftruncate(fd, 0);
+  rc = pamu_init_pool(fd, PAMU_DYNAMIC | PAMU_JOURNAL, 24);
+  ASSERT("Dynamic pool initialized without errors", rc == 0);
+  for(i = 0; i < 4200; i++) {
+    records[i] = pamu_alloc(fd, 24);
+    ok = ok && (records[i] > 0);
+    snprintf(buf, sizeof(buf), "%d", i);
+    pamu_write(fd, records[i], buf, sizeof(buf));
+  }
+  ASSERT("Records allocated without errors", ok);
+  pamu_flush(fd);
+  ASSERT("Second chunk follows the first", records[4096] == records[4095] + 24 + 512);
+  ASSERT("Medium ends at the last record", lseek(fd, 0, SEEK_END) == records[4199] + 24);
+  pamu_free(fd, records[4199]);
+  pamu_free(fd, records[4198]);
+
+  // Another handle sees the same records
+  pamu_close(fd);
+  int fd2 = open(tempfile, O_RDWR);
+  current = 0;
+  for(i = 0; i < 4198; i++) {
+    current = pamu_next(fd2, current);
+    pamu_read(fd2, current, buf, sizeof(buf));
+    ok = ok && (current == records[i]) && (atoi(buf) == i);
+  }
+  ASSERT("Reopened pool holds the records", ok && (pamu_next(fd2, current) == 0));
+
+  // Freeing the tail gives the space back
+  for(i = 4197; i >= 0; i--) ok = ok && (pamu_free(fd2, records[i]) == 0);
+  ASSERT("Records freed without errors", ok);
+  pamu_flush(fd2);
+  ASSERT("Empty pool shrinks to its header", lseek(fd2, 0, SEEK_END) == records[0] - 512);
+  pamu_close(fd2);
+  close(fd2);
+
+  // Remove the temporary file
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+  free(zero);
+}
+
+void test_tier() {
+  int i, ok = 1;
+  char buf[1024];
+  PAMU_T_POINTER blobs[6], current;
+
+  // Open tmp files, one per tier
+  char * fastfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(fastfile, tempfolder);
+  strcat(fastfile, "/");
+  strcat(fastfile, temptemplate);
+  char * slowfile = strdup(fastfile);
+  int fd     = mkstemp(fastfile);
+  int slowFd = mkstemp(slowfile);
+
+  int rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC);
+  ASSERT("Fast medium initialized without errors", rc == 0);
+  rc = pamu_init(slowFd, PAMU_DEFAULT | PAMU_DYNAMIC);
+  ASSERT("Slow medium initialized without errors", rc == 0);
+  ASSERT("Tiering onto itself is refused", pamu_tier(fd, fd, 256) == PAMU_ERR_NOT_SUPPORTED);
+  ASSERT("Negative threshold is refused", pamu_tier(fd, slowFd, -1) == PAMU_ERR_NEGATIVE_SIZE);
+  ASSERT("Tier bound without errors", pamu_tier(fd, slowFd, 256) == 0);
+
+  // Blobs are placed by size, the pointer tells where they went
+  for(i = 0; i < 6; i++) {
+    blobs[i] = pamu_alloc(fd, (i % 2) ? 1024 : 64);
+    memset(buf, 'a' + i, 1024);
+    ok = ok && (pamu_write(fd, blobs[i], buf, (i % 2) ? 1024 : 64) == 0);
+    ok = ok && ((!!(blobs[i] & PAMU_TIER_BIT)) == (i % 2));
+  }
+  ASSERT("Blobs placed by size", ok);
+  ASSERT("Large blobs stay off the fast medium", lseek(fd, 0, SEEK_END) < 1024);
+  ASSERT("Size of a slow blob", pamu_size(fd, blobs[1]) == 1024);
+  ASSERT("Slow blob is found on the slow medium", pamu_size(slowFd, blobs[1] & ~PAMU_TIER_BIT) == 1024);
+  pamu_read(fd, blobs[3], buf, 1024);
+  ASSERT("Slow blob reads back", (buf[0] == 'd') && (buf[1023] == 'd'));
+  ASSERT("Slow blob freed without errors", pamu_free(fd, blobs[5]) == 0);
+  ASSERT("Double free on the slow medium is detected", pamu_free(fd, blobs[5]) < 0);
+
+  // Iteration covers the fast medium, then the slow one
+  int order[] = { 0, 2, 4, 1, 3 };
+  current = 0;
+  for(i = 0; i < 5; i++) {
+    current = pamu_next(fd, current);
+    ok = ok && (current == blobs[order[i]]);
+  }
+  ASSERT("Iteration walks both tiers", ok && (pamu_next(fd, current) == 0));
+
+  // Slow tier pointers would dangle in a copy of the fast medium alone
+  char * outfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(outfile, tempfolder);
+  strcat(outfile, "/");
+  strcat(outfile, temptemplate);
+  int outFd = mkstemp(outfile);
+  ASSERT("Snapshot of a tiered medium is refused", pamu_snapshot(fd, outfile) == PAMU_ERR_NOT_SUPPORTED);
+  ASSERT("Export of a tiered medium is refused", pamu_export(fd, outFd) == PAMU_ERR_NOT_SUPPORTED);
+  ASSERT("Checkpoint on a tiered medium", pamu_checkpoint(fd) > 0);
+  ASSERT("Replication of a tiered medium is refused", pamu_replicate(fd, outFd, 1) == PAMU_ERR_NOT_SUPPORTED);
+  close(outFd);
+  unlink(outfile);
+  free(outfile);
+
+  // Binding again after reopening restores the pointers
+  ASSERT("Tiered handle closed without errors", pamu_close(fd) == 0);
+  int fd2 = open(fastfile, O_RDWR);
+  pamu_tier(fd2, slowFd, 256);
+  pamu_read(fd2, blobs[1], buf, 1024);
+  ASSERT("Reopened tier reads back", (buf[0] == 'b') && (buf[1023] == 'b'));
+  pamu_read(fd2, blobs[2], buf, 64);
+  ASSERT("Reopened fast medium reads back", (buf[0] == 'c') && (buf[63] == 'c'));
+  pamu_close(fd2);
+  close(fd2);
+
+  // Remove the temporary files
+  close(fd);
+  close(slowFd);
+  unlink(fastfile);
+  unlink(slowfile);
+  free(fastfile);
+  free(slowfile);
+}
+
+void test_extents() {
+  int i, n, mode, ok;
+  char buf[12000], *zero = calloc(1, 65536);
+  PAMU_T_POINTER blobs[16], large;
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  for(mode = 0; mode < 2; mode++) {
+    ftruncate(fd, 0);
+    if (!mode) pwrite(fd, zero, 65536, 0);
+    int rc = pamu_init(fd, mode ? (PAMU_DYNAMIC | PAMU_JOURNAL) : PAMU_DEFAULT);
+    ASSERT("Medium initialized without errors", rc == 0);
+
+    // Fragment the medium, no free block holds more than 4096 bytes
+    for(n = 0; n < 16; n++) {
+      blobs[n] = pamu_alloc(fd, 4096);
+      if (blobs[n] < 0) break;
+    }
+    for(i = 0; i < n; i += 2) pamu_free(fd, blobs[i]);
+    if (!mode) ASSERT("Contiguous blob doesn't fit", pamu_alloc(fd, 12000) == PAMU_ERR_MEDIUM_FULL);
+    pamu_flush(fd);
+    int64_t before = lseek(fd, 0, SEEK_END);
+
+    // Spread over the free blocks instead
+    large = pamu_alloc_extents(fd, 12000);
+    ASSERT("Large blob allocated without errors", large > 0);
+    ASSERT("Large blob reports it's size", pamu_extents_size(fd, large) == 12000);
+    pamu_flush(fd);
+    if (mode) ASSERT("Free blocks are reused before growing", lseek(fd, 0, SEEK_END) == before);
+    for(i = 0; i < 12000; i++) buf[i] = (char)(i % 251);
+    ok = 1;
+    for(i = 0; i < 12000; i += 1000) ok = ok && (pamu_extents_write(fd, large, i, buf + i, 1000) == 0);
+    ASSERT("Large blob written in pieces", ok);
+    memset(buf, 0, 12000);
+    ASSERT("Range across extents read", pamu_extents_read(fd, large, 4000, buf, 5000) == 0);
+    for(i = 0; i < 5000; i++) ok = ok && (buf[i] == (char)((i + 4000) % 251));
+    ASSERT("Range across extents holds the data", ok);
+    ASSERT("Reading past the end is refused", pamu_extents_read(fd, large, 11000, buf, 2000) == PAMU_ERR_OUT_OF_BOUNDS);
+
+    // Freeing gives all extents back
+    ASSERT("Large blob freed without errors", pamu_free_extents(fd, large) == 0);
+    for(i = 1; i < n; i += 2) pamu_free(fd, blobs[i]);
+    ASSERT("Extents are free again", pamu_next(fd, 0) == 0);
+    if (!mode) ASSERT("Contiguous blob fits again", pamu_alloc(fd, 12000) > 0);
+    if (!mode) ASSERT("Too large a blob doesn't fit in extents", pamu_alloc_extents(fd, 65536) == PAMU_ERR_MEDIUM_FULL);
+    pamu_close(fd);
+  }
+
+  // Remove the temporary file
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+  free(zero);
+}
+
+void test_clean() {
+  int i, ok = 1;
+  int64_t slot;
+  char buf[64];
+  PAMU_T_POINTER blobs[8], shared;
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  ASSERT("Pool with state snapshot is refused", pamu_init_pool(fd, PAMU_DYNAMIC | PAMU_CLEAN, 16) == PAMU_ERR_NOT_SUPPORTED);
+  int rc = pamu_init(fd, PAMU_DYNAMIC | PAMU_LAZY | PAMU_DEDUP | PAMU_CLEAN);
+  ASSERT("Medium initialized without errors", rc == 0);
+  for(i = 0; i < 8; i++) {
+    memset(buf, 'a' + (i % 4), 64);
+    blobs[i] = pamu_alloc_dedup(fd, buf, 64);
+    ok = ok && (blobs[i] > 0);
+  }
+  ASSERT("Blobs stored without errors", ok);
+  blobs[4] = pamu_alloc(fd, 8192);
+  pamu_alloc(fd, 64);
+  pamu_free(fd, blobs[4]);
+  ASSERT("Allocated near a blob", pamu_alloc_near(fd, 64, blobs[0]) > 0);
+
+  // A clean shutdown leaves a snapshot behind
+  ASSERT("Medium closed without errors", pamu_close(fd) == 0);
+  pread(fd, &slot, sizeof(slot), 8);
+  ASSERT("Header points at the snapshot", slot != 0);
+
+  // Which the next open picks up & retires
+  int fd2 = open(tempfile, O_RDWR);
+  memset(buf, 'b', 64);
+  shared = pamu_alloc_dedup(fd2, buf, 64);
+  pread(fd2, &slot, sizeof(slot), 8);
+  ASSERT("Snapshot is retired on open", slot == 0);
+  ASSERT("Dedup table survives the restart", shared == blobs[1]);
+  ASSERT("Free space survives the restart", pamu_alloc_near(fd2, 64, blobs[0]) > 0);
+  pamu_free(fd2, shared);
+
+  // A damaged snapshot falls back to scanning
+  ASSERT("Medium closed again without errors", pamu_close(fd2) == 0);
+  pread(fd2, &slot, sizeof(slot), 8);
+  pwrite(fd2, "XXXX", 4, be64toh(slot));
+  close(fd2);
+  fd2 = open(tempfile, O_RDWR);
+  memset(buf, 'c', 64);
+  ASSERT("Dedup table is rebuilt by a scan", pamu_alloc_dedup(fd2, buf, 64) == blobs[2]);
+
+  // As does one claiming to be larger than the medium
+  ASSERT("Medium closed again without errors", pamu_close(fd2) == 0);
+  slot = htobe64((uint64_t)1 << 62);
+  pwrite(fd2, &slot, sizeof(slot), 16);
+  close(fd2);
+  fd2 = open(tempfile, O_RDWR);
+  memset(buf, 'd', 64);
+  ASSERT("Oversized snapshot is ignored", pamu_alloc_dedup(fd2, buf, 64) == blobs[3]);
+  pread(fd2, &slot, sizeof(slot), 8);
+  ASSERT("Oversized snapshot is retired", slot == 0);
+
+  // Without closing, no snapshot is written
+  close(fd2);
+  fd2 = open(tempfile, O_RDWR);
+  pread(fd2, &slot, sizeof(slot), 8);
+  ASSERT("Unclean shutdown leaves no snapshot", slot == 0);
+  ASSERT("Unclean medium is usable", pamu_alloc(fd2, 64) > 0);
+  pamu_close(fd2);
+  close(fd2);
+
+  // Remove the temporary file
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+}
+
+struct scan_log {
+  int64_t allocated;
+  int64_t free;
+  int64_t pending;
+  int64_t last;
+  int     ordered;
+  int     stop;
+};
+
+int scan_hook(void *udata, const struct pamu_block *block) {
+  struct scan_log *log = udata;
+  if (block->addr <= log->last) log->ordered = 0;
+  log->last = block->addr;
+  if (!block->flags) log->allocated++;
+  if (block->flags & PAMU_BLOCK_FREE) log->free++;
+  if (block->flags & PAMU_BLOCK_PENDING) log->pending++;
+  return (log->stop && (log->allocated == log->stop)) ? 1 : 0;
+}
+
+void test_scan() {
+  int i;
+  char *zero = calloc(1, 65536);
+  PAMU_T_POINTER blobs[8];
+  struct scan_log log;
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  pwrite(fd, zero, 65536, 0);
+  int rc = pamu_init(fd, PAMU_LAZY);
+  ASSERT("Medium initialized without errors", rc == 0);
+  for(i = 0; i < 8; i++) blobs[i] = pamu_alloc(fd, 100);
+  pamu_free(fd, blobs[1]);
+  pamu_free(fd, blobs[5]);
+  pamu_maintain(fd, 1);
+  pamu_flush(fd);
+
+  // Every block in address order, as stored on disk
+  memset(&log, 0, sizeof(log));
+  log.ordered = 1;
+  ASSERT("Scan visits every block", pamu_scan(fd, scan_hook, &log) == 9);
+  ASSERT("Blocks are visited in address order", log.ordered);
+  ASSERT("Allocated blocks are reported", log.allocated == 6);
+  ASSERT("Coalesced free blocks are reported", log.free == 2);
+  ASSERT("Lazily freed blocks are reported", log.pending == 1);
+
+  // The callback ends the scan early
+  memset(&log, 0, sizeof(log));
+  log.stop = 2;
+  ASSERT("Callback stops the scan", pamu_scan(fd, scan_hook, &log) == 1);
+  ASSERT("No blocks after the stop", log.allocated == 2);
+
+  // Damaged markers are caught
+  pwrite(fd, zero, 8, blobs[3] + 100);
+  ASSERT("Mismatching end marker is reported", pamu_scan(fd, NULL, NULL) == PAMU_ERR_READ_MALFORMED);
+  pwrite(fd, "XXXX", 4, 0);
+  ASSERT("Uninitialized medium is reported", pamu_scan(fd, NULL, NULL) == PAMU_ERR_MEDIUM_UNINITIALIZED);
+
+  // Remove the temporary file
+  pamu_close(fd);
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+  free(zero);
+}
+
+#ifdef PAMU_TRACE
+struct trace_log {
+  int     count[11];
+  int64_t walk;
+  int64_t ns;
+};
+
+void trace_hook(const struct pamu_trace_event *event, void *udata) {
+  struct trace_log *log = udata;
+  log->count[event->type]++;
+  if (event->type == PAMU_TRACE_ALLOC_EXIT) log->walk = event->walk;
+  if (event->ns > log->ns) log->ns = event->ns;
+}
+
+void test_trace() {
+  struct trace_log log;
+  memset(&log, 0, sizeof(log));
+
+  // Open tmp file
+  char * tempfile = calloc(1,strlen(temptemplate)+strlen(tempfolder)+2);
+  strcat(tempfile, tempfolder);
+  strcat(tempfile, "/");
+  strcat(tempfile, temptemplate);
+  int fd = mkstemp(tempfile);
+
+  int rc = pamu_init(fd, PAMU_DEFAULT | PAMU_DYNAMIC);
+  ASSERT("Medium initialized without errors", rc == 0);
+  pamu_trace(trace_hook, &log);
+
+  PAMU_T_POINTER a0 = pamu_alloc(fd, 64);
+  PAMU_T_POINTER a1 = pamu_alloc(fd, 64);
+  PAMU_T_POINTER a2 = pamu_alloc(fd, 64);
+  ASSERT("3 alloc entries", log.count[PAMU_TRACE_ALLOC_ENTRY] == 3);
+  ASSERT("3 alloc exits", log.count[PAMU_TRACE_ALLOC_EXIT] == 3);
+  ASSERT("3 growths", log.count[PAMU_TRACE_GROW] == 3);
+
+  pamu_free(fd, a0);
+  pamu_free(fd, a1);
+  ASSERT("2 free entries", log.count[PAMU_TRACE_FREE_ENTRY] == 2);
+  ASSERT("2 free exits", log.count[PAMU_TRACE_FREE_EXIT] == 2);
+  ASSERT("1 merge", log.count[PAMU_TRACE_MERGE] == 1);
+
+  ASSERT("alloc reuses a0", pamu_alloc(fd, 16) == a0);
+  ASSERT("alloc walked the free list", log.walk >= 1);
+  ASSERT("1 split", log.count[PAMU_TRACE_SPLIT] == 1);
+
+  ASSERT("next(a0) == a2", pamu_next(fd, a0) == a2);
+  ASSERT("1 next exit", log.count[PAMU_TRACE_NEXT_EXIT] == 1);
+
+  pamu_free(fd, a2);
+  ASSERT("1 truncation", log.count[PAMU_TRACE_TRUNCATE] == 1);
+  ASSERT("durations are measured", log.ns >= 0);
+
+  // Detach the hook again
+  pamu_trace(NULL, NULL);
+  pamu_alloc(fd, 64);
+  ASSERT("no events once detached", log.count[PAMU_TRACE_ALLOC_EXIT] == 4);
+
+  // Remove the temporary file
+  pamu_close(fd);
+  close(fd);
+  unlink(tempfile);
+  free(tempfile);
+}
+#endif
+
 int main() {
 
   // Update temp folder from fallback
@@ -434,6 +2140,32 @@ int main() {
 
   RUN(test_comfort_size);
   RUN(test_comfort_next);
+  RUN(test_alloc_near);
+
+  RUN(test_journal);
+  RUN(test_journal_static);
+  RUN(test_txn);
+  RUN(test_txn_static);
+  RUN(test_cache);
+  RUN(test_lazy);
+  RUN(test_roots);
+  RUN(test_bulk_load);
+  RUN(test_punch);
+  RUN(test_export_import);
+  RUN(test_readers);
+  RUN(test_snapshot);
+  RUN(test_replicate);
+  RUN(test_compress);
+  RUN(test_dedup);
+  RUN(test_resize);
+  RUN(test_pool);
+  RUN(test_tier);
+  RUN(test_extents);
+  RUN(test_clean);
+  RUN(test_scan);
+#ifdef PAMU_TRACE
+  RUN(test_trace);
+#endif
 
   return TEST_REPORT();
 }
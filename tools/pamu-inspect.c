@@ -0,0 +1,210 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pamu.h"
+
+#define BUCKETS  64 // Power-of-two size classes
+#define SHADES   " .:-=+*#%@"
+
+struct histogram {
+  int64_t count[BUCKETS];
+  int64_t bytes[BUCKETS];
+  int64_t total;
+  int64_t totalBytes;
+};
+
+struct report {
+  int64_t           mediumSize;
+  struct histogram  allocated;
+  struct histogram  free;
+  int64_t           pending;
+  int64_t           pendingBytes;
+  int64_t           listLength;    // Free blocks linked in the free list
+  int64_t           listBackward;  // Links pointing to a lower address
+  int64_t           listJumps;     // Sum of link distances, in bytes
+  int64_t           largestFree;
+  int64_t           largestRun;    // Adjacent free & pending blocks
+  int64_t           run;
+  int64_t           minimum;       // Blocks of the minimum size
+  int64_t           overhead;      // Markers
+  int               width;
+  double           *heat;          // Allocated bytes per heatmap cell
+};
+
+int bucket(int64_t size) {
+  int b = 0;
+  while((size >>= 1) && (b < BUCKETS - 1)) b++;
+  return b;
+}
+
+void histogram_add(struct histogram *h, int64_t size) {
+  h->count[bucket(size)]++;
+  h->bytes[bucket(size)] += size;
+  h->total++;
+  h->totalBytes += size;
+}
+
+// Spreads the allocated bytes of a block over the cells it covers
+void heat_add(struct report *r, int64_t start, int64_t end) {
+  double  cell  = (double)r->mediumSize / r->width;
+  int     first = start / cell;
+  int     last  = (end - 1) / cell;
+  int     i;
+  double  lo, hi;
+  for(i = first; (i <= last) && (i < r->width); i++) {
+    lo = (i * cell) > start ? (i * cell) : start;
+    hi = ((i + 1) * cell) < end ? ((i + 1) * cell) : end;
+    r->heat[i] += hi - lo;
+  }
+}
+
+int collect(void *udata, const struct pamu_block *block) {
+  struct report *r = udata;
+  r->overhead += 2 * PAMU_T_MARKER_SIZE;
+
+  if (!block->flags) {
+    histogram_add(&r->allocated, block->size);
+    if (block->size == 2 * PAMU_T_POINTER_SIZE) r->minimum++;
+    heat_add(r, block->addr, block->addr + block->size + (2 * PAMU_T_MARKER_SIZE));
+    r->run = 0;
+    return 0;
+  }
+
+  // Free space, pending blocks aren't coalesced nor linked yet
+  r->run += block->size + (2 * PAMU_T_MARKER_SIZE);
+  if (r->run > r->largestRun) r->largestRun = r->run;
+  if (block->flags & PAMU_BLOCK_PENDING) {
+    r->pending++;
+    r->pendingBytes += block->size;
+    return 0;
+  }
+  histogram_add(&r->free, block->size);
+  if (block->size > r->largestFree) r->largestFree = block->size;
+  r->listLength++;
+  if (block->nextFree) {
+    if (block->nextFree < block->addr) r->listBackward++;
+    r->listJumps += llabs(block->nextFree - block->addr);
+  }
+  return 0;
+}
+
+void print_histogram(const char *name, struct histogram *h) {
+  int b;
+  printf("%s blocks: %lld, %lld bytes\n", name, (long long)h->total, (long long)h->totalBytes);
+  for(b = 0; b < BUCKETS; b++) {
+    if (!h->count[b]) continue;
+    printf("  %12lld - %12lld : %10lld blocks %14lld bytes\n",
+      (long long)((uint64_t)1 << b), (long long)(((uint64_t)1 << (b + 1)) - 1), (long long)h->count[b], (long long)h->bytes[b]);
+  }
+}
+
+void print_text(struct report *r, int64_t blocks) {
+  int    i;
+  double cell = (double)r->mediumSize / r->width;
+  printf("Medium size: %lld bytes, %lld blocks\n\n", (long long)r->mediumSize, (long long)blocks);
+  print_histogram("Allocated", &r->allocated);
+  printf("\n");
+  print_histogram("Free", &r->free);
+  printf("\n");
+  printf("Pending frees:     %lld blocks, %lld bytes\n", (long long)r->pending, (long long)r->pendingBytes);
+  printf("Free list:         %lld blocks, %lld backward links, %lld bytes average jump\n",
+    (long long)r->listLength, (long long)r->listBackward,
+    (long long)(r->listLength > 1 ? r->listJumps / (r->listLength - 1) : 0));
+  printf("Largest free:      %lld bytes in one block, %lld bytes contiguous\n", (long long)r->largestFree, (long long)r->largestRun);
+  printf("Minimum-size:      %lld blocks of %d bytes\n", (long long)r->minimum, (int)(2 * PAMU_T_POINTER_SIZE));
+  printf("Marker overhead:   %lld bytes\n\n", (long long)r->overhead);
+  printf("Occupancy, %d cells of %.0f bytes:\n|", r->width, cell);
+  int shade, shades = strlen(SHADES) - 1;
+  for(i = 0; i < r->width; i++) {
+    shade = (r->heat[i] / cell) * shades + 0.5;
+    putchar(SHADES[shade > shades ? shades : shade]);
+  }
+  printf("|\n");
+}
+
+void print_histogram_json(const char *name, struct histogram *h) {
+  int b, first = 1;
+  printf("  \"%s\": { \"count\": %lld, \"bytes\": %lld, \"histogram\": [", name, (long long)h->total, (long long)h->totalBytes);
+  for(b = 0; b < BUCKETS; b++) {
+    if (!h->count[b]) continue;
+    printf("%s{ \"min\": %lld, \"count\": %lld, \"bytes\": %lld }", first ? "" : ", ", (long long)((uint64_t)1 << b), (long long)h->count[b], (long long)h->bytes[b]);
+    first = 0;
+  }
+  printf("] },\n");
+}
+
+void print_json(struct report *r, int64_t blocks) {
+  int    i;
+  double cell = (double)r->mediumSize / r->width;
+  printf("{\n");
+  printf("  \"size\": %lld,\n  \"blocks\": %lld,\n", (long long)r->mediumSize, (long long)blocks);
+  print_histogram_json("allocated", &r->allocated);
+  print_histogram_json("free", &r->free);
+  printf("  \"pending\": { \"count\": %lld, \"bytes\": %lld },\n", (long long)r->pending, (long long)r->pendingBytes);
+  printf("  \"freeList\": { \"length\": %lld, \"backward\": %lld, \"jumps\": %lld },\n",
+    (long long)r->listLength, (long long)r->listBackward, (long long)r->listJumps);
+  printf("  \"largestFree\": %lld,\n  \"largestRun\": %lld,\n", (long long)r->largestFree, (long long)r->largestRun);
+  printf("  \"minimum\": { \"count\": %lld, \"size\": %d },\n", (long long)r->minimum, (int)(2 * PAMU_T_POINTER_SIZE));
+  printf("  \"overhead\": %lld,\n", (long long)r->overhead);
+  printf("  \"heatmap\": { \"cell\": %.0f, \"occupancy\": [", cell);
+  for(i = 0; i < r->width; i++) printf("%s%.3f", i ? ", " : "", r->heat[i] / cell);
+  printf("] }\n}\n");
+}
+
+void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-j] [-w width] <medium>\n", name);
+  fprintf(stderr, "  -j        Output JSON instead of text\n");
+  fprintf(stderr, "  -w width  Cells in the occupancy heatmap (default 64)\n");
+}
+
+int main(int argc, char **argv) {
+  struct report r;
+  int json = 0, opt;
+  memset(&r, 0, sizeof(r));
+  r.width = 64;
+
+  while((opt = getopt(argc, argv, "jw:h")) != -1) {
+    switch(opt) {
+      case 'j': json = 1; break;
+      case 'w': r.width = atoi(optarg); break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+  if ((optind != argc - 1) || (r.width < 1)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // Read-only, the medium may be in use
+  int fd = open(argv[optind], O_RDONLY);
+  if (fd < 0) {
+    perror(argv[optind]);
+    return 1;
+  }
+  r.mediumSize = lseek(fd, 0, SEEK_END);
+  r.heat       = calloc(r.width, sizeof(double));
+  if (r.mediumSize <= 0) {
+    fprintf(stderr, "%s: empty medium\n", argv[optind]);
+    return 1;
+  }
+
+  int64_t blocks = pamu_scan(fd, collect, &r);
+  close(fd);
+  if (blocks < 0) {
+    fprintf(stderr, "%s: scan failed (%lld)\n", argv[optind], (long long)blocks);
+    return 1;
+  }
+
+  if (json) {
+    print_json(&r, blocks);
+  } else {
+    print_text(&r, blocks);
+  }
+  free(r.heat);
+  return 0;
+}